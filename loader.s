@@ -2,24 +2,90 @@ global loader
 extern kmain
 
 MAGIC_NUMBER equ 0x1BADB002
-FLAGS        equ 0x0
-CHECKSUM     equ -MAGIC_NUMBER
+ALIGN_MODULES equ 0x1         ; Load modules on page boundaries
+MEMINFO      equ 0x2          ; Provide memory map
+FLAGS        equ ALIGN_MODULES | MEMINFO
+CHECKSUM     equ -(MAGIC_NUMBER + FLAGS)
 KERNEL_STACK_SIZE equ 4096
 
+; Must match vmm.h. The boot directory maps the direct map, all of the low
+; 512 MiB, at KERNEL_BASE with 4 MiB pages, and the first 4 MiB at 0 too so
+; the code keeps running while paging turns on. vmm_init replaces it.
+KERNEL_BASE     equ 0xC0000000
+KERNEL_PDE      equ KERNEL_BASE >> 22
+DIRECT_MAP_PDES equ 128
+PDE_LARGE       equ 0x83          ; Present, writable, 4 MiB
+CR4_PSE         equ 0x00000010
+CR0_PG          equ 0x80000000
+
 section .multiboot
 align 4
     dd MAGIC_NUMBER
     dd FLAGS
     dd CHECKSUM
 
+; Flat code and data segments at the selectors idt.c and interrupt.s use.
+; The bootloader's GDT sits in low memory, which is not mapped after vmm_init.
+section .data
+align 8
+gdt:
+    dq 0
+    dq 0x00CF9A000000FFFF   ; 0x08 code
+    dq 0x00CF92000000FFFF   ; 0x10 data
+gdt_end:
+gdt_descriptor:
+    dw gdt_end - gdt - 1
+    dd gdt
+
 section .bss
+align 4096
+boot_page_directory:
+    resb 4096
 align 4
 kernel_stack:
     resb KERNEL_STACK_SIZE
 
 section .text
-loader:
+; The bootloader jumps here with paging off, so the entry point is the load
+; address and everything up to the jump uses physical addresses
+loader equ _loader - KERNEL_BASE
+
+_loader:
+    mov edi, boot_page_directory - KERNEL_BASE
+    mov eax, PDE_LARGE
+    xor ecx, ecx
+.map:
+    mov [edi + ecx * 4 + KERNEL_PDE * 4], eax
+    add eax, 0x400000
+    inc ecx
+    cmp ecx, DIRECT_MAP_PDES
+    jne .map
+    mov dword [edi], PDE_LARGE
+
+    mov eax, cr4
+    or eax, CR4_PSE
+    mov cr4, eax
+    mov cr3, edi
+    mov eax, cr0
+    or eax, CR0_PG
+    mov cr0, eax
+
+    lea eax, [.higher_half]
+    jmp eax
+
+.higher_half:
+    lgdt [gdt_descriptor]
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov ss, ax
+    jmp 0x08:.segments_loaded
+
+.segments_loaded:
     mov esp, kernel_stack + KERNEL_STACK_SIZE
+    add ebx, KERNEL_BASE
     push ebx    ; Push multiboot info pointer
     call kmain
 .loop:
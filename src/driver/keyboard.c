@@ -53,6 +53,10 @@ void keyboard_init_irq(void) {
     register_interrupt_handler(33, &keyboard_irq_handler);
 }
 
+int keyboard_has_input(void) {
+    return buffer_read != buffer_write;
+}
+
 char keyboard_getchar(void) {
     while (buffer_read == buffer_write) {
         __asm__ __volatile__("hlt");
@@ -0,0 +1,124 @@
+#include "ramdisk.h"
+#include "kheap.h"
+#include "pmm.h"
+#include "vmm.h"
+#include <stddef.h>
+#include <string.h>
+
+// A single RAM disk, since DiskOps callbacks carry no context. The disk is a
+// list of pages holding eight sectors each. An image disk points the pages at
+// a boot module, a blank disk allocates them from the PMM one by one, so it
+// needs no contiguous memory.
+
+#define SECTORS_PER_PAGE (PAGE_SIZE / RAMDISK_SECTOR_SIZE)
+
+static uint8_t** pages;
+static uint32_t sector_count;
+
+static uint8_t* sector_addr(uint32_t sect) {
+    return pages[sect / SECTORS_PER_PAGE] + (sect % SECTORS_PER_PAGE) * RAMDISK_SECTOR_SIZE;
+}
+
+static bool ramdisk_read(uint8_t* buf, uint32_t sect) {
+    if (sect >= sector_count) {
+        return false;
+    }
+    memcpy(buf, sector_addr(sect), RAMDISK_SECTOR_SIZE);
+    return true;
+}
+
+static bool ramdisk_write(const uint8_t* buf, uint32_t sect) {
+    if (sect >= sector_count) {
+        return false;
+    }
+    memcpy(sector_addr(sect), buf, RAMDISK_SECTOR_SIZE);
+    return true;
+}
+
+// Copies up to a page at a time, pages are not contiguous
+static bool ramdisk_read_multi(uint8_t* buf, uint32_t sect, uint32_t cnt) {
+    if (sect >= sector_count || cnt > sector_count - sect) {
+        return false;
+    }
+
+    while (cnt > 0) {
+        uint32_t n = SECTORS_PER_PAGE - sect % SECTORS_PER_PAGE;
+        if (n > cnt) {
+            n = cnt;
+        }
+        memcpy(buf, sector_addr(sect), n * RAMDISK_SECTOR_SIZE);
+        buf += n * RAMDISK_SECTOR_SIZE;
+        sect += n;
+        cnt -= n;
+    }
+    return true;
+}
+
+// Uses a page-aligned boot module as the disk contents, in place. A trailing
+// partial sector is ignored.
+int ramdisk_init_image(uint32_t start, uint32_t end) {
+    if (pages != NULL || end <= start || (start & (PAGE_SIZE - 1))) {
+        return -1;
+    }
+
+    uint32_t sectors = (end - start) / RAMDISK_SECTOR_SIZE;
+    uint32_t page_count = (sectors + SECTORS_PER_PAGE - 1) / SECTORS_PER_PAGE;
+    if (sectors == 0) {
+        return -1;
+    }
+
+    pages = kmalloc(page_count * sizeof(uint8_t*));
+    if (pages == NULL) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < page_count; i++) {
+        pages[i] = (uint8_t*)(start + i * PAGE_SIZE);
+    }
+
+    sector_count = sectors;
+    return 0;
+}
+
+// Creates a zero-filled disk of the given size from PMM frames
+int ramdisk_init_blank(uint32_t sectors) {
+    if (pages != NULL || sectors == 0) {
+        return -1;
+    }
+
+    uint32_t page_count = (sectors + SECTORS_PER_PAGE - 1) / SECTORS_PER_PAGE;
+    if (page_count > pmm_get_free_frames()) {
+        return -1;
+    }
+
+    pages = kmalloc(page_count * sizeof(uint8_t*));
+    if (pages == NULL) {
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < page_count; i++) {
+        void* frame = pmm_alloc_frame();
+        if (frame == NULL) {
+            while (i-- > 0) {
+                pmm_free_frame((void*)VIRT_TO_PHYS(pages[i]));
+            }
+            kfree(pages);
+            pages = NULL;
+            return -1;
+        }
+        pages[i] = PHYS_TO_VIRT(frame);
+        memset(pages[i], 0, PAGE_SIZE);
+    }
+
+    sector_count = sectors;
+    return 0;
+}
+
+uint32_t ramdisk_sectors(void) {
+    return sector_count;
+}
+
+void ramdisk_get_ops(DiskOps* ops) {
+    ops->read = ramdisk_read;
+    ops->write = ramdisk_write;
+    ops->read_multi = ramdisk_read_multi;
+}
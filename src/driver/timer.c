@@ -3,6 +3,7 @@
 #include "io.h"
 
 static volatile uint32_t tick_count = 0;
+static uint32_t tick_frequency = 1;
 
 static void timer_callback(registers_t* regs) {
     (void)regs;
@@ -11,6 +12,7 @@ static void timer_callback(registers_t* regs) {
 
 void timer_init(uint32_t frequency) {
     register_interrupt_handler(32, &timer_callback);
+    tick_frequency = frequency;
     
     uint32_t divisor = 1193180 / frequency;
     
@@ -27,6 +29,11 @@ uint32_t timer_get_ticks(void) {
     return tick_count;
 }
 
+// Split so ticks * 1000 cannot overflow on long uptimes
+uint32_t timer_ticks_to_ms(uint32_t ticks) {
+    return ticks / tick_frequency * 1000 + ticks % tick_frequency * 1000 / tick_frequency;
+}
+
 void timer_wait(uint32_t ticks) {
     uint32_t target = tick_count + ticks;
     while (tick_count < target) {
@@ -1,17 +1,23 @@
 #include "tty.h"
 #include "io.h"
 #include "serial.h"
+#include "vmm.h"
 #include <string.h>
 
 #define VGA_ADDRESS 0xB8000
 #define VGA_WIDTH 80
 #define VGA_HEIGHT 25
+#define VGA_WINDOW 0xFF000000 // Write-combining mapping of the text buffer
 
 static unsigned int terminal_row;
 static unsigned int terminal_column;
 static unsigned char terminal_color;
 static unsigned short* terminal_buffer;
 
+// Copy of the screen in RAM. The write-combining window is uncached for
+// reads, so scrolling reads from here and only writes go to the screen.
+static unsigned short terminal_shadow[VGA_WIDTH * VGA_HEIGHT] __attribute__((aligned(4)));
+
 static inline unsigned char vga_entry_color(enum vga_color fg, enum vga_color bg) {
     return fg | bg << 4;
 }
@@ -29,26 +35,42 @@ static void update_cursor(unsigned int x, unsigned int y) {
     outb(0x3D5, (unsigned char)((pos >> 8) & 0xFF));
 }
 
-static void terminal_scroll(void) {
-    for (unsigned int y = 0; y < VGA_HEIGHT - 1; y++) {
+// Copies the whole shadow to the screen, two cells per store
+static void terminal_flush(void) {
+    const unsigned int* src = (const unsigned int*) terminal_shadow;
+    volatile unsigned int* dst = (volatile unsigned int*) terminal_buffer;
+
+    for (unsigned int i = 0; i < VGA_WIDTH * VGA_HEIGHT / 2; i++) {
+        dst[i] = src[i];
+    }
+}
+
+static void terminal_fill(void) {
+    for (unsigned int y = 0; y < VGA_HEIGHT; y++) {
         for (unsigned int x = 0; x < VGA_WIDTH; x++) {
-            unsigned int dest = y * VGA_WIDTH + x;
-            unsigned int src = (y + 1) * VGA_WIDTH + x;
-            terminal_buffer[dest] = terminal_buffer[src];
+            const unsigned int index = y * VGA_WIDTH + x;
+            terminal_shadow[index] = vga_entry(' ', terminal_color);
         }
     }
+    terminal_flush();
+}
+
+static void terminal_scroll(void) {
+    memmove(terminal_shadow, terminal_shadow + VGA_WIDTH, (VGA_HEIGHT - 1) * VGA_WIDTH * 2);
     
     for (unsigned int x = 0; x < VGA_WIDTH; x++) {
         unsigned int index = (VGA_HEIGHT - 1) * VGA_WIDTH + x;
-        terminal_buffer[index] = vga_entry(' ', terminal_color);
+        terminal_shadow[index] = vga_entry(' ', terminal_color);
     }
+    terminal_flush();
     
     terminal_row = VGA_HEIGHT - 1;
 }
 
 static void terminal_putentryat(char c, unsigned char color, unsigned int x, unsigned int y) {
     const unsigned int index = y * VGA_WIDTH + x;
-    terminal_buffer[index] = vga_entry(c, color);
+    terminal_shadow[index] = vga_entry(c, color);
+    terminal_buffer[index] = terminal_shadow[index];
     serial_putchar(c);
 }
 
@@ -56,26 +78,22 @@ void terminal_initialize(void) {
     terminal_row = 0;
     terminal_column = 0;
     terminal_color = vga_entry_color(VGA_COLOR_WHITE, VGA_COLOR_BLACK);
-    terminal_buffer = (unsigned short*) VGA_ADDRESS;
-    
-    for (unsigned int y = 0; y < VGA_HEIGHT; y++) {
-        for (unsigned int x = 0; x < VGA_WIDTH; x++) {
-            const unsigned int index = y * VGA_WIDTH + x;
-            terminal_buffer[index] = vga_entry(' ', terminal_color);
-        }
-    }
+    terminal_buffer = (unsigned short*) PHYS_TO_VIRT(VGA_ADDRESS);
+    terminal_fill();
+}
+
+// Moves the terminal to a write-combining mapping of the text buffer, so
+// runs of character writes go out as bursts. Needs paging.
+void terminal_map_buffer(void) {
+    vmm_map_range(vmm_get_kernel_directory(), VGA_WINDOW, VGA_ADDRESS, VGA_WIDTH * VGA_HEIGHT * 2,
+                  PAGE_PRESENT | PAGE_RW | PAGE_WC);
+    terminal_buffer = (unsigned short*) VGA_WINDOW;
 }
 
 void terminal_clear(void) {
     terminal_row = 0;
     terminal_column = 0;
-    
-    for (unsigned int y = 0; y < VGA_HEIGHT; y++) {
-        for (unsigned int x = 0; x < VGA_WIDTH; x++) {
-            const unsigned int index = y * VGA_WIDTH + x;
-            terminal_buffer[index] = vga_entry(' ', terminal_color);
-        }
-    }
+    terminal_fill();
     
     update_cursor(terminal_column, terminal_row);
 }
@@ -2,6 +2,8 @@
 // Copyright (c) 2025, Bjørn Brodtkorb. All rights reserved.
 
 #include "fat.h"
+#include "fat_mmap.h"
+#include "pagecache.h"
 #include <string.h>
 
 #define LIMIT(a, b) ((a) < (b) ? (a) : (b))
@@ -23,6 +25,10 @@
 #define SFN_LAST  0x00
 #define SFN_PAD   0x20
 
+#define FAT1_CLEAN  0x08000000 // Clean shutdown bit in reserved entry 1
+
+#define SCAN_SECTS  32 // FAT sectors fetched per bulk read during mount
+
 enum
 {
   FAT_BUF_DIRTY  = 0x01,
@@ -144,6 +150,8 @@ static uint8_t g_buf[512];
 static uint16_t g_len;
 static uint8_t g_crc;
 
+static uint8_t g_scan_buf[512 * SCAN_SECTS];
+
 //------------------------------------------------------------------------------
 static char to_upper(char c)
 {
@@ -204,6 +212,15 @@ static void encode_timestamp(uint16_t* date, uint16_t* time)
   *time = ((ts.sec / 2) & 0x1f) | (ts.min & 0x3f) << 5 | (ts.hour & 0x1f) << 11;
 }
 
+//------------------------------------------------------------------------------
+static int popcount(uint32_t v)
+{
+  v = v - ((v >> 1) & 0x55555555);
+  v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
+  v = (v + (v >> 4)) & 0x0f0f0f0f;
+  return (v * 0x01010101) >> 24;
+}
+
 //------------------------------------------------------------------------------
 static Fat* find_fat_volume(const char* name, int len)
 {
@@ -228,6 +245,20 @@ static uint32_t clust_to_sect(Fat* fat, uint32_t clust)
   return ((clust - 2) << fat->clust_shift) + fat->data_sect;
 }
 
+//------------------------------------------------------------------------------
+static int read_sects(DiskOps* ops, uint8_t* buf, uint32_t sect, uint32_t cnt)
+{
+  if (ops->read_multi)
+    return ops->read_multi(buf, sect, cnt) ? FAT_ERR_NONE : FAT_ERR_IO;
+
+  for (uint32_t i = 0; i < cnt; i++)
+  {
+    if (!ops->read(buf + 512 * i, sect + i))
+      return FAT_ERR_IO;
+  }
+  return FAT_ERR_NONE;
+}
+
 //------------------------------------------------------------------------------
 static int sync_buf(Fat* fat)
 {
@@ -350,6 +381,103 @@ static int put_fat(Fat* fat, uint32_t clust, uint32_t val)
   return put_fat2(fat, fat->fat_sect[0], clust, val);
 }
 
+//------------------------------------------------------------------------------
+// The clean bit in FAT entry 1 is cleared while the volume is mounted, so a
+// missing umount is detected on the next mount.
+
+static int set_clean(Fat* fat, bool clean)
+{
+  uint32_t* items = (uint32_t*)fat->buf;
+
+  int err = update_buf(fat, fat->fat_sect[0]);
+  if (err)
+    return err;
+
+  uint32_t val = items[1];
+  val = clean ? (val | FAT1_CLEAN) : (val & ~FAT1_CLEAN);
+
+  err = put_fat(fat, 1, val);
+  if (err)
+    return err;
+
+  return sync_buf(fat);
+}
+
+//------------------------------------------------------------------------------
+// Returns a mask with bit i set when entry i of the 32 entries is free. Fully 
+// free groups are detected with a single OR-reduction.
+
+static uint32_t free_mask(const uint32_t* items)
+{
+  uint32_t any = 0;
+  for (int i = 0; i < 32; i++)
+    any |= items[i];
+
+  if ((any & 0x0fffffff) == 0)
+    return 0xffffffff;
+
+  uint32_t msk = 0;
+  for (int i = 0; i < 32; i++)
+    msk |= (uint32_t)((items[i] & 0x0fffffff) == 0) << i;
+
+  return msk;
+}
+
+//------------------------------------------------------------------------------
+// Rebuilds the free cluster count and allocation hint from the active FAT. The
+// table is read in chunks of SCAN_SECTS sectors and counted 32 entries at a time.
+
+static int scan_fat(Fat* fat)
+{
+  uint32_t free_cnt = 0;
+  uint32_t first_free = 0;
+  uint32_t clust = 0;
+  uint32_t sect = fat->fat_sect[0];
+  uint32_t end = sect + (fat->clust_cnt + 127) / 128;
+
+  while (sect < end)
+  {
+    uint32_t cnt = LIMIT(end - sect, SCAN_SECTS);
+    int err = read_sects(&fat->ops, g_scan_buf, sect, cnt);
+    if (err)
+      return err;
+
+    uint32_t* items = (uint32_t*)g_scan_buf;
+
+    for (uint32_t i = 0; i < cnt * 128; i += 32, clust += 32)
+    {
+      if (clust >= fat->clust_cnt)
+        break;
+
+      uint32_t msk = free_mask(items + i);
+
+      if (clust == 0)
+        msk &= ~0x3u; // Entry 0 and 1 are reserved
+
+      if (fat->clust_cnt - clust < 32)
+        msk &= (1u << (fat->clust_cnt - clust)) - 1;
+
+      if (msk && !first_free)
+        first_free = clust + __builtin_ctz(msk);
+
+      free_cnt += popcount(msk);
+    }
+
+    sect += cnt;
+  }
+
+  // The allocator starts searching after last_used
+  if (first_free > 2)
+    fat->last_used = first_free - 1;
+  else if (first_free == 2)
+    fat->last_used = fat->clust_cnt - 1;
+  else
+    fat->last_used = 2;
+
+  fat->free_cnt = free_cnt;
+  return FAT_ERR_NONE;
+}
+
 //------------------------------------------------------------------------------
 static int remove_chain(Fat* fat, uint32_t clust)
 {
@@ -452,6 +580,92 @@ static int create_chain(Fat* fat, uint32_t* out_clust)
   return stretch_chain(fat, 0, out_clust);
 }
 
+//------------------------------------------------------------------------------
+// Counts the clusters and extents (runs of consecutive clusters) of a chain.
+
+static int chain_extents(Fat* fat, uint32_t clust, uint32_t* out_clusts, uint32_t* out_exts)
+{
+  uint32_t clusts = 0;
+  uint32_t exts = 0;
+  uint32_t prev = 0;
+
+  while (clust)
+  {
+    uint32_t next;
+    uint8_t flags;
+    int err = get_fat(fat, clust, &next, &flags);
+    if (err)
+      return err;
+
+    if (flags & (CLUST_BAD | CLUST_FREE))
+      return FAT_ERR_BROKEN;
+
+    if (clust != prev + 1)
+      exts++;
+
+    clusts++;
+    prev = clust;
+    clust = (flags & CLUST_LAST) ? 0 : next;
+  }
+
+  *out_clusts = clusts;
+  *out_exts = exts;
+  return FAT_ERR_NONE;
+}
+
+//------------------------------------------------------------------------------
+// First fit search for cnt consecutive free clusters.
+
+static int find_free_run(Fat* fat, uint32_t cnt, uint32_t* out_clust)
+{
+  uint32_t run = 0;
+
+  for (uint32_t clust = 2; clust < fat->clust_cnt; clust++)
+  {
+    uint32_t val;
+    uint8_t flags;
+    int err = get_fat(fat, clust, &val, &flags);
+    if (err)
+      return err;
+
+    run = (flags & CLUST_FREE) ? run + 1 : 0;
+
+    if (run == cnt)
+    {
+      *out_clust = clust + 1 - cnt;
+      return FAT_ERR_NONE;
+    }
+  }
+
+  return FAT_ERR_FULL;
+}
+
+//------------------------------------------------------------------------------
+// Copies the data of cluster src to cluster dst. Bypasses the FAT buffer.
+
+static int copy_clust(Fat* fat, uint32_t dst, uint32_t src)
+{
+  uint32_t sects = 1 << fat->clust_shift;
+  uint32_t from = clust_to_sect(fat, src);
+  uint32_t to = clust_to_sect(fat, dst);
+
+  for (uint32_t i = 0; i < sects; i += SCAN_SECTS)
+  {
+    uint32_t cnt = LIMIT(sects - i, SCAN_SECTS);
+    int err = read_sects(&fat->ops, g_scan_buf, from + i, cnt);
+    if (err)
+      return err;
+
+    for (uint32_t j = 0; j < cnt; j++)
+    {
+      if (!fat->ops.write(g_scan_buf + 512 * j, to + i + j))
+        return FAT_ERR_IO;
+    }
+  }
+
+  return FAT_ERR_NONE;
+}
+
 //------------------------------------------------------------------------------
 static int clust_clear(Fat* fat, uint32_t clust)
 {
@@ -583,6 +797,13 @@ static uint32_t sfn_cluster(Sfn* sfn)
   return sfn->clust_hi << 16 | sfn->clust_lo;
 }
 
+//------------------------------------------------------------------------------
+static void sfn_set_cluster(Sfn* sfn, uint32_t clust)
+{
+  sfn->clust_hi = clust >> 16;
+  sfn->clust_lo = clust & 0xffff;
+}
+
 //------------------------------------------------------------------------------
 // Only certain characters are allowed in an SFN file name. Invalid characters 
 // are converted to underscore. It does not follow Windows' algorithm, using
@@ -863,6 +1084,45 @@ static int remove_entries(Dir* dir, Loc* loc)
   }
 }
 
+//------------------------------------------------------------------------------
+// Points the .. entry of every subdirectory of the directory at clust back to it.
+// Used after the directory has been moved.
+
+static int dir_reparent(Fat* fat, uint32_t clust)
+{
+  Dir dir;
+  dir.fat = fat;
+  dir_enter(&dir, clust);
+
+  for (int err = 0;; err = dir_next(&dir))
+  {
+    if (err)
+      return err == FAT_ERR_EOF ? FAT_ERR_NONE : err;
+
+    err = update_buf(fat, dir.sect);
+    if (err)
+      return err;
+
+    Sfn* sfn = dir_ptr(&dir);
+
+    if (sfn_is_last(sfn))
+      return FAT_ERR_NONE;
+
+    if (sfn_is_free(sfn) || sfn_is_lfn(sfn) || sfn->name[0] == '.' ||
+        0 == (sfn->attr & FAT_ATTR_DIR))
+      continue;
+
+    err = update_buf(fat, clust_to_sect(fat, sfn_cluster(sfn)));
+    if (err)
+      return err;
+
+    // Cluster is zero for .. entries pointing to root
+    Sfn* dots = (Sfn*)fat->buf;
+    sfn_set_cluster(&dots[1], clust == fat->root_clust ? 0 : clust);
+    fat->flags |= FAT_BUF_DIRTY;
+  }
+}
+
 //------------------------------------------------------------------------------
 static int dir_add(Dir* dir, const char* name, int len, uint8_t attr, uint32_t clust)
 {
@@ -1021,9 +1281,13 @@ static bool check_fat(uint8_t* buf)
   if (!(bpb->ext_flags & EXT_FLAG_MIRROR) && (bpb->ext_flags & EXT_FLAG_ACT) > 1)
     return false;
   
-  // FAT type is determined from the count of clusters
-  uint32_t sect_cnt = bpb->sect_cnt_32 - (bpb->res_sect_cnt + bpb->fat_cnt * bpb->sect_per_fat_32);
-  return sect_cnt/ bpb->sect_per_clust >= 65525;
+  // A zero 16-bit FAT size marks FAT32. The cluster count is not required to
+  // reach 65525, so small volumes such as RAM disks can still be FAT32.
+  uint32_t meta = bpb->res_sect_cnt + bpb->fat_cnt * bpb->sect_per_fat_32;
+  if (bpb->sect_per_clust == 0 || (bpb->sect_per_clust & (bpb->sect_per_clust - 1)))
+    return false;
+
+  return bpb->sect_cnt_32 > meta && (bpb->sect_cnt_32 - meta) / bpb->sect_per_clust >= 2;
 }
 
 //------------------------------------------------------------------------------
@@ -1061,11 +1325,105 @@ int fat_probe(DiskOps* ops, int partition)
   return probe(ops, partition, &lba);
 }
 
+//------------------------------------------------------------------------------
+static bool write_zeros(DiskOps* ops, uint32_t sect, uint32_t cnt)
+{
+  memset(g_buf, 0, sizeof(g_buf));
+  for (uint32_t i = 0; i < cnt; i++)
+  {
+    if (!ops->write(g_buf, sect + i))
+      return false;
+  }
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Writes an empty FAT32 file system covering sect_cnt sectors of the drive,
+// without a partition table. The label is at most 11 characters. Volumes up
+// to 260 MiB use one sector per cluster, larger ones use 4 KiB clusters.
+
+int fat_format(DiskOps* ops, uint32_t sect_cnt, const char* label)
+{
+  uint32_t res_cnt = 32;
+  uint32_t spc = sect_cnt <= 532480 ? 1 : 8;
+
+  if (sect_cnt < 128)
+    return FAT_ERR_PARAM;
+
+  // Sized for every sector past the reserved area being data, which is
+  // slightly more than needed
+  uint32_t fat_size = ((sect_cnt - res_cnt) / spc + 2 + 127) / 128;
+  uint32_t data_sect = res_cnt + 2 * fat_size;
+  if (data_sect + 2 * spc > sect_cnt)
+    return FAT_ERR_PARAM;
+
+  uint32_t clust_cnt = (sect_cnt - data_sect) / spc;
+
+  // Reserved sectors, both FATs and the root directory cluster
+  if (!write_zeros(ops, 0, data_sect + spc))
+    return FAT_ERR_IO;
+
+  // Boot sector and its backup
+  Bpb* bpb = (Bpb*)g_buf;
+  memcpy(bpb->jump, "\xeb\x58\x90", 3);
+  memcpy(bpb->name, "BEANEROS", 8);
+  bpb->bytes_per_sect = 512;
+  bpb->sect_per_clust = spc;
+  bpb->res_sect_cnt = res_cnt;
+  bpb->fat_cnt = 2;
+  bpb->media = 0xf8;
+  bpb->sect_per_track = 32;
+  bpb->head_cnt = 64;
+  bpb->sect_cnt_32 = sect_cnt;
+  bpb->sect_per_fat_32 = fat_size;
+  bpb->root_cluster = 2;
+  bpb->info_sect = 1;
+  bpb->copy_bpb_sector = 6;
+  bpb->drive_num = 0x80;
+  bpb->boot_sig = 0x29;
+  bpb->volume_id = sect_cnt ^ 0x42454e52;
+  memset(bpb->volume_label, ' ', 11);
+  memcpy(bpb->volume_label, label, LIMIT(strlen(label), 11));
+  memcpy(bpb->fs_type, "FAT32   ", 8);
+  bpb->sign[0] = 0x55;
+  bpb->sign[1] = 0xaa;
+
+  if (!ops->write(g_buf, 0) || !ops->write(g_buf, 6))
+    return FAT_ERR_IO;
+
+  // FsInfo and its backup. The root directory uses cluster 2.
+  memset(g_buf, 0, sizeof(g_buf));
+  FsInfo* info = (FsInfo*)g_buf;
+  info->head_sig = FSINFO_HEAD_SIG;
+  info->struct_sig = FSINFO_STRUCT_SIG;
+  info->free_cnt = clust_cnt - 1;
+  info->next_free = 3;
+  info->tail_sig = FSINFO_TAIL_SIG;
+
+  if (!ops->write(g_buf, 1) || !ops->write(g_buf, 7))
+    return FAT_ERR_IO;
+
+  // Reserved entries, with the clean bit set, and the end of the root chain
+  memset(g_buf, 0, sizeof(g_buf));
+  uint32_t* fat = (uint32_t*)g_buf;
+  fat[0] = 0x0ffffff8;
+  fat[1] = 0x0fffffff;
+  fat[2] = 0x0fffffff;
+
+  if (!ops->write(g_buf, res_cnt) || !ops->write(g_buf, res_cnt + fat_size))
+    return FAT_ERR_IO;
+
+  return FAT_ERR_NONE;
+}
+
 //------------------------------------------------------------------------------
 // Mounts a file system. The name specifies which path is used to access it.
 // For example: mounting using 'mnt', and accessing using '/mnt/path/file.txt'.
 // Partition 0 referes to either the entire disk (absense of MBR), or to the 
 // specified MBR partition.
+//
+// The free cluster count and allocation hint in FsInfo are rebuilt from the FAT
+// when FsInfo is invalid or the volume was not cleanly unmounted.
 
 int fat_mount(DiskOps* ops, int partition, Fat* fat, const char* name)
 {
@@ -1082,30 +1440,19 @@ int fat_mount(DiskOps* ops, int partition, Fat* fat, const char* name)
 
   uint32_t fat_0 = lba + bpb->res_sect_cnt;
   uint32_t fat_1 = lba + bpb->res_sect_cnt + bpb->sect_per_fat_32;
+  uint32_t data_sect = bpb->res_sect_cnt + bpb->fat_cnt * bpb->sect_per_fat_32;
+
+  // Entries past the last data cluster only pad the FAT and must not be used
+  uint32_t clust_cnt = (bpb->sect_cnt_32 - data_sect) / bpb->sect_per_clust + 2;
   
   fat->clust_shift = __builtin_ctz(bpb->sect_per_clust);
   fat->clust_msk = bpb->sect_per_clust - 1;
-  fat->clust_cnt = bpb->sect_per_fat_32 * 128;
+  fat->clust_cnt = LIMIT(clust_cnt, bpb->sect_per_fat_32 * 128);
   fat->root_clust = bpb->root_cluster;
   fat->fat_sect[0] = use_first ? fat_0 : fat_1;
   fat->fat_sect[1] = mirror ? (use_first ? fat_1 : fat_0) : 0;
   fat->info_sect = lba + bpb->info_sect;
-  fat->data_sect = lba + bpb->res_sect_cnt + bpb->fat_cnt * bpb->sect_per_fat_32;
-
-  // Load FsInfo
-  if (!ops->read(g_buf, fat->info_sect))
-    return FAT_ERR_IO;
-
-  FsInfo* info = (FsInfo*)g_buf;
-  if (info->tail_sig != FSINFO_TAIL_SIG || 
-      info->head_sig != FSINFO_HEAD_SIG ||
-      info->struct_sig != FSINFO_STRUCT_SIG ||
-      info->next_free == 0xffffffff || 
-      info->free_cnt == 0xffffffff)
-    return FAT_ERR_NOFAT;
-  
-  fat->last_used = info->next_free;
-  fat->free_cnt  = info->free_cnt;
+  fat->data_sect = lba + data_sect;
 
   int name_len = strlen(name);
   if ((size_t)name_len > sizeof(fat->name))
@@ -1114,8 +1461,58 @@ int fat_mount(DiskOps* ops, int partition, Fat* fat, const char* name)
   fat->name_len = name_len;
 
   fat->ops = *ops;
+  fat->flags = 0;
+
+  // A cleared clean bit means the volume was not unmounted
+  if (!ops->read(g_buf, fat->fat_sect[0]))
+    return FAT_ERR_IO;
+
+  bool clean = (((uint32_t*)g_buf)[1] & FAT1_CLEAN) != 0;
+
+  // Load FsInfo
+  if (!ops->read(g_buf, fat->info_sect))
+    return FAT_ERR_IO;
+
+  FsInfo* info = (FsInfo*)g_buf;
+  bool info_valid = info->tail_sig == FSINFO_TAIL_SIG &&
+    info->head_sig == FSINFO_HEAD_SIG &&
+    info->struct_sig == FSINFO_STRUCT_SIG;
+
+  // Trust FsInfo only after a clean unmount and when its values are in range
+  if (clean && info_valid &&
+      info->free_cnt <= fat->clust_cnt - 2 &&
+      info->next_free >= 2 && info->next_free < fat->clust_cnt)
+  {
+    fat->last_used = info->next_free;
+    fat->free_cnt  = info->free_cnt;
+  }
+  else
+  {
+    err = scan_fat(fat);
+    if (err)
+      return err;
+
+    // Rewrite FsInfo. The scan does not touch the global buffer.
+    if (!info_valid)
+    {
+      memset(g_buf, 0, sizeof(g_buf));
+      info->head_sig = FSINFO_HEAD_SIG;
+      info->struct_sig = FSINFO_STRUCT_SIG;
+      info->tail_sig = FSINFO_TAIL_SIG;
+    }
+    info->free_cnt = fat->free_cnt;
+    info->next_free = fat->last_used;
+
+    if (!ops->write(g_buf, fat->info_sect))
+      return FAT_ERR_IO;
+  }
+
   fat->sect = 0;   // Causes buffering on first call
 
+  err = set_clean(fat, false);
+  if (err)
+    return err;
+
   fat->next = g_fat_list;
   g_fat_list = fat;
 
@@ -1136,7 +1533,12 @@ int fat_umount(Fat* fat)
     return FAT_ERR_PARAM;
 
   *it = fat->next;
-  return sync_fs(fat);
+
+  int err = sync_fs(fat);
+  if (err)
+    return err;
+
+  return set_clean(fat, true);
 }
 
 //------------------------------------------------------------------------------
@@ -1170,29 +1572,42 @@ int fat_stat(const char* path, DirInfo* info)
 }
 
 //------------------------------------------------------------------------------
-// Unlinks (deletes) an existing file or empty directory.
+// Drops cached and mapped pages of the file whose chain starts at clust. Both
+// are keyed by (volume, start cluster), and a freed start cluster can be reused
+// by another file, so every writer of file data has to come through here.
 
-int fat_unlink(const char* path)
+static void drop_cached(Fat* fat, uint32_t clust, uint32_t offset, uint32_t len)
 {
-  Dir dir;
-  Loc loc;
-  int err = follow_path(&dir, &path, &loc);
+  if (clust != 0 && len != 0)
+  {
+    pagecache_invalidate_range(fat, clust, offset, len);
+    fat_mmap_drop(fat, clust, offset, len);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Deletes the entry dir points to, which must be a file or an empty directory.
+// loc is the first entry (LFN or SFN) belonging to it.
+
+static int unlink_entry(Dir* dir, Loc* loc)
+{
+  int err = update_buf(dir->fat, dir->sect);
   if (err)
     return err;
 
-  if (dir_at_root(&dir))
-    return FAT_ERR_DENIED;
-
-  Sfn* sfn = dir_ptr(&dir);
+  Sfn* sfn = dir_ptr(dir);
   uint32_t clust = sfn_cluster(sfn);
 
   if (sfn->attr & (FAT_ATTR_RO | FAT_ATTR_SYS | FAT_ATTR_LABEL))
     return FAT_ERR_DENIED;
 
+  if (fat_mmap_busy(dir->fat, clust))
+    return FAT_ERR_BUSY;
+
   if (sfn->attr & FAT_ATTR_DIR)
   {
     // Make sure the directory is empty
-    Dir tmp = dir;
+    Dir tmp = *dir;
     dir_enter(&tmp, sfn_cluster(sfn));
 
     err = dir_advance(&tmp, 2); // . and ..
@@ -1220,61 +1635,191 @@ int fat_unlink(const char* path)
   }
 
   // Delete clusters
-  err = remove_chain(dir.fat, clust);
+  drop_cached(dir->fat, clust, 0, PAGECACHE_ALL);
+  err = remove_chain(dir->fat, clust);
   if (err)
     return err;
 
-  err = remove_entries(&dir, &loc);
+  err = remove_entries(dir, loc);
   if (err)
     return err;
 
-  return sync_fs(dir.fat);
+  return sync_fs(dir->fat);
 }
 
 //------------------------------------------------------------------------------
-// Opens a file. The file structure contain the size and offset that can be read
-// by the user at any point. Any combination of the following flags can be used:
-//
-//  - FAT_WRITE:   open for writing
-//  - FAT_READ:    open for reading
-//  - FAT_APPEND:  place file cursor at the end of the file
-//  - FAT_TRUNC:   truncate the file
-//  - FAT_CREATE:  create file if not existing
+// Unlinks (deletes) an existing file or empty directory.
 
-int fat_file_open(File* file, const char* path, uint8_t flags)
+int fat_unlink(const char* path)
 {
   Dir dir;
-  dir.fat = 0;
-
-  int err = follow_path(&dir, &path, NULL);
-  if (err && err != FAT_ERR_EOF)
+  Loc loc;
+  int err = follow_path(&dir, &path, &loc);
+  if (err)
     return err;
-  
-  if (err == FAT_ERR_EOF) // File does not exist
+
+  if (dir_at_root(&dir))
+    return FAT_ERR_DENIED;
+
+  return unlink_entry(&dir, &loc);
+}
+
+//------------------------------------------------------------------------------
+// Counts the clusters and extents of a file or directory. An extent is a run of
+// consecutive clusters, so a contiguous file has one.
+
+int fat_extents(const char* path, uint32_t* clusts, uint32_t* exts)
+{
+  Dir dir;
+  int err = follow_path(&dir, &path, NULL);
+  if (err)
+    return err;
+
+  uint32_t clust = dir.fat->root_clust;
+
+  if (!dir_at_root(&dir))
   {
-    if (0 == (flags & FAT_CREATE))
-      return FAT_ERR_DENIED;
-    
-    int len = last_subpath_len(path);
-    if (len == 0)
-      return FAT_ERR_PATH;
+    err = update_buf(dir.fat, dir.sect);
+    if (err)
+      return err;
 
-    // Create a new file
-    uint32_t clust;
-    err = create_chain(dir.fat, &clust);
+    clust = sfn_cluster(dir_ptr(&dir));
+  }
+
+  return chain_extents(dir.fat, clust, clusts, exts);
+}
+
+//------------------------------------------------------------------------------
+// Moves the clusters of a file or directory into one run of free clusters. The
+// new chain is allocated and filled before the directory entry is switched over,
+// and the old chain is freed last, so an interruption at most leaks clusters.
+// The file must not be open.
+
+int fat_defrag(const char* path)
+{
+  Dir dir;
+  Loc loc;
+  int err = follow_path(&dir, &path, &loc);
+  if (err)
+    return err;
+
+  if (dir_at_root(&dir))
+    return FAT_ERR_DENIED;
+
+  Fat* fat = dir.fat;
+  err = update_buf(fat, dir.sect);
+  if (err)
+    return err;
+
+  Sfn* sfn = dir_ptr(&dir);
+  uint32_t old = sfn_cluster(sfn);
+  bool is_dir = (sfn->attr & FAT_ATTR_DIR) != 0;
+
+  if (fat_mmap_busy(fat, old))
+    return FAT_ERR_BUSY;
+
+  uint32_t clusts, exts;
+  err = chain_extents(fat, old, &clusts, &exts);
+  if (err)
+    return err;
+
+  if (exts <= 1)
+    return FAT_ERR_NONE;
+
+  uint32_t clust;
+  err = find_free_run(fat, clusts, &clust);
+  if (err)
+    return err;
+
+  for (uint32_t i = 0; i < clusts; i++)
+  {
+    err = put_fat(fat, clust + i, i + 1 < clusts ? clust + i + 1 : 0x0fffffff);
     if (err)
       return err;
-    
-    err = dir_add(&dir, path, len, FAT_ATTR_ARCHIVE, clust);
+  }
+
+  fat->free_cnt -= clusts;
+  fat->flags |= FAT_INFO_DIRTY;
+
+  // Data is copied around the FAT buffer. Make sure it holds nothing unwritten.
+  err = sync_fs(fat);
+  if (err)
+    return err;
+
+  uint32_t src = old;
+  for (uint32_t i = 0; i < clusts; i++)
+  {
+    err = copy_clust(fat, clust + i, src);
     if (err)
       return err;
+
+    uint32_t next;
+    uint8_t flags;
+    err = get_fat(fat, src, &next, &flags);
+    if (err)
+      return err;
+
+    src = next;
   }
 
-  Sfn* sfn = dir_ptr(&dir);
+  if (is_dir)
+  {
+    err = update_buf(fat, clust_to_sect(fat, clust));
+    if (err)
+      return err;
 
-  file->fat = dir.fat;
-  file->dir_sect = dir.sect;
-  file->dir_idx = dir.idx;
+    sfn_set_cluster((Sfn*)fat->buf, clust); // . entry
+    fat->flags |= FAT_BUF_DIRTY;
+
+    err = dir_reparent(fat, clust);
+    if (err)
+      return err;
+  }
+
+  err = update_buf(fat, dir.sect);
+  if (err)
+    return err;
+
+  sfn = dir_ptr(&dir);
+  sfn_set_cluster(sfn, clust);
+  fat->flags |= FAT_BUF_DIRTY;
+
+  drop_cached(fat, old, 0, PAGECACHE_ALL);
+  err = remove_chain(fat, old);
+  if (err)
+    return err;
+
+  fat->sect = 0; // Drop any buffered sector of the old location
+  return FAT_ERR_NONE;
+}
+
+//------------------------------------------------------------------------------
+// Creates an empty file in the directory. Dir is left pointing to its SFN.
+
+static int make_file(Dir* dir, const char* name, int len)
+{
+  uint32_t clust;
+  int err = create_chain(dir->fat, &clust);
+  if (err)
+    return err;
+
+  return dir_add(dir, name, len, FAT_ATTR_ARCHIVE, clust);
+}
+
+//------------------------------------------------------------------------------
+// Sets up file from the SFN dir points to. The sector must be in the buffer.
+
+static int open_entry(File* file, Dir* dir, uint8_t flags)
+{
+  Sfn* sfn = dir_ptr(dir);
+
+  // Mappings hold the sector list of the whole file
+  if (sfn->size && flags & FAT_TRUNC && fat_mmap_busy(dir->fat, sfn_cluster(sfn)))
+    return FAT_ERR_BUSY;
+
+  file->fat = dir->fat;
+  file->dir_sect = dir->sect;
+  file->dir_idx = dir->idx;
   file->sclust = sfn_cluster(sfn);
   file->clust = file->sclust;
   file->sect = 0xffffffff;
@@ -1285,6 +1830,7 @@ int fat_file_open(File* file, const char* path, uint8_t flags)
 
   if (file->size && flags & FAT_TRUNC)
   {
+    drop_cached(file->fat, file->sclust, 0, PAGECACHE_ALL);
     file->size = 0;
     file->flags |= FAT_MODIFIED;
   }
@@ -1292,6 +1838,58 @@ int fat_file_open(File* file, const char* path, uint8_t flags)
   return fat_file_seek(file, 0, (flags & FAT_APPEND) ? FAT_SEEK_END : FAT_SEEK_START);
 }
 
+//------------------------------------------------------------------------------
+// Opens a file. The file structure contain the size and offset that can be read
+// by the user at any point. Any combination of the following flags can be used:
+//
+//  - FAT_WRITE:   open for writing
+//  - FAT_READ:    open for reading
+//  - FAT_APPEND:  place file cursor at the end of the file
+//  - FAT_TRUNC:   truncate the file
+//  - FAT_CREATE:  create file if not existing
+
+int fat_file_open(File* file, const char* path, uint8_t flags)
+{
+  Dir dir;
+  dir.fat = 0;
+
+  int err = follow_path(&dir, &path, NULL);
+  if (err && err != FAT_ERR_EOF)
+    return err;
+  
+  if (err == FAT_ERR_EOF) // File does not exist
+  {
+    if (0 == (flags & FAT_CREATE))
+      return FAT_ERR_DENIED;
+    
+    int len = last_subpath_len(path);
+    if (len == 0)
+      return FAT_ERR_PATH;
+
+    err = make_file(&dir, path, len);
+    if (err)
+      return err;
+  }
+
+  return open_entry(file, &dir, flags);
+}
+
+//------------------------------------------------------------------------------
+// Opens the file whose SFN dir points to, as left by fat_dir_lookup or
+// fat_dir_add. No path is resolved.
+
+int fat_file_open_entry(File* file, Dir* dir, uint8_t flags)
+{
+  if (!dir->fat)
+    return FAT_ERR_PARAM;
+
+  int err = update_buf(dir->fat, dir->sect);
+  if (err)
+    return err;
+
+  return open_entry(file, dir, flags);
+}
+
 //------------------------------------------------------------------------------
 // Closes a file. Updates the directory entry if modified. Writes back the write 
 // buffer if dirty.
@@ -1304,6 +1902,46 @@ int fat_file_close(File* file)
 }
 
 //------------------------------------------------------------------------------
+// Counts how many of the sectors following the current file sector are
+// consecutive on disk, up to max.
+
+static int file_run(File* file, int max, int* out_cnt)
+{
+  Fat* fat = file->fat;
+  uint32_t clust = file->clust;
+  uint32_t sect = file->sect;
+  int cnt = 0;
+
+  while (cnt < max)
+  {
+    if (((++sect - fat->data_sect) & fat->clust_msk) == 0)
+    {
+      // Crossing into the next cluster
+      uint32_t next;
+      uint8_t flags;
+      int err = get_fat(fat, clust, &next, &flags);
+      if (err)
+        return err;
+
+      if (flags & (CLUST_BAD | CLUST_FREE))
+        return FAT_ERR_BROKEN;
+
+      if ((flags & CLUST_LAST) || next != clust + 1)
+        break;
+
+      clust = next;
+    }
+    cnt++;
+  }
+
+  *out_cnt = cnt;
+  return FAT_ERR_NONE;
+}
+
+//------------------------------------------------------------------------------
+// Whole sectors that follow the file buffer contiguously on disk are read 
+// directly into the user buffer with a single multi-sector request.
+
 int fat_file_read(File* file, void* buf, int len, int* bytes)
 {
   *bytes = 0;
@@ -1327,7 +1965,24 @@ int fat_file_read(File* file, void* buf, int len, int* bytes)
     dst += cnt;
     len -= cnt;
 
-    int err = fat_file_seek(file, cnt, FAT_SEEK_CURR);
+    int run = 0;
+    int whole = LIMIT(len, (int)(file->size - file->offset - cnt)) / 512;
+
+    if (idx + cnt == 512 && whole > 0 && file->fat->ops.read_multi)
+    {
+      int err = file_run(file, whole, &run);
+      if (err)
+        return err;
+
+      if (run && !file->fat->ops.read_multi(dst, file->sect + 1, run))
+        return FAT_ERR_IO;
+
+      *bytes += 512 * run;
+      dst += 512 * run;
+      len -= 512 * run;
+    }
+
+    int err = fat_file_seek(file, cnt + 512 * run, FAT_SEEK_CURR);
     if (err)
       return err;
   }
@@ -1353,6 +2008,7 @@ int fat_file_write(File* file, const void* buf, int len, int* bytes)
     return FAT_ERR_DENIED;
   
   file->flags |= FAT_MODIFIED | FAT_ACCESSED;
+  drop_cached(file->fat, file->sclust, file->offset, len);
 
   while (len)
   {
@@ -1414,7 +2070,7 @@ int fat_file_seek(File* file, int offset, int seek)
   uint32_t off = (uint32_t)off64;
   
   // Handle empty files (no clusters allocated)
-  if (file->sclust == 0 || file->size == 0)
+  if (file->sclust == 0)
   {
     file->offset = 0;
     file->sect = 0xffffffff;
@@ -1448,6 +2104,14 @@ int fat_file_seek(File* file, int offset, int seek)
 
     if (flags & CLUST_LAST)
     {
+      // Reading up to the end of the last cluster must not grow the chain
+      if (0 == (file->flags & FAT_WRITE) && off >= file->size)
+      {
+        file->offset = off;
+        file->sect = 0xffffffff;
+        return FAT_ERR_NONE;
+      }
+
       err = stretch_chain(file->fat, file->clust, &next);
       if (err)
         return err;
@@ -1476,6 +2140,45 @@ int fat_file_seek(File* file, int offset, int seek)
   return FAT_ERR_NONE;
 }
 
+//------------------------------------------------------------------------------
+// Stores the first sector of each of the first cnt clusters of the file. This
+// allows the file data to be read directly from the disk without going through
+// the file buffer.
+
+int fat_file_bmap(File* file, uint32_t* sects, int cnt)
+{
+  if (!file->fat)
+    return FAT_ERR_PARAM;
+
+  uint32_t clust = file->sclust;
+
+  for (int i = 0; i < cnt; i++)
+  {
+    if (clust == 0)
+      return FAT_ERR_EOF;
+
+    sects[i] = clust_to_sect(file->fat, clust);
+    if (i + 1 == cnt)
+      break;
+
+    uint32_t next;
+    uint8_t flags;
+    int err = get_fat(file->fat, clust, &next, &flags);
+    if (err)
+      return err;
+
+    if (flags & (CLUST_BAD | CLUST_FREE))
+      return FAT_ERR_BROKEN;
+
+    if (flags & CLUST_LAST)
+      return FAT_ERR_EOF;
+
+    clust = next;
+  }
+
+  return FAT_ERR_NONE;
+}
+
 //------------------------------------------------------------------------------
 // Synchronizes a file. Writes back dirty file data. Updates directory timestamp
 // when accessed. Update directory size and timestamp when modified.
@@ -1526,21 +2229,12 @@ int fat_file_sync(File* file)
 }
 
 //------------------------------------------------------------------------------
-// Creates and enter a directory. Don't know if there is any point in returning dir.
+// Creates an empty directory in the directory. Dir is left pointing to its SFN.
 
-int fat_dir_create(Dir* dir, const char* path)
+static int make_dir(Dir* dir, const char* name, int len, uint32_t* out_clust)
 {
-  int err = follow_path(dir, &path, NULL);
-  if (err != FAT_ERR_EOF)
-    return err;
-  
-  int len = last_subpath_len(path);
-  if (len == 0)
-    return FAT_ERR_PATH;
-
-  // Create a new directory
   uint32_t clust;
-  err = create_chain(dir->fat, &clust);
+  int err = create_chain(dir->fat, &clust);
   if (err)
     return err;
 
@@ -1579,7 +2273,29 @@ int fat_dir_create(Dir* dir, const char* path)
   sfn[1].clust_hi = parent >> 16;
   sfn[1].clust_lo = parent & 0xffff;
 
-  err = dir_add(dir, path, len, FAT_ATTR_DIR, clust);
+  err = dir_add(dir, name, len, FAT_ATTR_DIR, clust);
+  if (err)
+    return err;
+
+  *out_clust = clust;
+  return FAT_ERR_NONE;
+}
+
+//------------------------------------------------------------------------------
+// Creates and enter a directory. Don't know if there is any point in returning dir.
+
+int fat_dir_create(Dir* dir, const char* path)
+{
+  int err = follow_path(dir, &path, NULL);
+  if (err != FAT_ERR_EOF)
+    return err;
+  
+  int len = last_subpath_len(path);
+  if (len == 0)
+    return FAT_ERR_PATH;
+
+  uint32_t clust;
+  err = make_dir(dir, path, len, &clust);
   if (err)
     return err;
   
@@ -1610,6 +2326,92 @@ int fat_dir_open(Dir* dir, const char* path)
   return FAT_ERR_NONE;
 }
 
+//------------------------------------------------------------------------------
+// The functions below work on an open directory instead of resolving a path
+// from the volume root. Lookup and add leave dir pointing to the SFN of the
+// entry. Such a dir can be kept and later passed to fat_dir_enter or
+// fat_file_open_entry to reach the entry again without a search.
+
+int fat_dir_lookup(Dir* dir, const char* name, int len, DirEnt* ent)
+{
+  if (!dir->fat)
+    return FAT_ERR_PARAM;
+
+  int err = dir_search(dir, name, len, NULL);
+  if (err)
+    return err;
+
+  Sfn* sfn = dir_ptr(dir);
+  ent->size = sfn->size;
+  ent->clust = sfn_cluster(sfn);
+  ent->name_off = 0;
+  ent->name_len = len;
+  ent->attr = sfn->attr;
+
+  return FAT_ERR_NONE;
+}
+
+//------------------------------------------------------------------------------
+// Creates an empty file, or directory if attr has FAT_ATTR_DIR. Returns DENIED
+// if the name exists.
+
+int fat_dir_add(Dir* dir, const char* name, int len, uint8_t attr)
+{
+  if (!dir->fat || len <= 0)
+    return FAT_ERR_PARAM;
+
+  int err = dir_search(dir, name, len, NULL);
+  if (err != FAT_ERR_EOF)
+    return err ? err : FAT_ERR_DENIED;
+
+  if (attr & FAT_ATTR_DIR)
+  {
+    uint32_t clust;
+    err = make_dir(dir, name, len, &clust);
+  }
+  else
+    err = make_file(dir, name, len);
+
+  if (err)
+    return err;
+
+  return sync_fs(dir->fat);
+}
+
+//------------------------------------------------------------------------------
+int fat_dir_remove(Dir* dir, const char* name, int len)
+{
+  if (!dir->fat)
+    return FAT_ERR_PARAM;
+
+  Loc loc;
+  int err = dir_search(dir, name, len, &loc);
+  if (err)
+    return err;
+
+  return unlink_entry(dir, &loc);
+}
+
+//------------------------------------------------------------------------------
+// Enters the directory whose SFN dir points to.
+
+int fat_dir_enter(Dir* dir)
+{
+  if (!dir->fat)
+    return FAT_ERR_PARAM;
+
+  int err = update_buf(dir->fat, dir->sect);
+  if (err)
+    return err;
+
+  Sfn* sfn = dir_ptr(dir);
+  if (0 == (sfn->attr & FAT_ATTR_DIR))
+    return FAT_ERR_PATH;
+
+  dir_enter(dir, sfn_cluster(sfn));
+  return FAT_ERR_NONE;
+}
+
 //------------------------------------------------------------------------------
 // Read directory entry pointed to by dir. Use dir_next to advance directory pointer.
 
@@ -1667,6 +2469,79 @@ int fat_dir_read(Dir* dir, DirInfo* info)
   }
 }
 
+//------------------------------------------------------------------------------
+// Reads up to max entries from the directory pointer in one sequential pass and
+// advances the pointer past them. Names are packed back to back (not terminated)
+// into the names arena and referenced by offset. The number of entries read is
+// returned in cnt. Returns EOF, possibly along with entries, when the end of
+// the directory is reached. Call again while it returns FAT_ERR_NONE.
+
+int fat_dir_read_batch(Dir* dir, DirEnt* ents, int max, char* names, int names_size, int* cnt)
+{
+  int used = 0;
+  *cnt = 0;
+
+  if (!dir->fat)
+    return FAT_ERR_PARAM;
+
+  while (*cnt < max)
+  {
+    int err = update_buf(dir->fat, dir->sect);
+    if (err)
+      return err;
+
+    Sfn* sfn = dir_ptr(dir);
+
+    if (sfn_is_last(sfn))
+      return FAT_ERR_EOF;
+
+    if (!sfn_is_free(sfn))
+    {
+      Dir start = *dir;
+
+      if (sfn_is_lfn(sfn))
+      {
+        err = parse_lfn_name(dir);
+        if (err)
+          return err;
+
+        // Following entry must be SFN
+        err = update_buf(dir->fat, dir->sect);
+        if (err)
+          return err;
+
+        sfn = dir_ptr(dir);
+        if (sfn_is_free(sfn) || g_crc != get_crc(sfn->name))
+          return FAT_ERR_BROKEN;
+      }
+      else
+        parse_sfn_name(sfn->name);
+
+      if (used + g_len > LIMIT(names_size, 0x10000))
+      {
+        // Arena full. Resume at this entry on the next call.
+        *dir = start;
+        return *cnt ? FAT_ERR_NONE : FAT_ERR_PARAM;
+      }
+
+      DirEnt* ent = &ents[(*cnt)++];
+      memcpy(names + used, g_buf, g_len);
+      ent->name_off = used;
+      ent->name_len = g_len;
+      ent->size = sfn->size;
+      ent->clust = sfn_cluster(sfn);
+      ent->attr = sfn->attr;
+      used += g_len;
+    }
+
+    err = dir_next(dir);
+    if (err)
+      return err;
+  }
+
+  return FAT_ERR_NONE;
+}
+
 //------------------------------------------------------------------------------
 // Advances the directory pointer. Returns EOF when the EOF marker is hit. The 
 // user should not call this after that point. Call rewind to reset the directory
@@ -1704,6 +2579,7 @@ const char* fat_get_error(int err)
     "FAT_ERR_EOF",
     "FAT_ERR_DENIED",
     "FAT_ERR_FULL",
+    "FAT_ERR_BUSY",
   };
 
   err = -err;
@@ -0,0 +1,185 @@
+#include "fat_async.h"
+#include <stddef.h>
+
+//------------------------------------------------------------------------------
+// Asynchronous file I/O on top of the FAT driver. Requests are queued in a
+// bounded ring and carried out in submission order by fat_async_run, at most
+// one sector per step. There are no kernel threads, so the worker is driven
+// cooperatively: poll and wait run it, and the shell runs it with a sector
+// budget while it waits for input, so queued transfers proceed while the
+// CPU would otherwise halt. Any long-running loop can call fat_async_run the
+// same way, as long as nothing else is inside the FAT driver at the time.
+// The shell's cat does, reading the next block while it prints the last one.
+//
+// A file must not be used synchronously while it has requests in flight.
+
+#define LIMIT(a, b) ((a) < (b) ? (a) : (b))
+
+#define POLL_BUDGET  1 // Sectors transferred by each call to poll
+
+enum
+{
+  REQ_READ,
+  REQ_WRITE,
+};
+
+typedef struct
+{
+  File* file;
+  uint8_t* buf;
+  int len;
+  int done;
+  int err;
+  uint8_t op;
+  bool retired;
+} Request;
+
+//------------------------------------------------------------------------------
+static Request g_ring[FAT_ASYNC_RING];
+
+// Free running counters. head <= next <= tail. Entries in [head, next) are
+// complete, entries in [next, tail) are queued.
+static uint32_t g_head;
+static uint32_t g_next;
+static uint32_t g_tail;
+
+//------------------------------------------------------------------------------
+static Request* get_req(uint32_t idx)
+{
+  return &g_ring[idx % FAT_ASYNC_RING];
+}
+
+//------------------------------------------------------------------------------
+static int submit(File* file, uint8_t* buf, int len, uint8_t op)
+{
+  if (!file->fat || len < 0)
+    return FAT_ERR_PARAM;
+
+  if (g_tail - g_head == FAT_ASYNC_RING)
+    return FAT_ERR_BUSY;
+
+  Request* req = get_req(g_tail);
+  req->file = file;
+  req->buf = buf;
+  req->len = len;
+  req->done = 0;
+  req->err = FAT_ERR_NONE;
+  req->op = op;
+  req->retired = false;
+
+  return g_tail++ & 0x7fffffff;
+}
+
+//------------------------------------------------------------------------------
+// Transfers up to the next sector boundary. Returns true when the request is
+// complete.
+
+static bool step(Request* req)
+{
+  int bytes = 0;
+  int cnt = LIMIT(req->len - req->done, 512 - (int)(req->file->offset % 512));
+
+  if (cnt > 0)
+  {
+    if (req->op == REQ_READ)
+      req->err = fat_file_read(req->file, req->buf + req->done, cnt, &bytes);
+    else
+      req->err = fat_file_write(req->file, req->buf + req->done, cnt, &bytes);
+
+    req->done += bytes;
+  }
+
+  // A short read means end of file
+  return cnt <= 0 || bytes < cnt || req->err;
+}
+
+//------------------------------------------------------------------------------
+// Handles are the low 31 bits of the ring counter. Rebuilds the counter and
+// checks that it refers to an unreleased request.
+
+static bool find_req(int handle, uint32_t* out_idx)
+{
+  if (handle < 0)
+    return false;
+
+  uint32_t idx = (g_head & 0x80000000u) | (uint32_t)handle;
+  if (idx - g_head >= g_tail - g_head)
+    idx ^= 0x80000000u;
+
+  if (idx - g_head >= g_tail - g_head || get_req(idx)->retired)
+    return false;
+
+  *out_idx = idx;
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Queues a read of len bytes at the current file offset. Returns a handle, or
+// FAT_ERR_BUSY when the ring is full.
+
+int fat_file_read_async(File* file, void* buf, int len)
+{
+  return submit(file, buf, len, REQ_READ);
+}
+
+//------------------------------------------------------------------------------
+// Queues a write of len bytes at the current file offset. The buffer must stay
+// valid until the request completes.
+
+int fat_file_write_async(File* file, const void* buf, int len)
+{
+  return submit(file, (uint8_t*)buf, len, REQ_WRITE);
+}
+
+//------------------------------------------------------------------------------
+// Runs the worker for up to budget sector transfers. Returns the number of
+// requests still queued.
+
+int fat_async_run(int budget)
+{
+  while (budget-- > 0 && g_next != g_tail)
+  {
+    if (step(get_req(g_next)))
+      g_next++;
+  }
+
+  return g_tail - g_next;
+}
+
+//------------------------------------------------------------------------------
+// Advances the worker and checks a request. Returns FAT_ERR_BUSY while it is
+// in flight. Otherwise the request result is returned, bytes is set to the
+// number of bytes transferred and the handle is released.
+
+int fat_async_poll(int handle, int* bytes)
+{
+  uint32_t idx;
+  if (!find_req(handle, &idx))
+    return FAT_ERR_PARAM;
+
+  fat_async_run(POLL_BUDGET);
+
+  if (idx - g_head >= g_next - g_head)
+    return FAT_ERR_BUSY;
+
+  Request* req = get_req(idx);
+  *bytes = req->done;
+  req->retired = true;
+
+  // Slots are reused in ring order once every earlier request is released
+  while (g_head != g_next && get_req(g_head)->retired)
+    g_head++;
+
+  return req->err;
+}
+
+//------------------------------------------------------------------------------
+int fat_async_wait(int handle, int* bytes)
+{
+  for (;;)
+  {
+    int err = fat_async_poll(handle, bytes);
+    if (err != FAT_ERR_BUSY)
+      return err;
+  }
+}
@@ -0,0 +1,301 @@
+#include "fat_mmap.h"
+#include "kheap.h"
+#include "pagecache.h"
+#include "pmm.h"
+#include "vmm.h"
+#include <string.h>
+
+//------------------------------------------------------------------------------
+// Demand-paged file mappings. fat_file_mmap records where the file clusters are
+// on disk and registers the virtual range as a lazy VMM region. The fault
+// callback fills a page from disk on first touch, so mapping a large ROM costs
+// O(pages touched) instead of O(file size).
+//
+// Mappings live in the kernel windows, which every address space shares, so
+// they are visible from any directory.
+//
+// Pages are read-only and never written back. Writes through the file drop the
+// resident pages they overlap, so the next touch reads the new data. Since the
+// sector list is fixed at map time, the FAT driver refuses to truncate, delete
+// or defragment a mapped file. Clean pages can be dropped at any time, so the
+// mappings register a page cache shrinker and give pages back under pressure.
+
+#define LIMIT(a, b) ((a) < (b) ? (a) : (b))
+
+typedef struct
+{
+  Fat* fat;
+  uint32_t sclust; // Start cluster of the file
+  uint32_t* sects; // First sector of each cluster
+  uint32_t start;
+  uint32_t end;
+  uint32_t size;   // Bytes of file data backing the mapping
+  bool used;
+} Mapping;
+
+//------------------------------------------------------------------------------
+static Mapping g_maps[FAT_MMAP_MAX];
+
+// Eviction clock hand
+static int g_hand_map;
+static uint32_t g_hand_addr;
+
+static bool g_shrinker;
+
+//------------------------------------------------------------------------------
+static Mapping* find_map(uint32_t addr)
+{
+  for (int i = 0; i < FAT_MMAP_MAX; i++)
+  {
+    if (g_maps[i].used && addr >= g_maps[i].start && addr < g_maps[i].end)
+      return &g_maps[i];
+  }
+  return NULL;
+}
+
+//------------------------------------------------------------------------------
+static uint32_t map_sect(Mapping* map, uint32_t pos)
+{
+  Fat* fat = map->fat;
+  return map->sects[pos >> (9 + fat->clust_shift)] + ((pos >> 9) & fat->clust_msk);
+}
+
+//------------------------------------------------------------------------------
+static bool read_run(Fat* fat, uint8_t* dst, uint32_t sect, uint32_t cnt)
+{
+  if (fat->ops.read_multi)
+    return fat->ops.read_multi(dst, sect, cnt);
+
+  for (uint32_t i = 0; i < cnt; i++)
+  {
+    if (!fat->ops.read(dst + 512 * i, sect + i))
+      return false;
+  }
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Reads the page at file offset off. Sectors that are adjacent on disk are read
+// with a single request. Bytes past the end of the file are zeroed.
+
+static bool fill_page(Mapping* map, uint8_t* dst, uint32_t off)
+{
+  uint32_t valid = map->size > off ? LIMIT(map->size - off, PAGE_SIZE) : 0;
+  uint32_t i = 0;
+
+  while (512 * i < valid)
+  {
+    uint32_t sect = map_sect(map, off + 512 * i);
+    uint32_t cnt = 1;
+
+    while (512 * (i + cnt) < valid && map_sect(map, off + 512 * (i + cnt)) == sect + cnt)
+      cnt++;
+
+    if (!read_run(map->fat, dst + 512 * i, sect, cnt))
+      return false;
+
+    i += cnt;
+  }
+
+  memset(dst + valid, 0, PAGE_SIZE - valid);
+  return true;
+}
+
+//------------------------------------------------------------------------------
+static int mmap_fault(page_directory_t dir, uint32_t addr, uint32_t error, void* data)
+{
+  Mapping* map = data;
+
+  if (error & PF_PRESENT)
+    return -1;
+
+  uint32_t page = addr & ~(PAGE_SIZE - 1);
+
+  void* frame = pmm_alloc_frame();
+  if (!frame && pagecache_reclaim(1) == 1)
+    frame = pmm_alloc_frame();
+
+  if (!frame)
+    return -1;
+
+  if (!fill_page(map, PHYS_TO_VIRT(frame), page - map->start))
+  {
+    pmm_free_frame(frame);
+    return -1;
+  }
+
+  vmm_map(dir, page, (uint32_t)frame, PAGE_PRESENT);
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+static uint32_t shrink(uint32_t cnt)
+{
+  return fat_mmap_evict(cnt);
+}
+
+//------------------------------------------------------------------------------
+// Maps len bytes of the file at vaddr, which must be page aligned and inside
+// the kernel windows. Nothing is read until the pages are touched. Bytes past
+// the end of the file read as zero. The file can be closed once mapped.
+
+int fat_file_mmap(File* file, uint32_t vaddr, uint32_t len)
+{
+  if (!file->fat || len == 0 || (vaddr & (PAGE_SIZE - 1)))
+    return FAT_ERR_PARAM;
+
+  uint32_t end = vaddr + ((len + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+  if (end <= vaddr || vaddr < KERNEL_WINDOW_START || end > PAGE_TABLES)
+    return FAT_ERR_PARAM;
+
+  page_directory_t dir = vmm_get_kernel_directory();
+  Mapping* map = NULL;
+
+  for (int i = 0; i < FAT_MMAP_MAX; i++)
+  {
+    if (!g_maps[i].used)
+      map = map ? map : &g_maps[i];
+    else if (vaddr < g_maps[i].end && end > g_maps[i].start)
+      return FAT_ERR_DENIED;
+  }
+
+  if (!map)
+    return FAT_ERR_FULL;
+
+  if (!g_shrinker && pagecache_register_shrinker(shrink) != 0)
+    return FAT_ERR_FULL;
+  g_shrinker = true;
+
+  for (uint32_t va = vaddr; va < end; va += PAGE_SIZE)
+  {
+    if (vmm_get_pte(dir, va) & PAGE_PRESENT)
+      return FAT_ERR_DENIED;
+  }
+
+  uint32_t size = LIMIT(file->size, len);
+  uint32_t clust_size = 512 << file->fat->clust_shift;
+  int clusts = (size + clust_size - 1) / clust_size;
+  uint32_t* sects = NULL;
+
+  if (clusts)
+  {
+    sects = kmalloc(clusts * sizeof(uint32_t));
+    if (!sects)
+      return FAT_ERR_FULL;
+
+    int err = fat_file_bmap(file, sects, clusts);
+    if (err)
+    {
+      kfree(sects);
+      return err;
+    }
+  }
+
+  if (vmm_add_region(dir, vaddr, end, mmap_fault, map) != 0)
+  {
+    kfree(sects);
+    return FAT_ERR_DENIED;
+  }
+
+  map->fat = file->fat;
+  map->sclust = file->sclust;
+  map->sects = sects;
+  map->start = vaddr;
+  map->end = end;
+  map->size = size;
+  map->used = true;
+
+  return FAT_ERR_NONE;
+}
+
+//------------------------------------------------------------------------------
+// Removes the mapping starting at vaddr and frees its resident pages.
+
+int fat_file_munmap(uint32_t vaddr)
+{
+  Mapping* map = find_map(vaddr);
+  if (!map || map->start != vaddr)
+    return FAT_ERR_PARAM;
+
+  vmm_remove_region(vmm_get_kernel_directory(), map->start);
+
+  kfree(map->sects);
+  map->used = false;
+
+  return FAT_ERR_NONE;
+}
+
+//------------------------------------------------------------------------------
+// Tells whether the file whose chain starts at clust is mapped.
+
+bool fat_mmap_busy(Fat* fat, uint32_t clust)
+{
+  for (int i = 0; i < FAT_MMAP_MAX; i++)
+  {
+    if (g_maps[i].used && g_maps[i].fat == fat && g_maps[i].sclust == clust)
+      return true;
+  }
+  return false;
+}
+
+//------------------------------------------------------------------------------
+// Drops the resident pages overlapping len bytes at offset in the file whose
+// chain starts at clust. Called by the FAT driver before it writes file data.
+
+void fat_mmap_drop(Fat* fat, uint32_t clust, uint32_t offset, uint32_t len)
+{
+  for (int i = 0; i < FAT_MMAP_MAX; i++)
+  {
+    Mapping* map = &g_maps[i];
+    uint32_t size = map->end - map->start;
+
+    if (!map->used || map->fat != fat || map->sclust != clust || offset >= size)
+      continue;
+
+    uint32_t first = offset & ~(PAGE_SIZE - 1);
+    uint32_t last = len > size - offset ? size : offset + len;
+
+    vmm_free_range(vmm_get_kernel_directory(), map->start + first, last - first);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Drops up to cnt resident pages, sweeping all mappings in clock order so the
+// same pages are not always the victims. Returns the number of pages freed.
+
+int fat_mmap_evict(int cnt)
+{
+  page_directory_t dir = vmm_get_kernel_directory();
+  uint32_t pages = 0;
+  int evicted = 0;
+
+  for (int i = 0; i < FAT_MMAP_MAX; i++)
+  {
+    if (g_maps[i].used)
+      pages += (g_maps[i].end - g_maps[i].start) / PAGE_SIZE;
+  }
+
+  for (uint32_t n = 0; n < pages && evicted < cnt; n++)
+  {
+    Mapping* map = &g_maps[g_hand_map];
+
+    while (!map->used || g_hand_addr < map->start || g_hand_addr >= map->end)
+    {
+      g_hand_map = (g_hand_map + 1) % FAT_MMAP_MAX;
+      map = &g_maps[g_hand_map];
+      g_hand_addr = map->start;
+    }
+
+    uint32_t pte = vmm_get_pte(dir, g_hand_addr);
+    if (pte & PAGE_PRESENT)
+    {
+      vmm_unmap(dir, g_hand_addr);
+      pmm_free_frame((void*)(pte & ~(PAGE_SIZE - 1)));
+      evicted++;
+    }
+
+    g_hand_addr += PAGE_SIZE;
+  }
+
+  return evicted;
+}
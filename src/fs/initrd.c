@@ -0,0 +1,196 @@
+#include "initrd.h"
+#include "kheap.h"
+#include "lz4.h"
+#include "pmm.h"
+#include "vmm.h"
+#include <stddef.h>
+#include <string.h>
+
+// Compressed files are unpacked on first use into PMM frames mapped back to
+// back in this window, so each file is virtually contiguous.
+#define INITRD_WINDOW     0xE0000000
+#define INITRD_WINDOW_END 0xE4000000
+
+static const uint8_t* image;
+static uint32_t image_size;
+static const initrd_entry_t* entries;
+static uint32_t entry_count;
+static uint32_t unpacked_size;
+
+static uint32_t* unpacked; // Window address of each unpacked file, 0 if not yet
+static uint32_t window_next = INITRD_WINDOW;
+static uint32_t resident_pages;
+
+// Checks the module handed over by the bootloader and takes it as the initrd.
+// The image is used in place, nothing is copied.
+int initrd_init(uint32_t start, uint32_t end) {
+    const initrd_header_t* header = (const initrd_header_t*)start;
+    uint32_t size = end - start;
+
+    if (end < start || size < sizeof(initrd_header_t) || header->magic != INITRD_MAGIC) {
+        return -1;
+    }
+
+    if (header->count > (size - sizeof(initrd_header_t)) / sizeof(initrd_entry_t)) {
+        return -1;
+    }
+
+    const initrd_entry_t* index = (const initrd_entry_t*)(header + 1);
+    uint32_t total = 0;
+
+    for (uint32_t i = 0; i < header->count; i++) {
+        if (index[i].name[INITRD_NAME_MAX - 1] != '\0') {
+            return -1;
+        }
+        if (index[i].offset > size || index[i].stored > size - index[i].offset) {
+            return -1;
+        }
+        if (!(index[i].flags & INITRD_LZ4) && index[i].stored != index[i].size) {
+            return -1;
+        }
+        // Lookups are binary searches, so the index must be strictly sorted
+        if (i > 0 && strcmp(index[i - 1].name, index[i].name) >= 0) {
+            return -1;
+        }
+        total += index[i].size;
+    }
+
+    if (header->count > 0) {
+        unpacked = kmalloc(header->count * sizeof(uint32_t));
+        if (unpacked == NULL) {
+            return -1;
+        }
+        memset(unpacked, 0, header->count * sizeof(uint32_t));
+    }
+
+    image = (const uint8_t*)start;
+    image_size = size;
+    entries = index;
+    entry_count = header->count;
+    unpacked_size = total;
+    return 0;
+}
+
+uint32_t initrd_count(void) {
+    return entry_count;
+}
+
+const initrd_entry_t* initrd_entry(uint32_t idx) {
+    return idx < entry_count ? &entries[idx] : NULL;
+}
+
+const initrd_entry_t* initrd_find(const char* name) {
+    uint32_t lo = 0;
+    uint32_t hi = entry_count;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(name, entries[mid].name);
+
+        if (cmp == 0) {
+            return &entries[mid];
+        }
+        if (cmp < 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    return NULL;
+}
+
+static int unpack(const initrd_entry_t* entry, uint8_t* dst) {
+    const uint8_t* src = image + entry->offset;
+    const uint32_t* blocks = (const uint32_t*)src;
+    uint32_t block_count = (entry->size + INITRD_BLOCK_SIZE - 1) / INITRD_BLOCK_SIZE;
+    uint32_t pos = block_count * sizeof(uint32_t);
+
+    if (block_count > entry->stored / sizeof(uint32_t)) {
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < block_count; i++) {
+        uint32_t len = blocks[i] & ~INITRD_BLOCK_RAW;
+        uint32_t out = entry->size - i * INITRD_BLOCK_SIZE;
+        if (out > INITRD_BLOCK_SIZE) {
+            out = INITRD_BLOCK_SIZE;
+        }
+
+        if (len > entry->stored - pos) {
+            return -1;
+        }
+
+        if (blocks[i] & INITRD_BLOCK_RAW) {
+            if (len != out) {
+                return -1;
+            }
+            memcpy(dst, src + pos, len);
+        } else if (lz4_decompress(src + pos, len, dst, out) != (int)out) {
+            return -1;
+        }
+
+        dst += out;
+        pos += len;
+    }
+
+    return 0;
+}
+
+static void release(uint32_t addr, uint32_t pages) {
+    vmm_free_range(vmm_get_kernel_directory(), addr, pages * PAGE_SIZE);
+}
+
+// Returns a pointer to the file contents. Stored files point into the module.
+// Compressed files are unpacked on the first call and stay resident. Returns
+// NULL if a compressed file is corrupt or there is no memory to unpack it.
+const uint8_t* initrd_data(const initrd_entry_t* entry) {
+    if (!(entry->flags & INITRD_LZ4)) {
+        return image + entry->offset;
+    }
+
+    uint32_t idx = entry - entries;
+    if (unpacked[idx] != 0) {
+        return (const uint8_t*)unpacked[idx];
+    }
+
+    uint32_t pages = (entry->size + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (pages > (INITRD_WINDOW_END - window_next) / PAGE_SIZE) {
+        return NULL;
+    }
+
+    page_directory_t dir = vmm_get_kernel_directory();
+
+    for (uint32_t i = 0; i < pages; i++) {
+        void* frame = pmm_alloc_high_frame();
+        if (frame == NULL) {
+            release(window_next, i);
+            return NULL;
+        }
+        vmm_map(dir, window_next + i * PAGE_SIZE, (uint32_t)frame, PAGE_PRESENT | PAGE_RW);
+    }
+
+    if (unpack(entry, (uint8_t*)window_next) != 0) {
+        release(window_next, pages);
+        return NULL;
+    }
+
+    unpacked[idx] = window_next;
+    window_next += pages * PAGE_SIZE;
+    resident_pages += pages;
+    return (const uint8_t*)unpacked[idx];
+}
+
+uint32_t initrd_image_size(void) {
+    return image_size;
+}
+
+// Total size of the files once unpacked
+uint32_t initrd_unpacked_size(void) {
+    return unpacked_size;
+}
+
+// Frames holding unpacked files, on top of the module itself
+uint32_t initrd_resident_pages(void) {
+    return resident_pages;
+}
@@ -0,0 +1,73 @@
+#include "lz4.h"
+#include <string.h>
+
+#define MIN_MATCH 4
+
+// Reads an LZ4 length extension: bytes are added until one is below 255
+static int read_length(const uint8_t** ip, const uint8_t* end, uint32_t* len) {
+    uint8_t b;
+    do {
+        if (*ip >= end) {
+            return -1;
+        }
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+// Decompresses one raw LZ4 block (no frame header). Every access is bounds
+// checked, so a corrupt block fails instead of writing past dst. Returns the
+// number of bytes produced, or -1.
+int lz4_decompress(const uint8_t* src, uint32_t src_len, uint8_t* dst, uint32_t dst_len) {
+    const uint8_t* ip = src;
+    const uint8_t* iend = src + src_len;
+    uint8_t* op = dst;
+    uint8_t* oend = dst + dst_len;
+
+    while (ip < iend) {
+        uint32_t token = *ip++;
+        uint32_t len = token >> 4;
+
+        if (len == 15 && read_length(&ip, iend, &len) != 0) {
+            return -1;
+        }
+        if (len > (uint32_t)(iend - ip) || len > (uint32_t)(oend - op)) {
+            return -1;
+        }
+        memcpy(op, ip, len);
+        op += len;
+        ip += len;
+
+        // The last sequence has literals only
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+        uint32_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (uint32_t)(op - dst)) {
+            return -1;
+        }
+
+        len = token & 15;
+        if (len == 15 && read_length(&ip, iend, &len) != 0) {
+            return -1;
+        }
+        len += MIN_MATCH;
+        if (len > (uint32_t)(oend - op)) {
+            return -1;
+        }
+
+        // Matches may overlap their own output, so copy forward byte by byte
+        const uint8_t* match = op - offset;
+        while (len--) {
+            *op++ = *match++;
+        }
+    }
+
+    return op - dst;
+}
@@ -0,0 +1,237 @@
+#include "pagecache.h"
+#include "kheap.h"
+#include "pmm.h"
+#include "slab.h"
+#include "vmm.h"
+#include <stddef.h>
+#include <string.h>
+
+// Page cache shared by every open of a file. Pages are whole PMM frames keyed
+// by (volume, file, page index), where the backend picks what identifies a
+// file (the start cluster for FAT). Backends fill pages on a miss and must
+// invalidate them when the file data changes or its key can be reused.
+//
+// All pages are on one LRU list. When the PMM runs low, pages are reclaimed
+// from the cold end before a new one is allocated. Other holders of clean,
+// re-readable pages register a shrinker, which reclaim falls back to once the
+// cache is empty.
+//
+// The hash table gets one bucket per FRAMES_PER_BUCKET frames of RAM, since
+// the cache can grow to almost all of it.
+
+#define MIN_BUCKETS       256
+#define FRAMES_PER_BUCKET 4
+
+typedef struct cache_page {
+    const void* volume;
+    uint32_t file;
+    uint32_t index;
+    uint8_t* frame;
+    struct cache_page* hash_next;
+    struct cache_page* lru_prev;
+    struct cache_page* lru_next;
+} cache_page_t;
+
+static cache_page_t* min_buckets[MIN_BUCKETS];
+static cache_page_t** buckets = min_buckets;
+static uint32_t bucket_mask = MIN_BUCKETS - 1;
+static cache_page_t lru = { .lru_prev = &lru, .lru_next = &lru }; // lru.lru_next is the coldest
+static pagecache_stats_t stats;
+static kmem_cache_t* page_cache; // Descriptors, kept off the kernel heap since there can be one per frame
+static pagecache_shrinker_t shrinkers[PAGECACHE_MAX_SHRINKERS];
+
+static uint32_t hash_key(const void* volume, uint32_t file, uint32_t index) {
+    uint32_t hash = (uint32_t)volume ^ (file * 2654435761u) ^ (index * 40503u);
+    return (hash ^ (hash >> 16)) & bucket_mask;
+}
+
+static void lru_remove(cache_page_t* page) {
+    page->lru_prev->lru_next = page->lru_next;
+    page->lru_next->lru_prev = page->lru_prev;
+}
+
+static void lru_push(cache_page_t* page) {
+    page->lru_prev = lru.lru_prev;
+    page->lru_next = &lru;
+    lru.lru_prev->lru_next = page;
+    lru.lru_prev = page;
+}
+
+static void drop(cache_page_t* page) {
+    cache_page_t** link = &buckets[hash_key(page->volume, page->file, page->index)];
+    while (*link != page) {
+        link = &(*link)->hash_next;
+    }
+    *link = page->hash_next;
+
+    lru_remove(page);
+    pmm_free_frame((void*)VIRT_TO_PHYS(page->frame));
+    kmem_cache_free(page_cache, page);
+    stats.pages--;
+}
+
+// Sizes the hash table for the installed RAM. Must run before anything is
+// cached. Keeps the static table if the heap cannot hold a larger one.
+void pagecache_init(void) {
+    page_cache = kmem_cache_create("cache_page", sizeof(cache_page_t), 0, NULL);
+
+    uint32_t count = MIN_BUCKETS;
+    while (count < pmm_get_total_frames() / FRAMES_PER_BUCKET) {
+        count *= 2;
+    }
+
+    for (; count > MIN_BUCKETS; count /= 2) {
+        cache_page_t** table = kmalloc(count * sizeof(cache_page_t*));
+        if (table != NULL) {
+            memset(table, 0, count * sizeof(cache_page_t*));
+            buckets = table;
+            bucket_mask = count - 1;
+            break;
+        }
+    }
+}
+
+static cache_page_t* lookup(const void* volume, uint32_t file, uint32_t index) {
+    cache_page_t* page = buckets[hash_key(volume, file, index)];
+
+    while (page != NULL && (page->volume != volume || page->file != file || page->index != index)) {
+        page = page->hash_next;
+    }
+    return page;
+}
+
+// Returns the cached page and marks it recently used, or NULL on a miss
+uint8_t* pagecache_find(const void* volume, uint32_t file, uint32_t index) {
+    cache_page_t* page = lookup(volume, file, index);
+
+    if (page == NULL) {
+        stats.misses++;
+        return NULL;
+    }
+
+    lru_remove(page);
+    lru_push(page);
+    stats.hits++;
+    return page->frame;
+}
+
+// Adds a page and returns its frame for the caller to fill. If filling fails
+// the caller must invalidate it. Returns NULL when no memory can be found.
+uint8_t* pagecache_insert(const void* volume, uint32_t file, uint32_t index) {
+    uint32_t free = pmm_get_free_frames();
+    if (free < PAGECACHE_MIN_FREE) {
+        pagecache_reclaim(PAGECACHE_MIN_FREE - free);
+    }
+
+    cache_page_t* page = page_cache != NULL ? kmem_cache_alloc(page_cache) : NULL;
+    if (page == NULL) {
+        return NULL;
+    }
+
+    void* frame = pmm_alloc_frame();
+    if (frame == NULL && pagecache_reclaim(1) == 1) {
+        frame = pmm_alloc_frame();
+    }
+    if (frame == NULL) {
+        kmem_cache_free(page_cache, page);
+        return NULL;
+    }
+    page->frame = PHYS_TO_VIRT(frame);
+
+    uint32_t bucket = hash_key(volume, file, index);
+    page->volume = volume;
+    page->file = file;
+    page->index = index;
+    page->hash_next = buckets[bucket];
+    buckets[bucket] = page;
+    lru_push(page);
+    stats.pages++;
+
+    return page->frame;
+}
+
+// Drops count pages of a file starting at page first. Short ranges are looked
+// up page by page, so small writes do not depend on the size of the cache.
+void pagecache_invalidate(const void* volume, uint32_t file, uint32_t first, uint32_t count) {
+    if (count <= stats.pages) {
+        for (uint32_t i = 0; i < count; i++) {
+            cache_page_t* page = lookup(volume, file, first + i);
+            if (page != NULL) {
+                drop(page);
+            }
+        }
+        return;
+    }
+
+    cache_page_t* page = lru.lru_next;
+    while (page != &lru) {
+        cache_page_t* next = page->lru_next;
+        if (page->volume == volume && page->file == file &&
+            page->index >= first && page->index - first < count) {
+            drop(page);
+        }
+        page = next;
+    }
+}
+
+// Drops the pages holding len bytes of a file from offset. With PAGECACHE_ALL
+// as len, everything from offset on is dropped.
+void pagecache_invalidate_range(const void* volume, uint32_t file, uint32_t offset, uint32_t len) {
+    uint32_t first = offset / PAGE_SIZE;
+    uint32_t count = PAGECACHE_ALL;
+
+    if (len == 0) {
+        return;
+    }
+    if (len <= PAGECACHE_ALL - offset) {
+        count = (offset + len - 1) / PAGE_SIZE - first + 1;
+    }
+    pagecache_invalidate(volume, file, first, count);
+}
+
+void pagecache_invalidate_volume(const void* volume) {
+    cache_page_t* page = lru.lru_next;
+
+    while (page != &lru) {
+        cache_page_t* next = page->lru_next;
+        if (page->volume == volume) {
+            drop(page);
+        }
+        page = next;
+    }
+}
+
+// Frees up to count of the least recently used pages, then asks the
+// shrinkers for the rest. Returns the number freed.
+uint32_t pagecache_reclaim(uint32_t count) {
+    uint32_t freed = 0;
+
+    while (freed < count && lru.lru_next != &lru) {
+        drop(lru.lru_next);
+        freed++;
+    }
+    for (int i = 0; i < PAGECACHE_MAX_SHRINKERS && freed < count && shrinkers[i] != NULL; i++) {
+        freed += shrinkers[i](count - freed);
+    }
+
+    stats.reclaimed += freed;
+    return freed;
+}
+
+// Adds a shrinker to the reclaim path. Returns -1 if all slots are taken.
+int pagecache_register_shrinker(pagecache_shrinker_t shrink) {
+    for (int i = 0; i < PAGECACHE_MAX_SHRINKERS; i++) {
+        if (shrinkers[i] == shrink) {
+            return 0;
+        }
+        if (shrinkers[i] == NULL) {
+            shrinkers[i] = shrink;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void pagecache_get_stats(pagecache_stats_t* out) {
+    *out = stats;
+}
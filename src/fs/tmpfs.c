@@ -0,0 +1,383 @@
+#include "vfs.h"
+#include "kheap.h"
+#include "pagecache.h"
+#include "pmm.h"
+#include "vmm.h"
+#include <string.h>
+
+// RAM-backed filesystem. Nodes live until they are removed and are independent
+// of the vnode cache, which just points at them. Directories are hash tables
+// of their children that double when the load gets high. Children are also on
+// a list in creation order for readdir, since a resize reorders the buckets.
+// Files are arrays of PMM frames. Pages that were never written are NULL and
+// read as zeros.
+
+#define TMPFS_MIN_BUCKETS 8
+
+typedef struct tmp_node {
+    struct tmp_node* hash_next;
+    struct tmp_node* order_prev;
+    struct tmp_node* order_next;
+    uint32_t seq;         // Position in the creation order of the parent
+    uint32_t type;
+    uint32_t size;
+    union {
+        struct {
+            struct tmp_node** buckets;
+            uint32_t bucket_count;
+            uint32_t count;
+            struct tmp_node* first; // Creation order
+            struct tmp_node* last;
+            uint32_t next_seq;
+        } dir;
+        struct {
+            uint8_t** pages;
+            uint32_t page_count; // Length of pages
+        } file;
+    };
+    uint8_t name_len;
+    char name[];
+} tmp_node_t;
+
+static uint32_t hash_name(const char* name, int len) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static tmp_node_t* find_child(tmp_node_t* dir, const char* name, int len) {
+    tmp_node_t* node = dir->dir.buckets[hash_name(name, len) % dir->dir.bucket_count];
+
+    for (; node != NULL; node = node->hash_next) {
+        if (node->name_len == len && memcmp(node->name, name, len) == 0) {
+            return node;
+        }
+    }
+    return NULL;
+}
+
+static int init_dir(tmp_node_t* dir) {
+    dir->dir.buckets = kmalloc(TMPFS_MIN_BUCKETS * sizeof(tmp_node_t*));
+    if (dir->dir.buckets == NULL) {
+        return VFS_ERR_NOSPC;
+    }
+    memset(dir->dir.buckets, 0, TMPFS_MIN_BUCKETS * sizeof(tmp_node_t*));
+    dir->dir.bucket_count = TMPFS_MIN_BUCKETS;
+    dir->dir.count = 0;
+    dir->dir.first = NULL;
+    dir->dir.last = NULL;
+    dir->dir.next_seq = 1;
+    return VFS_OK;
+}
+
+// Doubles the bucket array. A failed allocation just leaves longer chains.
+static void grow_dir(tmp_node_t* dir) {
+    uint32_t count = dir->dir.bucket_count * 2;
+    tmp_node_t** buckets = kmalloc(count * sizeof(tmp_node_t*));
+    if (buckets == NULL) {
+        return;
+    }
+    memset(buckets, 0, count * sizeof(tmp_node_t*));
+
+    for (uint32_t i = 0; i < dir->dir.bucket_count; i++) {
+        tmp_node_t* node = dir->dir.buckets[i];
+        while (node != NULL) {
+            tmp_node_t* next = node->hash_next;
+            uint32_t bucket = hash_name(node->name, node->name_len) % count;
+            node->hash_next = buckets[bucket];
+            buckets[bucket] = node;
+            node = next;
+        }
+    }
+
+    kfree(dir->dir.buckets);
+    dir->dir.buckets = buckets;
+    dir->dir.bucket_count = count;
+}
+
+static void free_pages(tmp_node_t* file) {
+    for (uint32_t i = 0; i < file->file.page_count; i++) {
+        if (file->file.pages[i] != NULL) {
+            pmm_free_frame((void*)VIRT_TO_PHYS(file->file.pages[i]));
+        }
+    }
+    kfree(file->file.pages);
+    file->file.pages = NULL;
+    file->file.page_count = 0;
+    file->size = 0;
+}
+
+// Returns the page at index, allocating it and growing the page array as needed
+static uint8_t* get_page(tmp_node_t* file, uint32_t index) {
+    if (index >= file->file.page_count) {
+        uint32_t count = file->file.page_count ? file->file.page_count : 4;
+        while (count <= index) {
+            count *= 2;
+        }
+
+        uint8_t** pages = kmalloc(count * sizeof(uint8_t*));
+        if (pages == NULL) {
+            return NULL;
+        }
+        memset(pages, 0, count * sizeof(uint8_t*));
+        if (file->file.pages != NULL) {
+            memcpy(pages, file->file.pages, file->file.page_count * sizeof(uint8_t*));
+            kfree(file->file.pages);
+        }
+
+        file->file.pages = pages;
+        file->file.page_count = count;
+    }
+
+    if (file->file.pages[index] == NULL) {
+        void* frame = pmm_alloc_frame();
+        if (frame == NULL && pagecache_reclaim(1) == 1) {
+            frame = pmm_alloc_frame();
+        }
+        if (frame == NULL) {
+            return NULL;
+        }
+        uint8_t* page = PHYS_TO_VIRT(frame);
+        memset(page, 0, PAGE_SIZE);
+        file->file.pages[index] = page;
+    }
+
+    return file->file.pages[index];
+}
+
+static int tmpfs_lookup(vnode_t* dir, const char* name, int len, vnode_t* node) {
+    tmp_node_t* child = find_child(dir->data, name, len);
+    if (child == NULL) {
+        return VFS_ERR_NOENT;
+    }
+
+    node->type = child->type;
+    node->size = child->size;
+    node->data = child;
+    return VFS_OK;
+}
+
+static int tmpfs_create(vnode_t* dir, const char* name, int len, uint32_t type, vnode_t* node) {
+    tmp_node_t* parent = dir->data;
+    tmp_node_t* child = kmalloc(sizeof(tmp_node_t) + len);
+    if (child == NULL) {
+        return VFS_ERR_NOSPC;
+    }
+
+    child->type = type;
+    child->size = 0;
+    child->name_len = len;
+    memcpy(child->name, name, len);
+
+    if (type == VFS_DIR) {
+        if (init_dir(child) != VFS_OK) {
+            kfree(child);
+            return VFS_ERR_NOSPC;
+        }
+    } else {
+        child->file.pages = NULL;
+        child->file.page_count = 0;
+    }
+
+    if (parent->dir.count >= 2 * parent->dir.bucket_count) {
+        grow_dir(parent);
+    }
+
+    uint32_t bucket = hash_name(name, len) % parent->dir.bucket_count;
+    child->hash_next = parent->dir.buckets[bucket];
+    parent->dir.buckets[bucket] = child;
+    parent->dir.count++;
+
+    child->seq = parent->dir.next_seq++;
+    child->order_prev = parent->dir.last;
+    child->order_next = NULL;
+    if (parent->dir.last != NULL) {
+        parent->dir.last->order_next = child;
+    } else {
+        parent->dir.first = child;
+    }
+    parent->dir.last = child;
+
+    node->type = type;
+    node->size = 0;
+    node->data = child;
+    return VFS_OK;
+}
+
+static int tmpfs_remove(vnode_t* dir, const char* name, int len) {
+    tmp_node_t* parent = dir->data;
+    tmp_node_t** link = &parent->dir.buckets[hash_name(name, len) % parent->dir.bucket_count];
+
+    while (*link != NULL && ((*link)->name_len != len || memcmp((*link)->name, name, len) != 0)) {
+        link = &(*link)->hash_next;
+    }
+
+    tmp_node_t* child = *link;
+    if (child == NULL) {
+        return VFS_ERR_NOENT;
+    }
+    if (child->type == VFS_DIR && child->dir.count > 0) {
+        return VFS_ERR_BUSY;
+    }
+
+    *link = child->hash_next;
+    parent->dir.count--;
+
+    if (child->order_prev != NULL) {
+        child->order_prev->order_next = child->order_next;
+    } else {
+        parent->dir.first = child->order_next;
+    }
+    if (child->order_next != NULL) {
+        child->order_next->order_prev = child->order_prev;
+    } else {
+        parent->dir.last = child->order_prev;
+    }
+
+    if (child->type == VFS_DIR) {
+        kfree(child->dir.buckets);
+    } else {
+        free_pages(child);
+    }
+    kfree(child);
+    return VFS_OK;
+}
+
+static int tmpfs_open(vfs_file_t* file) {
+    tmp_node_t* node = file->node->data;
+
+    if (node->type == VFS_FILE && (file->flags & VFS_O_TRUNC)) {
+        free_pages(node);
+        file->node->size = 0;
+    }
+    file->data = NULL;
+    return VFS_OK;
+}
+
+static int tmpfs_read(vfs_file_t* file, void* buf, uint32_t len) {
+    tmp_node_t* node = file->node->data;
+    uint8_t* dst = buf;
+    uint32_t offset = file->offset;
+
+    if (offset >= node->size) {
+        return 0;
+    }
+    if (len > node->size - offset) {
+        len = node->size - offset;
+    }
+
+    uint32_t done = 0;
+    while (done < len) {
+        uint32_t index = offset / PAGE_SIZE;
+        uint32_t in_page = offset % PAGE_SIZE;
+        uint32_t n = PAGE_SIZE - in_page < len - done ? PAGE_SIZE - in_page : len - done;
+
+        if (index < node->file.page_count && node->file.pages[index] != NULL) {
+            memcpy(dst + done, node->file.pages[index] + in_page, n);
+        } else {
+            memset(dst + done, 0, n);
+        }
+        done += n;
+        offset += n;
+    }
+
+    return done;
+}
+
+static int tmpfs_write(vfs_file_t* file, const void* buf, uint32_t len) {
+    tmp_node_t* node = file->node->data;
+    const uint8_t* src = buf;
+    uint32_t offset = file->offset;
+
+    if (offset + len < offset) {
+        return VFS_ERR_INVAL;
+    }
+
+    uint32_t done = 0;
+    while (done < len) {
+        uint8_t* page = get_page(node, offset / PAGE_SIZE);
+        if (page == NULL) {
+            break;
+        }
+
+        uint32_t in_page = offset % PAGE_SIZE;
+        uint32_t n = PAGE_SIZE - in_page < len - done ? PAGE_SIZE - in_page : len - done;
+        memcpy(page + in_page, src + done, n);
+        done += n;
+        offset += n;
+    }
+
+    if (offset > node->size) {
+        node->size = offset;
+        file->node->size = offset;
+    }
+    return done > 0 || len == 0 ? (int)done : VFS_ERR_NOSPC;
+}
+
+static int tmpfs_readdir(vfs_file_t* file, vfs_dirent_t* ents, int max, char* names, int names_size) {
+    tmp_node_t* dir = file->node->data;
+    uint32_t last = (uint32_t)file->data;
+    tmp_node_t* node = dir->dir.first;
+    int count = 0;
+    int used = 0;
+
+    // The cursor is the sequence number of the last entry returned. Entries
+    // created meanwhile come later and removed ones just drop out, so a
+    // listing interleaved with changes neither skips nor repeats an entry.
+    while (node != NULL && node->seq <= last) {
+        node = node->order_next;
+    }
+
+    for (; node != NULL && count < max; node = node->order_next) {
+        if (used + node->name_len > names_size) {
+            break;
+        }
+
+        memcpy(names + used, node->name, node->name_len);
+        ents[count].size = node->size;
+        ents[count].name_off = used;
+        ents[count].name_len = node->name_len;
+        ents[count].type = node->type;
+        used += node->name_len;
+        last = node->seq;
+        count++;
+    }
+
+    file->data = (void*)last;
+    return count > 0 || node == NULL ? count : VFS_ERR_INVAL;
+}
+
+static const vfs_ops_t tmpfs_ops = {
+    .lookup = tmpfs_lookup,
+    .create = tmpfs_create,
+    .remove = tmpfs_remove,
+    .open = tmpfs_open,
+    .read = tmpfs_read,
+    .write = tmpfs_write,
+    .readdir = tmpfs_readdir,
+};
+
+// Mounts an empty tmpfs at path
+int vfs_mount_tmpfs(const char* path) {
+    tmp_node_t* root = kmalloc(sizeof(tmp_node_t));
+    if (root == NULL) {
+        return VFS_ERR_NOSPC;
+    }
+
+    root->type = VFS_DIR;
+    root->size = 0;
+    root->name_len = 0;
+    if (init_dir(root) != VFS_OK) {
+        kfree(root);
+        return VFS_ERR_NOSPC;
+    }
+
+    int err = vfs_mount(path, &tmpfs_ops, VFS_DIR, root);
+    if (err != VFS_OK) {
+        kfree(root->dir.buckets);
+        kfree(root);
+    }
+    return err;
+}
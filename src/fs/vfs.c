@@ -0,0 +1,649 @@
+#include "vfs.h"
+#include <string.h>
+
+// Vnodes live in a fixed pool and are cached by (parent, name). A vnode whose
+// reference count drops to zero stays in the hash table and goes on an LRU
+// list, so opening the same path again finds every component in the cache
+// instead of asking the backend to search directories. When the pool runs out
+// the least recently used unreferenced vnode is recycled. Children hold a
+// reference on their parent, so only leaves are ever recycled.
+
+#define VNODE_COUNT   128
+#define VNODE_BUCKETS 64
+#define FILE_COUNT    64
+#define MOUNT_PATH_MAX 32
+
+typedef struct {
+    char path[MOUNT_PATH_MAX];
+    uint32_t path_len;
+    vnode_t* root;
+} vfs_mount_t;
+
+static vnode_t vnodes[VNODE_COUNT];
+static vnode_t* buckets[VNODE_BUCKETS];
+static vnode_t* free_vnodes;
+static vnode_t lru; // Sentinel, lru.lru_next is the least recently used
+
+static vfs_file_t files[FILE_COUNT];
+static vfs_file_t* free_files[FILE_COUNT];
+static uint32_t free_file_count;
+
+static vfs_mount_t mounts[VFS_MAX_MOUNTS];
+static uint32_t mount_count;
+
+static vfs_fd_table_t kernel_fds;
+static vfs_fd_table_t* current_fds = &kernel_fds;
+
+static uint32_t cache_hits;
+static uint32_t cache_misses;
+
+void vfs_init(void) {
+    memset(buckets, 0, sizeof(buckets));
+    lru.lru_next = &lru;
+    lru.lru_prev = &lru;
+
+    free_vnodes = NULL;
+    for (int i = VNODE_COUNT - 1; i >= 0; i--) {
+        vnodes[i].hash_next = free_vnodes;
+        free_vnodes = &vnodes[i];
+    }
+
+    for (int i = 0; i < FILE_COUNT; i++) {
+        free_files[i] = &files[i];
+    }
+    free_file_count = FILE_COUNT;
+
+    mount_count = 0;
+    vfs_fd_table_init(&kernel_fds);
+    current_fds = &kernel_fds;
+}
+
+// There is no task model yet, so the kernel table is the current one until
+// tasks switch it with vfs_set_fd_table.
+void vfs_fd_table_init(vfs_fd_table_t* table) {
+    memset(table, 0, sizeof(*table));
+}
+
+void vfs_set_fd_table(vfs_fd_table_t* table) {
+    current_fds = table;
+}
+
+static uint32_t hash_name(const vnode_t* parent, const char* name, int len) {
+    uint32_t hash = 2166136261u ^ (uint32_t)parent;
+    for (int i = 0; i < len; i++) {
+        hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+    }
+    return hash % VNODE_BUCKETS;
+}
+
+static void lru_remove(vnode_t* node) {
+    node->lru_prev->lru_next = node->lru_next;
+    node->lru_next->lru_prev = node->lru_prev;
+}
+
+static void vnode_get(vnode_t* node) {
+    if (node->refs++ == 0 && node->parent != NULL) {
+        lru_remove(node);
+    }
+}
+
+static void vnode_put(vnode_t* node) {
+    if (--node->refs == 0 && node->parent != NULL) {
+        node->lru_prev = lru.lru_prev;
+        node->lru_next = &lru;
+        lru.lru_prev->lru_next = node;
+        lru.lru_prev = node;
+    }
+}
+
+static void hash_remove(vnode_t* node) {
+    vnode_t** link = &buckets[hash_name(node->parent, node->name, node->name_len)];
+    while (*link != node) {
+        link = &(*link)->hash_next;
+    }
+    *link = node->hash_next;
+}
+
+// Drops an unreferenced vnode from the cache and returns it to the pool
+static void evict(vnode_t* node) {
+    vnode_t* parent = node->parent;
+
+    lru_remove(node);
+    hash_remove(node);
+    if (node->ops->release != NULL) {
+        node->ops->release(node);
+    }
+
+    node->hash_next = free_vnodes;
+    free_vnodes = node;
+    vnode_put(parent);
+}
+
+static vnode_t* alloc_vnode(void) {
+    if (free_vnodes == NULL && lru.lru_next != &lru) {
+        evict(lru.lru_next);
+    }
+
+    vnode_t* node = free_vnodes;
+    if (node != NULL) {
+        free_vnodes = node->hash_next;
+        memset(node, 0, sizeof(*node));
+    }
+    return node;
+}
+
+static vnode_t* cache_find(vnode_t* dir, const char* name, int len) {
+    vnode_t* node = buckets[hash_name(dir, name, len)];
+    for (; node != NULL; node = node->hash_next) {
+        if (node->parent == dir && node->name_len == len && memcmp(node->name, name, len) == 0) {
+            return node;
+        }
+    }
+    return NULL;
+}
+
+static void cache_insert(vnode_t* dir, vnode_t* node, const char* name, int len) {
+    uint32_t bucket = hash_name(dir, name, len);
+
+    node->ops = dir->ops;
+    node->parent = dir;
+    node->refs = 1;
+    node->name_len = len;
+    memcpy(node->name, name, len);
+    node->hash_next = buckets[bucket];
+    buckets[bucket] = node;
+    vnode_get(dir);
+}
+
+// Returns a referenced child of dir, from the cache if possible. With create
+// set, a missing child is created with that type, and an existing one is still
+// returned but with VFS_ERR_EXIST.
+static int lookup_child(vnode_t* dir, const char* name, int len, uint32_t create, vnode_t** out) {
+    if (dir->type != VFS_DIR) {
+        return VFS_ERR_NOTDIR;
+    }
+
+    vnode_t* node = cache_find(dir, name, len);
+    if (node != NULL) {
+        cache_hits++;
+        vnode_get(node);
+        *out = node;
+        return create ? VFS_ERR_EXIST : VFS_OK;
+    }
+    cache_misses++;
+
+    node = alloc_vnode();
+    if (node == NULL) {
+        return VFS_ERR_MFILE;
+    }
+
+    int err = dir->ops->lookup(dir, name, len, node);
+    if (err == VFS_OK && create) {
+        err = VFS_ERR_EXIST;
+    } else if (err == VFS_ERR_NOENT && create) {
+        err = dir->ops->create ? dir->ops->create(dir, name, len, create, node) : VFS_ERR_PERM;
+    }
+
+    if (err != VFS_OK && err != VFS_ERR_EXIST) {
+        node->hash_next = free_vnodes;
+        free_vnodes = node;
+        return err;
+    }
+
+    cache_insert(dir, node, name, len);
+    *out = node;
+    return err;
+}
+
+static vfs_mount_t* find_mount(const char* path) {
+    vfs_mount_t* best = NULL;
+
+    for (uint32_t i = 0; i < mount_count; i++) {
+        vfs_mount_t* mount = &mounts[i];
+        if (strncmp(path, mount->path, mount->path_len) != 0) {
+            continue;
+        }
+        // Match whole components only, "/" matches everything
+        char next = path[mount->path_len];
+        if (mount->path_len > 1 && next != '/' && next != '\0') {
+            continue;
+        }
+        if (best == NULL || mount->path_len > best->path_len) {
+            best = mount;
+        }
+    }
+
+    return best;
+}
+
+static int component_len(const char* path) {
+    int len = 0;
+    while (path[len] != '/' && path[len] != '\0') {
+        len++;
+    }
+    return len;
+}
+
+// Resolves an absolute path to a referenced vnode. If name is not NULL the
+// last component is not resolved: the parent is returned and name/len point
+// to the last component. name is set to NULL when the path has no last
+// component (a mount root).
+static int walk(const char* path, vnode_t** out, const char** name, int* len) {
+    if (path[0] != '/') {
+        return VFS_ERR_INVAL;
+    }
+
+    vfs_mount_t* mount = find_mount(path);
+    if (mount == NULL) {
+        return VFS_ERR_NOENT;
+    }
+
+    vnode_t* node = mount->root;
+    vnode_get(node);
+    path += mount->path_len;
+
+    if (name != NULL) {
+        *name = NULL;
+    }
+
+    for (;;) {
+        while (*path == '/') {
+            path++;
+        }
+
+        int n = component_len(path);
+        if (n == 0) {
+            break;
+        }
+        if (n > VFS_NAME_MAX) {
+            vnode_put(node);
+            return VFS_ERR_INVAL;
+        }
+
+        const char* rest = path + n;
+        while (*rest == '/') {
+            rest++;
+        }
+
+        if (n == 1 && path[0] == '.') {
+            path = rest;
+            continue;
+        }
+
+        if (n == 2 && path[0] == '.' && path[1] == '.') {
+            if (node->parent != NULL) {
+                vnode_t* parent = node->parent;
+                vnode_get(parent);
+                vnode_put(node);
+                node = parent;
+            }
+            path = rest;
+            continue;
+        }
+
+        if (name != NULL && *rest == '\0') {
+            *name = path;
+            *len = n;
+            break;
+        }
+
+        vnode_t* child;
+        int err = lookup_child(node, path, n, 0, &child);
+        vnode_put(node);
+        if (err != VFS_OK) {
+            return err;
+        }
+        node = child;
+        path = rest;
+    }
+
+    *out = node;
+    return VFS_OK;
+}
+
+// Mounts a backend at path. The root vnode gets the given type and data and is
+// never evicted.
+int vfs_mount(const char* path, const vfs_ops_t* ops, uint32_t type, void* data) {
+    size_t len = strlen(path);
+    if (path[0] != '/' || len >= MOUNT_PATH_MAX || mount_count == VFS_MAX_MOUNTS) {
+        return VFS_ERR_INVAL;
+    }
+
+    // Trailing slashes would break prefix matching
+    while (len > 1 && path[len - 1] == '/') {
+        len--;
+    }
+
+    vnode_t* root = alloc_vnode();
+    if (root == NULL) {
+        return VFS_ERR_MFILE;
+    }
+
+    root->ops = ops;
+    root->refs = 1;
+    root->type = type;
+    root->data = data;
+
+    vfs_mount_t* mount = &mounts[mount_count++];
+    memcpy(mount->path, path, len);
+    mount->path[len] = '\0';
+    mount->path_len = len;
+    mount->root = root;
+    return VFS_OK;
+}
+
+// Returns the root vnode of the mount holding an absolute path, and in rest the
+// part of the path below the mount point
+vnode_t* vfs_mount_root(const char* path, const char** rest) {
+    vfs_mount_t* mount = path[0] == '/' ? find_mount(path) : NULL;
+    if (mount == NULL) {
+        return NULL;
+    }
+
+    *rest = path + mount->path_len;
+    return mount->root;
+}
+
+// Evicts the unreferenced cached children of a node, so that no vnode keeps
+// backend state that points into it. Returns VFS_ERR_BUSY if the node is open
+// or a child is still referenced. Backends call this before moving a node.
+int vfs_evict_children(const char* path) {
+    vnode_t* node;
+    int err = walk(path, &node, NULL, NULL);
+    if (err != VFS_OK) {
+        return err;
+    }
+
+    for (int i = 0; i < VNODE_BUCKETS; i++) {
+        vnode_t* child = buckets[i];
+        while (child != NULL) {
+            vnode_t* next = child->hash_next;
+            if (child->parent == node && child->refs == 0) {
+                evict(child);
+            }
+            child = next;
+        }
+    }
+
+    // Beyond the walk reference and the permanent one of a mount root, every
+    // reference is an open file or a child in use
+    uint32_t own = node->parent == NULL ? 2 : 1;
+    err = node->refs > own ? VFS_ERR_BUSY : VFS_OK;
+    vnode_put(node);
+    return err;
+}
+
+static vfs_file_t* get_file(int fd) {
+    if (fd < 0 || fd >= VFS_MAX_FDS) {
+        return NULL;
+    }
+    return current_fds->files[fd];
+}
+
+static int alloc_fd(vfs_file_t* file) {
+    uint32_t free = ~current_fds->used;
+    if (free == 0) {
+        return VFS_ERR_MFILE;
+    }
+
+    int fd = __builtin_ctz(free);
+    current_fds->used |= 1u << fd;
+    current_fds->files[fd] = file;
+    return fd;
+}
+
+static void release_file(vfs_file_t* file) {
+    if (--file->refs > 0) {
+        return;
+    }
+    if (file->node->ops->close != NULL) {
+        file->node->ops->close(file);
+    }
+    vnode_put(file->node);
+    free_files[free_file_count++] = file;
+}
+
+int vfs_open(const char* path, uint32_t flags) {
+    vnode_t* dir;
+    vnode_t* node;
+    const char* name;
+    int len;
+
+    int err = walk(path, &dir, &name, &len);
+    if (err != VFS_OK) {
+        return err;
+    }
+
+    if (name == NULL) {
+        node = dir;
+    } else {
+        err = lookup_child(dir, name, len, (flags & VFS_O_CREATE) ? VFS_FILE : 0, &node);
+        vnode_put(dir);
+        if (err == VFS_ERR_EXIST) {
+            err = VFS_OK;
+        }
+        if (err != VFS_OK) {
+            return err;
+        }
+    }
+
+    if (node->type == VFS_DIR && (flags & VFS_O_WRITE)) {
+        vnode_put(node);
+        return VFS_ERR_ISDIR;
+    }
+    if (free_file_count == 0 || current_fds->used == 0xffffffff) {
+        vnode_put(node);
+        return VFS_ERR_MFILE;
+    }
+
+    vfs_file_t* file = free_files[--free_file_count];
+    file->node = node;
+    file->refs = 1;
+    file->offset = 0;
+    file->flags = flags;
+    file->data = NULL;
+
+    err = node->ops->open ? node->ops->open(file) : VFS_OK;
+    if (err != VFS_OK) {
+        vnode_put(node);
+        free_files[free_file_count++] = file;
+        return err;
+    }
+
+    return alloc_fd(file);
+}
+
+int vfs_close(int fd) {
+    vfs_file_t* file = get_file(fd);
+    if (file == NULL) {
+        return VFS_ERR_BADF;
+    }
+
+    current_fds->files[fd] = NULL;
+    current_fds->used &= ~(1u << fd);
+    release_file(file);
+    return VFS_OK;
+}
+
+// New descriptor for the same open file. The offset is shared.
+int vfs_dup(int fd) {
+    vfs_file_t* file = get_file(fd);
+    if (file == NULL) {
+        return VFS_ERR_BADF;
+    }
+
+    int new_fd = alloc_fd(file);
+    if (new_fd >= 0) {
+        file->refs++;
+    }
+    return new_fd;
+}
+
+int vfs_read(int fd, void* buf, uint32_t len) {
+    vfs_file_t* file = get_file(fd);
+    if (file == NULL || !(file->flags & VFS_O_READ)) {
+        return VFS_ERR_BADF;
+    }
+    if (file->node->type == VFS_DIR) {
+        return VFS_ERR_ISDIR;
+    }
+
+    int n = file->node->ops->read(file, buf, len);
+    if (n > 0) {
+        file->offset += n;
+    }
+    return n;
+}
+
+int vfs_write(int fd, const void* buf, uint32_t len) {
+    vfs_file_t* file = get_file(fd);
+    if (file == NULL || !(file->flags & VFS_O_WRITE)) {
+        return VFS_ERR_BADF;
+    }
+    if (file->node->ops->write == NULL) {
+        return VFS_ERR_PERM;
+    }
+
+    if (file->flags & VFS_O_APPEND) {
+        file->offset = file->node->size;
+    }
+
+    int n = file->node->ops->write(file, buf, len);
+    if (n > 0) {
+        file->offset += n;
+    }
+    return n;
+}
+
+int vfs_seek(int fd, int offset, int whence) {
+    vfs_file_t* file = get_file(fd);
+    if (file == NULL) {
+        return VFS_ERR_BADF;
+    }
+
+    int base = 0;
+    if (whence == VFS_SEEK_CUR) {
+        base = file->offset;
+    } else if (whence == VFS_SEEK_END) {
+        base = file->node->size;
+    } else if (whence != VFS_SEEK_SET) {
+        return VFS_ERR_INVAL;
+    }
+
+    if (base + offset < 0) {
+        return VFS_ERR_INVAL;
+    }
+
+    file->offset = base + offset;
+    return file->offset;
+}
+
+int vfs_readdir(int fd, vfs_dirent_t* ents, int max, char* names, int names_size) {
+    vfs_file_t* file = get_file(fd);
+    if (file == NULL) {
+        return VFS_ERR_BADF;
+    }
+    if (file->node->type != VFS_DIR) {
+        return VFS_ERR_NOTDIR;
+    }
+    return file->node->ops->readdir(file, ents, max, names, names_size);
+}
+
+int vfs_stat(const char* path, vfs_stat_t* st) {
+    vnode_t* node;
+    int err = walk(path, &node, NULL, NULL);
+    if (err != VFS_OK) {
+        return err;
+    }
+
+    st->type = node->type;
+    st->size = node->size;
+    vnode_put(node);
+    return VFS_OK;
+}
+
+int vfs_mkdir(const char* path) {
+    vnode_t* dir;
+    vnode_t* node;
+    const char* name;
+    int len;
+
+    int err = walk(path, &dir, &name, &len);
+    if (err != VFS_OK) {
+        return err;
+    }
+    if (name == NULL) {
+        vnode_put(dir);
+        return VFS_ERR_EXIST;
+    }
+
+    err = lookup_child(dir, name, len, VFS_DIR, &node);
+    if (err == VFS_OK || err == VFS_ERR_EXIST) {
+        vnode_put(node);
+    }
+    vnode_put(dir);
+    return err;
+}
+
+int vfs_unlink(const char* path) {
+    vnode_t* dir;
+    const char* name;
+    int len;
+
+    int err = walk(path, &dir, &name, &len);
+    if (err != VFS_OK) {
+        return err;
+    }
+    if (name == NULL) {
+        vnode_put(dir);
+        return VFS_ERR_BUSY;
+    }
+
+    // An open file or a directory with cached children cannot go away
+    vnode_t* node = cache_find(dir, name, len);
+    if (node != NULL && node->refs > 0) {
+        vnode_put(dir);
+        return VFS_ERR_BUSY;
+    }
+
+    if (dir->type != VFS_DIR) {
+        err = VFS_ERR_NOTDIR;
+    } else if (dir->ops->remove == NULL) {
+        err = VFS_ERR_PERM;
+    } else {
+        if (node != NULL) {
+            evict(node);
+        }
+        err = dir->ops->remove(dir, name, len);
+    }
+
+    vnode_put(dir);
+    return err;
+}
+
+void vfs_cache_stats(uint32_t* hits, uint32_t* misses) {
+    *hits = cache_hits;
+    *misses = cache_misses;
+}
+
+const char* vfs_strerror(int err) {
+    static const char* const messages[] = {
+        "Success",
+        "No such file or directory",
+        "Not a directory",
+        "Is a directory",
+        "File exists",
+        "Bad file descriptor",
+        "Too many open files",
+        "Resource busy",
+        "Permission denied",
+        "No space left on device",
+        "I/O error",
+        "Invalid argument",
+    };
+
+    if (err > 0 || -err >= (int)(sizeof(messages) / sizeof(messages[0]))) {
+        return "Unknown error";
+    }
+    return messages[-err];
+}
@@ -0,0 +1,393 @@
+#include "vfs.h"
+#include "fat.h"
+#include "pagecache.h"
+#include "pmm.h"
+#include "slab.h"
+#include <string.h>
+
+// File data is read through the page cache, keyed by the start cluster of the
+// file. The FAT driver drops the affected pages itself on writes, truncation,
+// removal and defragmentation, so writers that bypass the VFS are covered too.
+//
+// Each vnode keeps a Dir pointing at its directory entry, so the file or
+// directory can be opened again without searching for it. The volume root has
+// no entry and keeps the entered Dir instead.
+typedef struct {
+    Dir dir;
+    int is_root;
+} fat_node_t;
+
+typedef struct {
+    Dir dir;
+    int eof;
+} fat_dir_state_t;
+
+#define READDIR_BATCH 16
+
+static kmem_cache_t* node_cache;
+static kmem_cache_t* dir_cache;
+static kmem_cache_t* file_cache;
+
+static int map_error(int err) {
+    if (err == FAT_ERR_NONE) {
+        return VFS_OK;
+    }
+    if (err == FAT_ERR_EOF || err == FAT_ERR_PATH) {
+        return VFS_ERR_NOENT;
+    }
+    if (err == FAT_ERR_DENIED) {
+        return VFS_ERR_PERM;
+    }
+    if (err == FAT_ERR_FULL) {
+        return VFS_ERR_NOSPC;
+    }
+    if (err == FAT_ERR_PARAM) {
+        return VFS_ERR_INVAL;
+    }
+    if (err == FAT_ERR_BUSY) {
+        return VFS_ERR_BUSY;
+    }
+    return VFS_ERR_IO;
+}
+
+// Gives an entered Dir for a directory vnode
+static int enter(vnode_t* node, Dir* dir) {
+    fat_node_t* fn = node->data;
+    *dir = fn->dir;
+    return fn->is_root ? FAT_ERR_NONE : fat_dir_enter(dir);
+}
+
+static int fat_lookup(vnode_t* dir, const char* name, int len, vnode_t* node) {
+    fat_node_t* fn = kmem_cache_alloc(node_cache);
+    if (fn == NULL) {
+        return VFS_ERR_MFILE;
+    }
+
+    DirEnt ent;
+    int err = enter(dir, &fn->dir);
+    if (err == FAT_ERR_NONE) {
+        err = fat_dir_lookup(&fn->dir, name, len, &ent);
+    }
+    if (err != FAT_ERR_NONE) {
+        kmem_cache_free(node_cache, fn);
+        return map_error(err);
+    }
+
+    fn->is_root = 0;
+    node->type = (ent.attr & FAT_ATTR_DIR) ? VFS_DIR : VFS_FILE;
+    node->size = ent.size;
+    node->data = fn;
+    return VFS_OK;
+}
+
+static int fat_create(vnode_t* dir, const char* name, int len, uint32_t type, vnode_t* node) {
+    fat_node_t* fn = kmem_cache_alloc(node_cache);
+    if (fn == NULL) {
+        return VFS_ERR_MFILE;
+    }
+
+    uint8_t attr = type == VFS_DIR ? FAT_ATTR_DIR : FAT_ATTR_ARCHIVE;
+    int err = enter(dir, &fn->dir);
+    if (err == FAT_ERR_NONE) {
+        err = fat_dir_add(&fn->dir, name, len, attr);
+    }
+    if (err != FAT_ERR_NONE) {
+        kmem_cache_free(node_cache, fn);
+        return map_error(err);
+    }
+
+    fn->is_root = 0;
+    node->type = type;
+    node->size = 0;
+    node->data = fn;
+    return VFS_OK;
+}
+
+static int fat_remove(vnode_t* dir, const char* name, int len) {
+    Dir d;
+    int err = enter(dir, &d);
+    if (err == FAT_ERR_NONE) {
+        err = fat_dir_remove(&d, name, len);
+    }
+    return map_error(err);
+}
+
+static int fat_open(vfs_file_t* file) {
+    vnode_t* node = file->node;
+
+    if (node->type == VFS_DIR) {
+        fat_dir_state_t* state = kmem_cache_alloc(dir_cache);
+        if (state == NULL) {
+            return VFS_ERR_MFILE;
+        }
+        int err = enter(node, &state->dir);
+        if (err != FAT_ERR_NONE) {
+            kmem_cache_free(dir_cache, state);
+            return map_error(err);
+        }
+        state->eof = 0;
+        file->data = state;
+        return VFS_OK;
+    }
+
+    File* f = kmem_cache_alloc(file_cache);
+    if (f == NULL) {
+        return VFS_ERR_MFILE;
+    }
+
+    uint8_t flags = 0;
+    if (file->flags & VFS_O_READ) {
+        flags |= FAT_READ;
+    }
+    if (file->flags & VFS_O_WRITE) {
+        flags |= FAT_WRITE;
+    }
+    if (file->flags & VFS_O_TRUNC) {
+        flags |= FAT_TRUNC;
+    }
+
+    Dir entry = ((fat_node_t*)node->data)->dir;
+    int err = fat_file_open_entry(f, &entry, flags);
+    if (err != FAT_ERR_NONE) {
+        kmem_cache_free(file_cache, f);
+        return map_error(err);
+    }
+
+    node->size = f->size;
+    file->data = f;
+    return VFS_OK;
+}
+
+static int fat_close(vfs_file_t* file) {
+    int err = FAT_ERR_NONE;
+
+    if (file->node->type == VFS_FILE) {
+        File* f = file->data;
+        err = fat_file_close(f);
+        file->node->size = f->size;
+        kmem_cache_free(file_cache, f);
+    } else {
+        kmem_cache_free(dir_cache, file->data);
+    }
+
+    return map_error(err);
+}
+
+static int seek_to(File* f, uint32_t offset) {
+    if (f->offset == offset) {
+        return FAT_ERR_NONE;
+    }
+    return fat_file_seek(f, offset, FAT_SEEK_START);
+}
+
+static int read_direct(File* f, uint32_t offset, void* buf, uint32_t len) {
+    int bytes;
+
+    int err = seek_to(f, offset);
+    if (err == FAT_ERR_NONE) {
+        err = fat_file_read(f, buf, len, &bytes);
+    }
+    return err == FAT_ERR_NONE ? bytes : map_error(err);
+}
+
+// Returns the cached page at index, reading it in on a miss. Returns NULL if
+// no page could be allocated and sets *err if the read failed.
+static const uint8_t* get_page(File* f, uint32_t index, int* err) {
+    const uint8_t* page = pagecache_find(f->fat, f->sclust, index);
+    if (page != NULL) {
+        return page;
+    }
+
+    uint8_t* frame = pagecache_insert(f->fat, f->sclust, index);
+    if (frame == NULL) {
+        return NULL;
+    }
+
+    uint32_t offset = index * PAGE_SIZE;
+    uint32_t valid = f->size - offset < PAGE_SIZE ? f->size - offset : PAGE_SIZE;
+    int bytes = read_direct(f, offset, frame, valid);
+
+    if (bytes < 0 || (uint32_t)bytes != valid) {
+        pagecache_invalidate(f->fat, f->sclust, index, 1);
+        *err = bytes < 0 ? bytes : VFS_ERR_IO;
+        return NULL;
+    }
+    memset(frame + valid, 0, PAGE_SIZE - valid);
+    return frame;
+}
+
+static int fat_read(vfs_file_t* file, void* buf, uint32_t len) {
+    File* f = file->data;
+    uint8_t* dst = buf;
+    uint32_t offset = file->offset;
+
+    if (f->sclust == 0 || offset >= f->size) {
+        return read_direct(f, offset, buf, len);
+    }
+    if (len > f->size - offset) {
+        len = f->size - offset;
+    }
+
+    uint32_t done = 0;
+    while (done < len) {
+        int err = VFS_OK;
+        const uint8_t* page = get_page(f, offset / PAGE_SIZE, &err);
+
+        if (page == NULL) {
+            if (err != VFS_OK) {
+                return done > 0 ? (int)done : err;
+            }
+            // Out of memory, read the rest without caching it
+            int bytes = read_direct(f, offset, dst + done, len - done);
+            return bytes < 0 ? (done > 0 ? (int)done : bytes) : (int)(done + bytes);
+        }
+
+        uint32_t in_page = offset % PAGE_SIZE;
+        uint32_t n = PAGE_SIZE - in_page < len - done ? PAGE_SIZE - in_page : len - done;
+        memcpy(dst + done, page + in_page, n);
+        done += n;
+        offset += n;
+    }
+
+    return done;
+}
+
+static int fat_write(vfs_file_t* file, const void* buf, uint32_t len) {
+    File* f = file->data;
+    int bytes;
+
+    int err = seek_to(f, file->offset);
+    if (err == FAT_ERR_NONE) {
+        err = fat_file_write(f, buf, len, &bytes);
+    }
+    if (err != FAT_ERR_NONE) {
+        return map_error(err);
+    }
+
+    file->node->size = f->size;
+    return bytes;
+}
+
+static int fat_readdir(vfs_file_t* file, vfs_dirent_t* ents, int max, char* names, int names_size) {
+    fat_dir_state_t* state = file->data;
+    DirEnt batch[READDIR_BATCH];
+    int count = 0;
+
+    if (max <= 0) {
+        return VFS_ERR_INVAL;
+    }
+
+    // Volume labels are skipped, so a batch can come back empty
+    while (count == 0 && !state->eof) {
+        int cnt;
+        int err = fat_dir_read_batch(&state->dir, batch, max < READDIR_BATCH ? max : READDIR_BATCH,
+                                     names, names_size, &cnt);
+        if (err == FAT_ERR_EOF) {
+            state->eof = 1;
+        } else if (err != FAT_ERR_NONE) {
+            return map_error(err);
+        }
+
+        for (int i = 0; i < cnt; i++) {
+            if (batch[i].attr & FAT_ATTR_LABEL) {
+                continue;
+            }
+            ents[count].size = batch[i].size;
+            ents[count].name_off = batch[i].name_off;
+            ents[count].name_len = batch[i].name_len;
+            ents[count].type = (batch[i].attr & FAT_ATTR_DIR) ? VFS_DIR : VFS_FILE;
+            count++;
+        }
+    }
+
+    return count;
+}
+
+static void fat_release(vnode_t* node) {
+    kmem_cache_free(node_cache, node->data);
+}
+
+static const vfs_ops_t fat_ops = {
+    .lookup = fat_lookup,
+    .create = fat_create,
+    .remove = fat_remove,
+    .open = fat_open,
+    .close = fat_close,
+    .read = fat_read,
+    .write = fat_write,
+    .readdir = fat_readdir,
+    .release = fat_release,
+};
+
+// Translates a path on a mounted FAT volume into the driver's path, which
+// starts with the volume name. Returns the volume, or NULL if the path is on
+// another filesystem or too long for fat_path.
+Fat* vfs_fat_resolve(const char* path, char* fat_path, int size) {
+    const char* rest;
+    vnode_t* root = vfs_mount_root(path, &rest);
+    if (root == NULL || root->ops != &fat_ops) {
+        return NULL;
+    }
+
+    Fat* fat = ((fat_node_t*)root->data)->dir.fat;
+    while (*rest == '/') {
+        rest++;
+    }
+    size_t len = strlen(rest);
+    if (fat->name_len + len + 3 > (size_t)size) {
+        return NULL;
+    }
+
+    fat_path[0] = '/';
+    memcpy(fat_path + 1, fat->name, fat->name_len);
+    fat_path[fat->name_len + 1] = '/';
+    memcpy(fat_path + fat->name_len + 2, rest, len + 1);
+    return fat;
+}
+
+// Creates the object caches on the first mount
+static int init_caches(void) {
+    if (node_cache == NULL) {
+        node_cache = kmem_cache_create("fat_node", sizeof(fat_node_t), 0, NULL);
+    }
+    if (dir_cache == NULL) {
+        dir_cache = kmem_cache_create("fat_dir", sizeof(fat_dir_state_t), 0, NULL);
+    }
+    if (file_cache == NULL) {
+        file_cache = kmem_cache_create("fat_file", sizeof(File), 0, NULL);
+    }
+    return node_cache != NULL && dir_cache != NULL && file_cache != NULL;
+}
+
+// Mounts the root directory of a mounted FAT volume at path
+int vfs_mount_fat(const char* path, const char* volume) {
+    char root[34];
+    size_t len = strlen(volume);
+
+    if (len == 0 || len > 32) {
+        return VFS_ERR_INVAL;
+    }
+    root[0] = '/';
+    memcpy(root + 1, volume, len + 1);
+    if (!init_caches()) {
+        return VFS_ERR_NOSPC;
+    }
+
+    fat_node_t* fn = kmem_cache_alloc(node_cache);
+    if (fn == NULL) {
+        return VFS_ERR_MFILE;
+    }
+
+    int err = fat_dir_open(&fn->dir, root);
+    if (err != FAT_ERR_NONE) {
+        kmem_cache_free(node_cache, fn);
+        return map_error(err);
+    }
+    fn->is_root = 1;
+
+    err = vfs_mount(path, &fat_ops, VFS_DIR, fn);
+    if (err != VFS_OK) {
+        kmem_cache_free(node_cache, fn);
+    }
+    return err;
+}
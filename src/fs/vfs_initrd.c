@@ -0,0 +1,88 @@
+#include "vfs.h"
+#include "initrd.h"
+#include <string.h>
+
+// The initrd is a single read-only directory. File vnodes point at their index
+// entry, open directories keep the next index in file->data.
+
+static int initrd_lookup(vnode_t* dir, const char* name, int len, vnode_t* node) {
+    (void)dir;
+    char buf[INITRD_NAME_MAX];
+
+    if (len >= INITRD_NAME_MAX) {
+        return VFS_ERR_NOENT;
+    }
+    memcpy(buf, name, len);
+    buf[len] = '\0';
+
+    const initrd_entry_t* entry = initrd_find(buf);
+    if (entry == NULL) {
+        return VFS_ERR_NOENT;
+    }
+
+    node->type = VFS_FILE;
+    node->size = entry->size;
+    node->data = (void*)entry;
+    return VFS_OK;
+}
+
+static int initrd_open(vfs_file_t* file) {
+    if (file->flags & (VFS_O_WRITE | VFS_O_TRUNC)) {
+        return VFS_ERR_PERM;
+    }
+    file->data = NULL;
+    return VFS_OK;
+}
+
+static int initrd_read(vfs_file_t* file, void* buf, uint32_t len) {
+    const initrd_entry_t* entry = file->node->data;
+    const uint8_t* data = initrd_data(entry);
+
+    if (data == NULL) {
+        return VFS_ERR_IO;
+    }
+    if (file->offset >= entry->size) {
+        return 0;
+    }
+    if (len > entry->size - file->offset) {
+        len = entry->size - file->offset;
+    }
+
+    memcpy(buf, data + file->offset, len);
+    return len;
+}
+
+static int initrd_readdir(vfs_file_t* file, vfs_dirent_t* ents, int max, char* names, int names_size) {
+    uint32_t idx = (uint32_t)file->data;
+    int count = 0;
+    int used = 0;
+
+    for (; count < max && idx < initrd_count(); idx++, count++) {
+        const initrd_entry_t* entry = initrd_entry(idx);
+        int len = strlen(entry->name);
+        if (used + len > names_size) {
+            break;
+        }
+
+        memcpy(names + used, entry->name, len);
+        ents[count].size = entry->size;
+        ents[count].name_off = used;
+        ents[count].name_len = len;
+        ents[count].type = VFS_FILE;
+        used += len;
+    }
+
+    file->data = (void*)idx;
+    return count;
+}
+
+static const vfs_ops_t initrd_ops = {
+    .lookup = initrd_lookup,
+    .open = initrd_open,
+    .read = initrd_read,
+    .readdir = initrd_readdir,
+};
+
+int vfs_mount_initrd(const char* path) {
+    return vfs_mount(path, &initrd_ops, VFS_DIR, NULL);
+}
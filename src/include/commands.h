@@ -10,6 +10,21 @@ void cmd_touch(Fat *fs, const char *filename);
 void cmd_mkdir(Fat *fs, const char *dirname);
 void cmd_cd(Fat *fs, const char *dirname);
 void cmd_pwd(Fat *fs);
+void cmd_defrag(Fat *fs, const char *filename);
+void cmd_initrd(const char *name);
+void cmd_cache(void);
+void cmd_ramdisk(const char *size);
+void cmd_pmmbench(void);
+void cmd_heapbench(void);
+void cmd_slabinfo(void);
+void cmd_meminfo(const char *arg);
+void cmd_tlbbench(void);
+void cmd_forkbench(void);
+void cmd_switchbench(void);
+void cmd_mapbench(void);
+void cmd_blitbench(void);
+void cmd_lsbench(const char *dirname);
+void cmd_mmapbench(const char *filename);
 void cmd_help(void);
 
 #endif
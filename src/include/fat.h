@@ -20,6 +20,7 @@ enum
   FAT_ERR_EOF      = -6,
   FAT_ERR_DENIED   = -7,
   FAT_ERR_FULL     = -8,
+  FAT_ERR_BUSY     = -9,
 };
 
 enum
@@ -59,6 +60,7 @@ typedef struct
 {
   bool (*read)(uint8_t* buf, uint32_t sect);
   bool (*write)(const uint8_t* buf, uint32_t sect);
+  bool (*read_multi)(uint8_t* buf, uint32_t sect, uint32_t cnt); // Optional
 } DiskOps;
 
 typedef struct
@@ -101,6 +103,15 @@ typedef struct
   uint8_t name_len;
 } DirInfo;
 
+typedef struct
+{
+  uint32_t size;
+  uint32_t clust;
+  uint16_t name_off; // Offset of the name in the caller's name arena
+  uint8_t name_len;
+  uint8_t attr;
+} DirEnt;
+
 typedef struct
 {
   Fat* fat;
@@ -129,25 +140,35 @@ typedef struct
 const char* fat_get_error(int err);
 
 int fat_probe(DiskOps* ops, int partition);
+int fat_format(DiskOps* ops, uint32_t sect_cnt, const char* label);
 int fat_mount(DiskOps* ops, int partition, Fat* fat, const char* path);
 int fat_umount(Fat* fat);
 int fat_sync(Fat* fat);
 
 int fat_stat(const char* path, DirInfo* info);
 int fat_unlink(const char* path);
+int fat_extents(const char* path, uint32_t* clusts, uint32_t* exts);
+int fat_defrag(const char* path);
 
 int fat_file_open(File* file, const char* path, uint8_t flags);
+int fat_file_open_entry(File* file, Dir* dir, uint8_t flags);
 int fat_file_close(File* file);
 int fat_file_read(File* file, void* buf, int len, int* bytes);
 int fat_file_write(File* file, const void* buf, int len, int* bytes);
 int fat_file_seek(File* file, int offset, int seek);
 int fat_file_sync(File* file);
+int fat_file_bmap(File* file, uint32_t* sects, int cnt);
 
 int fat_dir_create(Dir* dir, const char* path);
 int fat_dir_open(Dir* dir, const char* path);
 int fat_dir_read(Dir* dir, DirInfo* info);
 int fat_dir_rewind(Dir* dir);
 int fat_dir_next(Dir* dir);
+int fat_dir_read_batch(Dir* dir, DirEnt* ents, int max, char* names, int names_size, int* cnt);
+int fat_dir_lookup(Dir* dir, const char* name, int len, DirEnt* ent);
+int fat_dir_add(Dir* dir, const char* name, int len, uint8_t attr);
+int fat_dir_remove(Dir* dir, const char* name, int len);
+int fat_dir_enter(Dir* dir);
 
 void fat_get_timestamp(Timestamp* ts);
 
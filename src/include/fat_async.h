@@ -0,0 +1,17 @@
+#ifndef FAT_ASYNC_H
+#define FAT_ASYNC_H
+
+//------------------------------------------------------------------------------
+#include "fat.h"
+
+//------------------------------------------------------------------------------
+#define FAT_ASYNC_RING  16 // Maximum number of requests in flight
+
+//------------------------------------------------------------------------------
+int fat_file_read_async(File* file, void* buf, int len);
+int fat_file_write_async(File* file, const void* buf, int len);
+int fat_async_poll(int handle, int* bytes);
+int fat_async_wait(int handle, int* bytes);
+int fat_async_run(int budget);
+
+#endif
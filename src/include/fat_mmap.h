@@ -0,0 +1,17 @@
+#ifndef FAT_MMAP_H
+#define FAT_MMAP_H
+
+//------------------------------------------------------------------------------
+#include "fat.h"
+
+//------------------------------------------------------------------------------
+#define FAT_MMAP_MAX  8 // Maximum number of simultaneous mappings
+
+//------------------------------------------------------------------------------
+int fat_file_mmap(File* file, uint32_t vaddr, uint32_t len);
+int fat_file_munmap(uint32_t vaddr);
+int fat_mmap_evict(int cnt);
+bool fat_mmap_busy(Fat* fat, uint32_t clust);
+void fat_mmap_drop(Fat* fat, uint32_t clust, uint32_t offset, uint32_t len);
+
+#endif
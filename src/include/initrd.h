@@ -0,0 +1,43 @@
+#ifndef INITRD_H
+#define INITRD_H
+
+#include <stdint.h>
+
+// Image layout: header, index sorted by name, then file data. Offsets are from
+// the start of the image. The same definitions are used by tools/mkinitrd.c.
+//
+// Compressed files start with a block index, one uint32_t per block giving
+// its stored size, followed by the blocks. Each block is an independent raw
+// LZ4 block that unpacks to INITRD_BLOCK_SIZE bytes (less for the last one).
+#define INITRD_MAGIC      0x44524E49 // "INRD"
+#define INITRD_NAME_MAX   48
+#define INITRD_ALIGN      16         // File data alignment
+#define INITRD_BLOCK_SIZE 65536
+#define INITRD_BLOCK_RAW  0x80000000 // Block index flag: block is not compressed
+
+// Entry flags
+#define INITRD_LZ4        0x1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t count;
+} initrd_header_t;
+
+typedef struct {
+    char name[INITRD_NAME_MAX]; // NUL terminated
+    uint32_t offset;
+    uint32_t size;              // Unpacked size
+    uint32_t stored;            // Bytes in the image
+    uint32_t flags;
+} initrd_entry_t;
+
+int initrd_init(uint32_t start, uint32_t end);
+uint32_t initrd_count(void);
+const initrd_entry_t* initrd_entry(uint32_t idx);
+const initrd_entry_t* initrd_find(const char* name);
+const uint8_t* initrd_data(const initrd_entry_t* entry);
+uint32_t initrd_image_size(void);
+uint32_t initrd_unpacked_size(void);
+uint32_t initrd_resident_pages(void);
+
+#endif /* INITRD_H */
@@ -2,6 +2,7 @@
 #define KEYBOARD_H
 
 void keyboard_init_irq(void);
+int keyboard_has_input(void);
 char keyboard_getchar(void);
 
 #endif /* KEYBOARD_H */
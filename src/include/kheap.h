@@ -2,9 +2,35 @@
 #define KHEAP_H
 
 #include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    uint32_t mapped;       // Bytes of mapped heap
+    uint32_t used;         // Payload bytes of live allocations
+    uint32_t peak;         // Highest value of used
+    uint32_t blocks;       // Live allocations
+    uint32_t free;         // Payload bytes of free blocks
+    uint32_t free_blocks;
+    uint32_t largest_free;
+} kheap_stats_t;
+
+// Live allocations of one kmalloc call site, only kept when built with
+// KHEAP_PROFILE
+typedef struct {
+    void* caller;
+    uint32_t live;
+    uint32_t bytes;
+    uint32_t allocs; // Including freed ones
+} kheap_site_t;
 
 void kheap_init(void);
 void* kmalloc(size_t size);
 void kfree(void* ptr);
 
+void kheap_get_stats(kheap_stats_t* stats);
+void kheap_walk(void (*fn)(void* ptr, size_t size, void* caller));
+#ifdef KHEAP_PROFILE
+int kheap_get_sites(kheap_site_t* sites, int max);
+#endif
+
 #endif /* KHEAP_H */
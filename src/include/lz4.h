@@ -0,0 +1,8 @@
+#ifndef LZ4_H
+#define LZ4_H
+
+#include <stdint.h>
+
+int lz4_decompress(const uint8_t* src, uint32_t src_len, uint8_t* dst, uint32_t dst_len);
+
+#endif /* LZ4_H */
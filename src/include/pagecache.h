@@ -0,0 +1,33 @@
+#ifndef PAGECACHE_H
+#define PAGECACHE_H
+
+#include <stdint.h>
+
+// Pages are reclaimed when the PMM has fewer free frames than this
+#define PAGECACHE_MIN_FREE 256
+
+#define PAGECACHE_ALL 0xFFFFFFFF
+
+#define PAGECACHE_MAX_SHRINKERS 4
+
+// Frees up to count pages held outside the page cache, returns the number freed
+typedef uint32_t (*pagecache_shrinker_t)(uint32_t count);
+
+typedef struct {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t pages;
+    uint32_t reclaimed;
+} pagecache_stats_t;
+
+void pagecache_init(void);
+uint8_t* pagecache_find(const void* volume, uint32_t file, uint32_t index);
+uint8_t* pagecache_insert(const void* volume, uint32_t file, uint32_t index);
+void pagecache_invalidate(const void* volume, uint32_t file, uint32_t first, uint32_t count);
+void pagecache_invalidate_range(const void* volume, uint32_t file, uint32_t offset, uint32_t len);
+void pagecache_invalidate_volume(const void* volume);
+uint32_t pagecache_reclaim(uint32_t count);
+int pagecache_register_shrinker(pagecache_shrinker_t shrink);
+void pagecache_get_stats(pagecache_stats_t* stats);
+
+#endif /* PAGECACHE_H */
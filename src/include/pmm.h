@@ -7,10 +7,33 @@
 #define PAGE_SIZE 4096
 #define FRAME_SIZE PAGE_SIZE
 
-void pmm_init(uint32_t mem_low, uint32_t mem_high);
+#define PMM_MAX_ORDER 10 // Largest block is 2^10 frames (4 MiB)
+
+// Single-frame cache in front of the buddy allocator
+typedef struct {
+    uint32_t hits;    // pmm_alloc_frame served from the cache
+    uint32_t misses;  // pmm_alloc_frame that had to refill it
+    uint32_t drains;
+    uint32_t cached;  // Frames currently in the cache
+} pmm_cache_stats_t;
+
+uint32_t pmm_metadata_size(uint32_t mem_end);
+void pmm_init(uint32_t mem_end, uint32_t meta_addr);
+void pmm_add_region(uint32_t start, uint32_t end);
 void* pmm_alloc_frame(void);
+void* pmm_alloc_high_frame(void);
 void pmm_free_frame(void* addr);
+void* pmm_alloc_pages(uint32_t order);
+void pmm_free_pages(void* addr, uint32_t order);
+void pmm_ref_frame(void* addr);
+uint32_t pmm_get_frame_refs(void* addr);
+void pmm_reserve_range(uint32_t start, uint32_t end);
 uint32_t pmm_get_total_frames(void);
+uint32_t pmm_get_high_frames(void);
+uint32_t pmm_get_memory_end(void);
 uint32_t pmm_get_free_frames(void);
+uint32_t pmm_get_free_low_frames(void);
+uint32_t pmm_get_free_blocks(uint32_t order);
+void pmm_get_cache_stats(pmm_cache_stats_t* stats);
 
 #endif /* PMM_H */
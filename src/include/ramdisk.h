@@ -0,0 +1,14 @@
+#ifndef RAMDISK_H
+#define RAMDISK_H
+
+#include <stdint.h>
+#include "fat.h"
+
+#define RAMDISK_SECTOR_SIZE 512
+
+int ramdisk_init_image(uint32_t start, uint32_t end);
+int ramdisk_init_blank(uint32_t sectors);
+uint32_t ramdisk_sectors(void);
+void ramdisk_get_ops(DiskOps* ops);
+
+#endif
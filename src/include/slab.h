@@ -0,0 +1,26 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct kmem_cache kmem_cache_t;
+
+typedef struct {
+    const char* name;
+    uint32_t size;    // Object size
+    uint32_t in_use;  // Allocated objects
+    uint32_t total;   // Objects in all slabs
+    uint32_t slabs;
+    uint32_t pages;   // Pages per slab
+} kmem_cache_stats_t;
+
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align, void (*ctor)(void*));
+void* kmem_cache_alloc(kmem_cache_t* cache);
+void kmem_cache_free(kmem_cache_t* cache, void* obj);
+int kmem_cache_destroy(kmem_cache_t* cache);
+
+void kmem_cache_get_stats(const kmem_cache_t* cache, kmem_cache_stats_t* stats);
+kmem_cache_t* kmem_cache_next(kmem_cache_t* cache);
+
+#endif /* SLAB_H */
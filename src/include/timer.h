@@ -5,6 +5,7 @@
 
 void timer_init(uint32_t frequency);
 uint32_t timer_get_ticks(void);
+uint32_t timer_ticks_to_ms(uint32_t ticks);
 void timer_wait(uint32_t ticks);
 
 #endif /* TIMER_H */
@@ -20,6 +20,7 @@ enum vga_color {
 };
 
 void terminal_initialize(void);
+void terminal_map_buffer(void);
 void terminal_enable_cursor(void);
 void terminal_setcolor(unsigned char color);
 void terminal_set_position(unsigned int x, unsigned int y);
@@ -0,0 +1,133 @@
+#ifndef VFS_H
+#define VFS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define VFS_NAME_MAX   255
+#define VFS_MAX_MOUNTS 8
+#define VFS_MAX_FDS    32 // Per table, must fit the bitmask in vfs_fd_table_t
+
+// Error codes
+enum {
+    VFS_OK         =  0,
+    VFS_ERR_NOENT  = -1,
+    VFS_ERR_NOTDIR = -2,
+    VFS_ERR_ISDIR  = -3,
+    VFS_ERR_EXIST  = -4,
+    VFS_ERR_BADF   = -5,
+    VFS_ERR_MFILE  = -6, // Out of descriptors, open files or vnodes
+    VFS_ERR_BUSY   = -7,
+    VFS_ERR_PERM   = -8,
+    VFS_ERR_NOSPC  = -9,
+    VFS_ERR_IO     = -10,
+    VFS_ERR_INVAL  = -11,
+};
+
+// Node types
+enum {
+    VFS_FILE = 1,
+    VFS_DIR  = 2,
+};
+
+// Open flags
+#define VFS_O_READ   0x01
+#define VFS_O_WRITE  0x02
+#define VFS_O_CREATE 0x04
+#define VFS_O_TRUNC  0x08
+#define VFS_O_APPEND 0x10
+
+// Seek origins
+enum {
+    VFS_SEEK_SET,
+    VFS_SEEK_CUR,
+    VFS_SEEK_END,
+};
+
+struct vnode;
+struct vfs_file;
+
+// Directory entry returned by vfs_readdir. Names are packed into a separate
+// arena and are not NUL terminated.
+typedef struct {
+    uint32_t size;
+    uint16_t name_off;
+    uint8_t name_len;
+    uint8_t type;
+} vfs_dirent_t;
+
+typedef struct {
+    uint32_t type;
+    uint32_t size;
+} vfs_stat_t;
+
+// Filesystem backend. lookup and create fill in type, size and data of the
+// new vnode. read and write transfer at file->offset and return the number of
+// bytes moved or an error. readdir returns the number of entries, 0 at the
+// end. Optional operations are NULL.
+typedef struct vfs_ops {
+    int (*lookup)(struct vnode* dir, const char* name, int len, struct vnode* node);
+    int (*create)(struct vnode* dir, const char* name, int len, uint32_t type, struct vnode* node);
+    int (*remove)(struct vnode* dir, const char* name, int len);
+    int (*open)(struct vfs_file* file);
+    int (*close)(struct vfs_file* file);
+    int (*read)(struct vfs_file* file, void* buf, uint32_t len);
+    int (*write)(struct vfs_file* file, const void* buf, uint32_t len);
+    int (*readdir)(struct vfs_file* file, vfs_dirent_t* ents, int max, char* names, int names_size);
+    void (*release)(struct vnode* node); // Vnode dropped from the cache
+} vfs_ops_t;
+
+typedef struct vnode {
+    const vfs_ops_t* ops;
+    struct vnode* parent; // Holds a reference, so parents outlive children
+    struct vnode* hash_next;
+    struct vnode* lru_prev;
+    struct vnode* lru_next;
+    uint32_t refs;
+    uint32_t type;
+    uint32_t size;
+    void* data;           // Backend state
+    uint8_t name_len;
+    char name[VFS_NAME_MAX];
+} vnode_t;
+
+typedef struct vfs_file {
+    vnode_t* node;
+    uint32_t refs;        // Descriptors sharing this open file
+    uint32_t offset;
+    uint32_t flags;
+    void* data;           // Backend state
+} vfs_file_t;
+
+typedef struct {
+    vfs_file_t* files[VFS_MAX_FDS];
+    uint32_t used;        // Bit n set when descriptor n is open
+} vfs_fd_table_t;
+
+void vfs_init(void);
+int vfs_mount(const char* path, const vfs_ops_t* ops, uint32_t type, void* data);
+int vfs_mount_fat(const char* path, const char* volume);
+int vfs_mount_initrd(const char* path);
+int vfs_mount_tmpfs(const char* path);
+vnode_t* vfs_mount_root(const char* path, const char** rest);
+int vfs_evict_children(const char* path);
+struct Fat* vfs_fat_resolve(const char* path, char* fat_path, int size);
+
+void vfs_fd_table_init(vfs_fd_table_t* table);
+void vfs_set_fd_table(vfs_fd_table_t* table);
+
+int vfs_open(const char* path, uint32_t flags);
+int vfs_close(int fd);
+int vfs_dup(int fd);
+int vfs_read(int fd, void* buf, uint32_t len);
+int vfs_write(int fd, const void* buf, uint32_t len);
+int vfs_seek(int fd, int offset, int whence);
+int vfs_readdir(int fd, vfs_dirent_t* ents, int max, char* names, int names_size);
+int vfs_stat(const char* path, vfs_stat_t* st);
+int vfs_mkdir(const char* path);
+int vfs_unlink(const char* path);
+
+void vfs_cache_stats(uint32_t* hits, uint32_t* misses);
+const char* vfs_strerror(int err);
+
+#endif /* VFS_H */
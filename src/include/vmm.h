@@ -7,14 +7,71 @@
 #define PAGE_PRESENT    0x1
 #define PAGE_RW         0x2
 #define PAGE_USER       0x4
+#define PAGE_WC         0x8 // Write-combining, write-through without PAT
+#define PAGE_UC         0x18 // Uncached
+#define PAGE_LARGE      0x80 // Directory entry maps 4 MiB directly
+#define PAGE_GLOBAL     0x100 // Kept in the TLB across CR3 loads, set on kernel mappings
+#define PAGE_COW        0x200 // Shared read-only, copied on the first write
 #define PAGE_SIZE       4096
+#define LARGE_PAGE_SIZE 0x400000
+
+// Address space layout. User space takes everything below KERNEL_BASE except
+// the first 4 MiB, which stay unmapped to catch null pointers. The kernel part
+// from KERNEL_BASE up is shared by every directory: the kernel image and all
+// low memory in the direct map, then the kernel windows from
+// KERNEL_WINDOW_START. The last 4 MiB map the page tables of the active
+// directory through a recursive directory entry.
+#define KERNEL_BASE         0xC0000000
+#define USER_START          0x00400000
+#define USER_END            KERNEL_BASE
+#define KERNEL_WINDOW_START 0xE0000000
+#define PAGE_TABLES         0xFFC00000
+
+// Physical memory below DIRECT_MAP_SIZE is mapped at KERNEL_BASE, so the
+// kernel reaches it at a fixed offset. The kernel is linked at its load
+// address plus KERNEL_BASE.
+#define DIRECT_MAP_SIZE     (KERNEL_WINDOW_START - KERNEL_BASE)
+#define PHYS_TO_VIRT(addr)  ((void*)((uint32_t)(addr) + KERNEL_BASE))
+#define VIRT_TO_PHYS(addr)  ((uint32_t)(addr) - KERNEL_BASE)
+
+// Page fault error code bits
+#define PF_PRESENT 0x1 // Protection violation on a present page
+#define PF_WRITE   0x2
+#define PF_USER    0x4
+
+#define VMM_MAX_REGIONS 32
 
 typedef uint32_t* page_directory_t;
 
+// Called for faults in a lazy region with the faulting address. Returns 0
+// once the page is mapped, anything else makes the fault fatal.
+typedef int (*vmm_fault_t)(page_directory_t dir, uint32_t addr, uint32_t error, void* data);
+
 void vmm_init(void);
 void vmm_map(page_directory_t dir, uint32_t virt, uint32_t phys, uint32_t flags);
 void vmm_unmap(page_directory_t dir, uint32_t virt);
+void vmm_map_range(page_directory_t dir, uint32_t virt, uint32_t phys, uint32_t size, uint32_t flags);
+void vmm_unmap_range(page_directory_t dir, uint32_t virt, uint32_t size);
+void vmm_free_range(page_directory_t dir, uint32_t virt, uint32_t size);
+uint32_t vmm_get_pte(page_directory_t dir, uint32_t virt);
+void* vmm_map_temp(uint32_t phys);
+void vmm_unmap_temp(void* addr);
+int vmm_add_region(page_directory_t dir, uint32_t start, uint32_t end, vmm_fault_t fault, void* data);
+int vmm_add_zero_region(page_directory_t dir, uint32_t start, uint32_t end, uint32_t flags);
+void vmm_remove_region(page_directory_t dir, uint32_t start);
+
+page_directory_t vmm_create_directory(void);
+page_directory_t vmm_clone_directory(page_directory_t src);
+void vmm_destroy_directory(page_directory_t dir);
 void vmm_switch_directory(page_directory_t dir);
+page_directory_t vmm_get_current_directory(void);
 page_directory_t vmm_get_kernel_directory(void);
+int vmm_uses_pat(void);
+int vmm_uses_global_pages(void);
+int vmm_set_global_pages(int enable);
+
+void vmm_flush_page(uint32_t virt);
+void vmm_flush_tlb(void);
+void vmm_flush_tlb_global(void);
 
 #endif /* VMM_H */
@@ -1,20 +1,36 @@
 #include "commands.h"
 #include "fat.h"
+#include "fat_async.h"
+#include "fat_mmap.h"
+#include "initrd.h"
 #include "kheap.h"
+#include "pagecache.h"
+#include "pmm.h"
+#include "ramdisk.h"
+#include "serial.h"
+#include "slab.h"
 #include "tty.h"
+#include "timer.h"
+#include "vfs.h"
+#include "vmm.h"
 #include <stdio.h>
 #include <string.h>
 
-static char g_cwd[256] = "/root";
-static const size_t VOLUME_PREFIX_LEN = 5;
+extern Fat g_ramfs;
+
+static char g_cwd[256] = "/";
 
 static void build_path(char *dest, const char *filename, size_t filename_len) {
 
-        size_t cwd_len = strlen(g_cwd);
-        memcpy(dest, g_cwd, cwd_len);
+        size_t cwd_len = 0;
+
+        if (filename[0] != '/') {
+            cwd_len = strlen(g_cwd);
+            memcpy(dest, g_cwd, cwd_len);
         
-        if (cwd_len > 0 && g_cwd[cwd_len - 1] != '/') {
-            dest[cwd_len++] = '/';
+            if (cwd_len > 0 && g_cwd[cwd_len - 1] != '/') {
+                dest[cwd_len++] = '/';
+            }
         }
         
         memcpy(dest + cwd_len, filename, filename_len);
@@ -23,23 +39,77 @@ static void build_path(char *dest, const char *filename, size_t filename_len) {
 
 void cmd_ls(Fat *fs) {
     (void)fs;
-    Dir dir;
-    DirInfo info;
+    static vfs_dirent_t ents[64];
+    static char names[4096];
+    int count;
     
-    if (fat_dir_open(&dir, g_cwd) != FAT_ERR_NONE) {
+    int fd = vfs_open(g_cwd, VFS_O_READ);
+    if (fd < 0) {
         printf("Failed to open directory\n");
         return;
     }
     
     printf("Directory contents:\n");
-    while (fat_dir_read(&dir, &info) == FAT_ERR_NONE) {
-        if (info.attr & FAT_ATTR_DIR) {
-            printf("  [DIR]  %.*s\n", (int)info.name_len, info.name);
-        } else {
-            printf("  [FILE] %.*s (%u bytes)\n", (int)info.name_len, info.name, info.size);
+    while ((count = vfs_readdir(fd, ents, 64, names, sizeof(names))) > 0) {
+        for (int i = 0; i < count; i++) {
+            const char *name = names + ents[i].name_off;
+            if (ents[i].type == VFS_DIR) {
+                printf("  [DIR]  %.*s\n", (int)ents[i].name_len, name);
+            } else {
+                printf("  [FILE] %.*s (%u bytes)\n", (int)ents[i].name_len, name, ents[i].size);
+            }
         }
-        fat_dir_next(&dir);
     }
+    
+    if (count < 0) {
+        printf("ls: %s\n", vfs_strerror(count));
+    }
+    vfs_close(fd);
+}
+
+#define CAT_BLOCK 4096 // Bytes per asynchronous read
+#define CAT_CHUNK 512  // Bytes printed between worker steps
+
+// Prints a file on a FAT volume with two buffers. The next block is queued
+// before the current one is printed, and the worker moves a sector between
+// chunks of output, so reading the disk overlaps writing the terminal.
+// Returns 0 without printing anything if fat_path is not a file.
+static int cat_async(const char *fat_path) {
+    static File file;
+    static uint8_t blocks[2][CAT_BLOCK];
+
+    if (fat_file_open(&file, fat_path, FAT_READ) != FAT_ERR_NONE) {
+        return 0;
+    }
+    if (file.attr & FAT_ATTR_DIR) {
+        fat_file_close(&file);
+        return 0;
+    }
+
+    int cur = 0;
+    int handle = fat_file_read_async(&file, blocks[cur], CAT_BLOCK);
+    while (handle >= 0) {
+        int bytes;
+        int err = fat_async_wait(handle, &bytes);
+
+        handle = FAT_ERR_EOF;
+        if (err == FAT_ERR_NONE && bytes == CAT_BLOCK) {
+            handle = err = fat_file_read_async(&file, blocks[!cur], CAT_BLOCK);
+        }
+
+        for (int off = 0; off < bytes; off += CAT_CHUNK) {
+            int n = bytes - off < CAT_CHUNK ? bytes - off : CAT_CHUNK;
+            terminal_write((const char*)blocks[cur] + off, (unsigned int)n);
+            fat_async_run(1);
+        }
+        if (err < 0) {
+            printf("cat: read error: %s\n", fat_get_error(err));
+        }
+        cur = !cur;
+    }
+
+    fat_file_close(&file);
+    return 1;
 }
 
 void cmd_cat(Fat *fs, const char *filename) {
@@ -70,34 +140,25 @@ void cmd_cat(Fat *fs, const char *filename) {
     static char path[256];
     build_path(path, filename, name_len);
 
-    File file;
-    int err = fat_file_open(&file, path, FAT_READ);
-    if (err != FAT_ERR_NONE) {
-        printf("cat: cannot open '%.*s': %s\n", (int)name_len, filename, fat_get_error(err));
+    // Files on FAT volumes are read asynchronously, anything else through the VFS
+    static char fat_path[256 + 34];
+    if (vfs_fat_resolve(path, fat_path, sizeof(fat_path)) != NULL && cat_async(fat_path)) {
         return;
     }
 
-    // Check for empty files
-    if (file.size == 0) {
-        fat_file_close(&file);
-        return;
-    }
-
-    // Check for invalid cluster (shouldn't happen with non-empty files)
-    if (file.sclust == 0) {
-        printf("cat: '%.*s': invalid file cluster\n", (int)name_len, filename);
-        fat_file_close(&file);
+    int fd = vfs_open(path, VFS_O_READ);
+    if (fd < 0) {
+        printf("cat: cannot open '%.*s': %s\n", (int)name_len, filename, vfs_strerror(fd));
         return;
     }
 
     uint8_t buffer[512];
 
     for (;;) {
-        int bytes_read = 0;
-        err = fat_file_read(&file, buffer, sizeof(buffer), &bytes_read);
+        int bytes_read = vfs_read(fd, buffer, sizeof(buffer));
 
-        if (err != FAT_ERR_NONE) {
-            printf("cat: read error: %s\n", fat_get_error(err));
+        if (bytes_read < 0) {
+            printf("cat: read error: %s\n", vfs_strerror(bytes_read));
             break;
         }
 
@@ -108,7 +169,7 @@ void cmd_cat(Fat *fs, const char *filename) {
         terminal_write((const char*)buffer, (unsigned int)bytes_read);
     }
 
-    fat_file_close(&file);
+    vfs_close(fd);
 }
 
 void cmd_echo(Fat *fs, const char *text, const char *output_file, int is_append) {
@@ -126,24 +187,22 @@ void cmd_echo(Fat *fs, const char *text, const char *output_file, int is_append)
         }
         build_path(path, output_file, name_len);
         
-        File file;
-        uint8_t flags = FAT_WRITE | FAT_CREATE;
+        uint32_t flags = VFS_O_WRITE | VFS_O_CREATE;
         if (is_append) {
-            flags |= FAT_APPEND;
+            flags |= VFS_O_APPEND;
         } else {
-            flags |= FAT_TRUNC;
+            flags |= VFS_O_TRUNC;
         }
         
-        if (fat_file_open(&file, path, flags) != FAT_ERR_NONE) {
+        int fd = vfs_open(path, flags);
+        if (fd < 0) {
             printf("Failed to open file: %s\n", output_file);
             return;
         }
         
-        int bytes_written;
-        int len = strlen(text);
-        fat_file_write(&file, text, len, &bytes_written);
-        fat_file_write(&file, "\n", 1, &bytes_written);
-        fat_file_close(&file);
+        vfs_write(fd, text, strlen(text));
+        vfs_write(fd, "\n", 1);
+        vfs_close(fd);
     } else {
         printf("%s\n", text);
     }
@@ -158,9 +217,9 @@ void cmd_touch(Fat *fs, const char *filename) {
     }
     build_path(path, filename, name_len);
     
-    File file;
-    if (fat_file_open(&file, path, FAT_CREATE | FAT_WRITE) == FAT_ERR_NONE) {
-        fat_file_close(&file);
+    int fd = vfs_open(path, VFS_O_CREATE | VFS_O_WRITE);
+    if (fd >= 0) {
+        vfs_close(fd);
         printf("Created: %s\n", filename);
     } else {
         printf("Failed to create: %s\n", filename);
@@ -176,8 +235,7 @@ void cmd_mkdir(Fat *fs, const char *dirname) {
     }
     build_path(path, dirname, name_len);
     
-    Dir dir;
-    if (fat_dir_create(&dir, path) == FAT_ERR_NONE) {
+    if (vfs_mkdir(path) == VFS_OK) {
         printf("Created directory: %s\n", dirname);
     } else {
         printf("Failed to create directory: %s\n", dirname);
@@ -215,38 +273,30 @@ void cmd_cd(Fat *fs, const char *dirname) {
     }
     
     if (name_len == 2 && dirname[0] == '.' && dirname[1] == '.') {
-        size_t cwd_len = strlen(g_cwd);
-        if (cwd_len <= VOLUME_PREFIX_LEN) {
-            return;
-        }
-        
-        size_t i = cwd_len - 1;
-        if (g_cwd[i] == '/') i--;
+        size_t i = strlen(g_cwd);
         
-        while (i > VOLUME_PREFIX_LEN && g_cwd[i] != '/') {
+        while (i > 1 && g_cwd[i - 1] != '/') {
             i--;
         }
-        
-        if (i <= VOLUME_PREFIX_LEN) {
-            strncpy(g_cwd, "/root", sizeof(g_cwd) - 1);
-        } else {
-            g_cwd[i] = '\0';
-        }
+        g_cwd[i > 1 ? i - 1 : 1] = '\0';
         return;
     }
     
-    if (dirname[0] == '/') {
-        memcpy(new_path, "/root", 5);
-        memcpy(new_path + 5, dirname, name_len);
-        new_path[5 + name_len] = '\0';
-    } else {
-        build_path(new_path, dirname, name_len);
+    build_path(new_path, dirname, name_len);
+    
+    // Keep the cwd free of trailing slashes so '..' strips one component
+    size_t path_len = strlen(new_path);
+    while (path_len > 1 && new_path[path_len - 1] == '/') {
+        new_path[--path_len] = '\0';
     }
     
-    Dir dir;
-    int err = fat_dir_open(&dir, new_path);
-    if (err != FAT_ERR_NONE) {
-        printf("cd: cannot access '%.*s': %s\n", (int)name_len, dirname, fat_get_error(err));
+    vfs_stat_t st;
+    int err = vfs_stat(new_path, &st);
+    if (err == VFS_OK && st.type != VFS_DIR) {
+        err = VFS_ERR_NOTDIR;
+    }
+    if (err != VFS_OK) {
+        printf("cd: cannot access '%.*s': %s\n", (int)name_len, dirname, vfs_strerror(err));
         return;
     }
     
@@ -256,11 +306,873 @@ void cmd_cd(Fat *fs, const char *dirname) {
 
 void cmd_pwd(Fat *fs) {
     (void)fs;
-    if (strlen(g_cwd) > VOLUME_PREFIX_LEN) {
-        printf("%s\n", g_cwd + VOLUME_PREFIX_LEN);
+    printf("%s\n", g_cwd);
+}
+
+// Reads the whole file repeatedly for at least half a second and returns the
+// throughput in KiB/s.
+// Reads from disk, not from the page cache
+static uint32_t measure_read(Fat *fs, const char *path) {
+    static uint8_t buffer[16384];
+    uint32_t kib = 0;
+    uint32_t bytes = 0;
+    uint32_t start = timer_get_ticks();
+    uint32_t elapsed;
+
+    do {
+        pagecache_invalidate_volume(fs);
+        int fd = vfs_open(path, VFS_O_READ);
+        if (fd < 0) {
+            return 0;
+        }
+
+        int bytes_read;
+        do {
+            bytes_read = vfs_read(fd, buffer, sizeof(buffer));
+            if (bytes_read < 0) {
+                vfs_close(fd);
+                return 0;
+            }
+            bytes += bytes_read;
+            kib += bytes / 1024;
+            bytes %= 1024;
+        } while (bytes_read > 0);
+
+        vfs_close(fd);
+        elapsed = timer_get_ticks() - start;
+    } while (elapsed < 50);
+
+    return kib * 1000 / timer_ticks_to_ms(elapsed);
+}
+
+void cmd_defrag(Fat *fs, const char *filename) {
+    (void)fs;
+    static char path[256];
+    static char fat_path[256 + 34];
+    size_t name_len = 0;
+    while (name_len < 249 && filename[name_len]) {
+        name_len++;
+    }
+    if (name_len == 0) {
+        printf("Usage: defrag <path>\n");
+        return;
+    }
+    build_path(path, filename, name_len);
+
+    // Defragmenting is specific to FAT, which takes paths starting with the
+    // name of the volume mounted there
+    Fat *volume = vfs_fat_resolve(path, fat_path, sizeof(fat_path));
+    if (volume == NULL) {
+        printf("defrag: '%s' is not on a FAT volume\n", filename);
+        return;
+    }
+
+    uint32_t clusters, extents;
+    int err = fat_extents(fat_path, &clusters, &extents);
+    if (err != FAT_ERR_NONE) {
+        printf("defrag: cannot access '%s': %s\n", filename, fat_get_error(err));
+        return;
+    }
+
+    vfs_stat_t st;
+    int is_file = vfs_stat(path, &st) == VFS_OK && st.type == VFS_FILE;
+
+    printf("Before: %u extents, %u clusters", extents, clusters);
+    if (is_file) {
+        printf(", %u KiB/s", measure_read(volume, path));
+    }
+    printf("\n");
+
+    // Cached vnodes and open files point into the clusters that move
+    int busy = vfs_evict_children(path);
+    if (busy != VFS_OK) {
+        printf("defrag: '%s': %s\n", filename, vfs_strerror(busy));
+        return;
+    }
+
+    err = fat_defrag(fat_path);
+    if (err != FAT_ERR_NONE) {
+        printf("defrag: %s\n", fat_get_error(err));
+        return;
+    }
+
+    fat_extents(fat_path, &clusters, &extents);
+    printf("After:  %u extents, %u clusters", extents, clusters);
+    if (is_file) {
+        printf(", %u KiB/s", measure_read(volume, path));
+    }
+    printf("\n");
+}
+
+void cmd_initrd(const char *name) {
+    if (name == NULL || *name == '\0') {
+        uint32_t count = initrd_count();
+        printf("Initrd contents (%u files):\n", count);
+        for (uint32_t i = 0; i < count; i++) {
+            const initrd_entry_t *entry = initrd_entry(i);
+            if (entry->flags & INITRD_LZ4) {
+                printf("  %s (%u bytes, %u packed)\n", entry->name, entry->size, entry->stored);
+            } else {
+                printf("  %s (%u bytes)\n", entry->name, entry->size);
+            }
+        }
+        printf("Image %u KiB, unpacked files %u KiB resident\n",
+               initrd_image_size() / 1024, initrd_resident_pages() * 4);
+        return;
+    }
+
+    const initrd_entry_t *entry = initrd_find(name);
+    if (entry == NULL) {
+        printf("initrd: %s: not found\n", name);
+        return;
+    }
+
+    const uint8_t *data = initrd_data(entry);
+    if (data == NULL) {
+        printf("initrd: %s: cannot unpack\n", name);
+        return;
+    }
+
+    terminal_write((const char*)data, entry->size);
+}
+
+// Creates a blank RAM disk of the given size in MiB, formats it and mounts it
+// at /ram. Without a size, shows the current RAM disk.
+void cmd_ramdisk(const char *size) {
+    if (size == NULL || *size == '\0') {
+        if (ramdisk_sectors() == 0) {
+            printf("No RAM disk\n");
+        } else {
+            printf("RAM disk: %u KiB, %u free clusters\n", ramdisk_sectors() / 2, g_ramfs.free_cnt);
+        }
+        return;
+    }
+
+    uint32_t mib = 0;
+    for (; *size >= '0' && *size <= '9' && mib < 1024; size++) {
+        mib = mib * 10 + (*size - '0');
+    }
+    if (*size != '\0' || mib == 0 || mib >= 1024) {
+        printf("Usage: ramdisk [MiB]\n");
+        return;
+    }
+
+    if (ramdisk_sectors() != 0) {
+        printf("ramdisk: a RAM disk already exists\n");
+        return;
+    }
+    if (ramdisk_init_blank(mib * 2048) != 0) {
+        printf("ramdisk: not enough memory for %u MiB\n", mib);
+        return;
+    }
+
+    DiskOps ops;
+    ramdisk_get_ops(&ops);
+
+    uint32_t start = timer_get_ticks();
+    int err = fat_format(&ops, ramdisk_sectors(), "RAMDISK");
+    uint32_t format_ms = timer_ticks_to_ms(timer_get_ticks() - start);
+    if (err != FAT_ERR_NONE) {
+        printf("ramdisk: format failed: %s\n", fat_get_error(err));
+        return;
+    }
+
+    start = timer_get_ticks();
+    err = fat_mount(&ops, 0, &g_ramfs, "ram");
+    uint32_t mount_ms = timer_ticks_to_ms(timer_get_ticks() - start);
+    if (err != FAT_ERR_NONE) {
+        printf("ramdisk: mount failed: %s\n", fat_get_error(err));
+        return;
+    }
+
+    err = vfs_mount_fat("/ram", "ram");
+    if (err != VFS_OK) {
+        printf("ramdisk: %s\n", vfs_strerror(err));
+        return;
+    }
+    printf("Formatted in %u ms, mounted at /ram in %u ms (%u free clusters)\n",
+           format_ms, mount_ms, g_ramfs.free_cnt);
+}
+
+// Times batches of single-frame allocations with the PMM filled to 10%, 50%
+// and 90% of the low frames, which are the ones pmm_alloc_frame hands out
+void cmd_pmmbench(void) {
+    static void *held[4096];
+    static uint8_t held_order[4096];
+    static void *batch[64];
+    static const uint32_t levels[] = { 10, 50, 90 };
+    uint32_t low = pmm_get_total_frames() - pmm_get_high_frames();
+
+    printf("Free blocks by order:");
+    for (uint32_t order = 0; order <= PMM_MAX_ORDER; order++) {
+        printf(" %u", pmm_get_free_blocks(order));
+    }
+    printf("\n");
+
+    for (uint32_t i = 0; i < sizeof(levels) / sizeof(levels[0]); i++) {
+        // Fill with the largest blocks that fit so few allocations are held
+        uint32_t count = 0;
+        uint32_t order = PMM_MAX_ORDER;
+        while (count < 4096) {
+            uint32_t used = low - pmm_get_free_low_frames();
+            uint32_t target = low / 100 * levels[i];
+            if (used >= target) {
+                break;
+            }
+            while (order > 0 && (1u << order) > target - used) {
+                order--;
+            }
+            held[count] = pmm_alloc_pages(order);
+            if (held[count] == NULL) {
+                if (order == 0) {
+                    break;
+                }
+                order--;
+                continue;
+            }
+            held_order[count++] = order;
+        }
+
+        uint32_t allocs = 0;
+        uint32_t start = timer_get_ticks();
+        uint32_t elapsed;
+        uint32_t got;
+        do {
+            for (got = 0; got < 64; got++) {
+                batch[got] = pmm_alloc_frame();
+                if (batch[got] == NULL) {
+                    break;
+                }
+            }
+            for (uint32_t j = 0; j < got; j++) {
+                pmm_free_frame(batch[j]);
+            }
+            allocs += got;
+            elapsed = timer_ticks_to_ms(timer_get_ticks() - start);
+        } while (elapsed < 250 && got == 64);
+
+        if (got < 64) {
+            printf("%u%% used: out of frames after %u allocs\n", levels[i], allocs);
+        } else {
+            printf("%u%% used: %u allocs/s\n", levels[i], allocs / elapsed * 1000);
+        }
+
+        while (count > 0) {
+            count--;
+            pmm_free_pages(held[count], held_order[count]);
+        }
+    }
+}
+
+static uint32_t rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return lo;
+}
+
+// Randomly allocates and frees mixed sizes, mostly small, in 256 slots and
+// reports throughput and the slowest single operation
+void cmd_heapbench(void) {
+    static void *slots[256];
+    uint32_t seed = 2463534242u;
+    uint32_t ops = 0;
+    uint32_t failed = 0;
+    uint32_t worst = 0;
+    uint32_t start = timer_get_ticks();
+    uint32_t elapsed;
+
+    do {
+        for (int i = 0; i < 256; i++) {
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+
+            uint32_t slot = seed % 256;
+            uint32_t size = (seed >> 8) % 100 < 70 ? 16 + (seed >> 16) % 112
+                          : (seed >> 8) % 100 < 95 ? 128 + (seed >> 16) % 1920
+                          : 2048 + (seed >> 16) % 14336;
+
+            uint32_t t0 = rdtsc();
+            if (slots[slot] != NULL) {
+                kfree(slots[slot]);
+                slots[slot] = NULL;
+            } else {
+                slots[slot] = kmalloc(size);
+                failed += slots[slot] == NULL;
+            }
+            uint32_t cycles = rdtsc() - t0;
+
+            if (cycles > worst) {
+                worst = cycles;
+            }
+        }
+        ops += 256;
+        elapsed = timer_ticks_to_ms(timer_get_ticks() - start);
+    } while (elapsed < 250);
+
+    for (int i = 0; i < 256; i++) {
+        kfree(slots[i]);
+        slots[i] = NULL;
+    }
+
+    printf("%u ops/s, worst case %u cycles, %u failed allocations\n",
+           ops / elapsed * 1000, worst, failed);
+}
+
+#define TLBBENCH_BLOCKS 4           // 4 MiB blocks, more pages than the TLB holds
+#define TLBBENCH_PAGES  (TLBBENCH_BLOCKS * 1024)
+#define TLBBENCH_WINDOW 0xF0000000  // Unused virtual range for the 4 KiB mapping
+#define TLBBENCH_PASSES 8
+
+// Average cycles per load touching every page once per pass in random order
+static uint32_t tlb_walk(const uint32_t *pages, const uint16_t *order) {
+    volatile uint32_t sum = 0;
+    uint32_t t0 = 0;
+
+    // The first pass only warms the caches and the TLB
+    for (int pass = 0; pass <= TLBBENCH_PASSES; pass++) {
+        if (pass == 1) {
+            t0 = rdtsc();
+        }
+        for (int i = 0; i < TLBBENCH_PAGES; i++) {
+            sum += *(volatile uint32_t *)(pages[order[i]] + (i & 63) * 64);
+        }
+    }
+    return (rdtsc() - t0) / (TLBBENCH_PASSES * TLBBENCH_PAGES);
+}
+
+// Reads the same 16 MiB through the direct map and through a 4 KiB mapping
+// of it, so the difference is the cost of the extra TLB misses
+void cmd_tlbbench(void) {
+    static uint16_t order[TLBBENCH_PAGES];
+    static uint32_t direct[TLBBENCH_PAGES];
+    static uint32_t window[TLBBENCH_PAGES];
+    void *blocks[TLBBENCH_BLOCKS];
+    page_directory_t dir = vmm_get_kernel_directory();
+    uint32_t seed = 2463534242u;
+
+    for (int i = 0; i < TLBBENCH_BLOCKS; i++) {
+        blocks[i] = pmm_alloc_pages(10);
+        if (blocks[i] == NULL) {
+            printf("Not enough contiguous memory\n");
+            while (i-- > 0) {
+                pmm_free_pages(blocks[i], 10);
+            }
+            return;
+        }
+        for (int j = 0; j < 1024; j++) {
+            direct[i * 1024 + j] = (uint32_t)PHYS_TO_VIRT(blocks[i]) + j * PAGE_SIZE;
+        }
+    }
+
+    for (int i = 0; i < TLBBENCH_BLOCKS; i++) {
+        vmm_map_range(dir, TLBBENCH_WINDOW + i * LARGE_PAGE_SIZE, (uint32_t)blocks[i], LARGE_PAGE_SIZE,
+                      PAGE_PRESENT | PAGE_RW);
+    }
+    for (int i = 0; i < TLBBENCH_PAGES; i++) {
+        order[i] = i;
+        window[i] = TLBBENCH_WINDOW + i * PAGE_SIZE;
+    }
+    for (int i = TLBBENCH_PAGES - 1; i > 0; i--) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        int j = seed % (i + 1);
+        uint16_t tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+
+    uint32_t direct_cycles = tlb_walk(direct, order);
+    uint32_t window_cycles = tlb_walk(window, order);
+
+    vmm_unmap_range(dir, TLBBENCH_WINDOW, TLBBENCH_PAGES * PAGE_SIZE);
+    for (int i = 0; i < TLBBENCH_BLOCKS; i++) {
+        pmm_free_pages(blocks[i], 10);
+    }
+
+    printf("Direct map (4 MiB pages): %u cycles per load\n", direct_cycles);
+    printf("4 KiB mapping: %u cycles per load\n", window_cycles);
+}
+
+#define FORKBENCH_PAGES  4096 // 16 MiB touched in the parent
+#define FORKBENCH_ROUNDS 32
+#define FORKBENCH_WRITES 256
+
+// Clones a test address space with 16 MiB of touched memory and destroys the
+// clone, which is what fork followed by exit costs. Also times the faults of
+// a clone writing to shared pages and, for comparison, copying everything.
+void cmd_forkbench(void) {
+    static uint32_t copies[FORKBENCH_PAGES];
+    page_directory_t kernel = vmm_get_current_directory();
+    volatile uint32_t *mem = (volatile uint32_t *)USER_START;
+    const uint32_t words = PAGE_SIZE / sizeof(uint32_t);
+
+    page_directory_t parent = vmm_create_directory();
+    if (parent == NULL ||
+        vmm_add_zero_region(parent, USER_START, USER_START + FORKBENCH_PAGES * PAGE_SIZE, PAGE_RW) != 0) {
+        printf("Out of memory\n");
+        vmm_destroy_directory(parent);
+        return;
+    }
+
+    vmm_switch_directory(parent);
+    for (uint32_t i = 0; i < FORKBENCH_PAGES; i++) {
+        mem[i * words] = i;
+    }
+
+    uint32_t fork_cycles = 0;
+    for (int round = 0; round < FORKBENCH_ROUNDS; round++) {
+        uint32_t t0 = rdtsc();
+        page_directory_t child = vmm_clone_directory(parent);
+        if (child == NULL) {
+            printf("Out of memory\n");
+            break;
+        }
+        vmm_destroy_directory(child);
+        fork_cycles += rdtsc() - t0;
+    }
+
+    uint32_t cow_cycles = 0;
+    int isolated = 0;
+    page_directory_t child = vmm_clone_directory(parent);
+    if (child != NULL) {
+        vmm_switch_directory(child);
+        uint32_t t0 = rdtsc();
+        for (uint32_t i = 0; i < FORKBENCH_WRITES; i++) {
+            mem[i * words] = ~i;
+        }
+        cow_cycles = rdtsc() - t0;
+
+        vmm_switch_directory(parent);
+        isolated = mem[0] == 0 && mem[(FORKBENCH_WRITES - 1) * words] == FORKBENCH_WRITES - 1;
+        vmm_destroy_directory(child);
+    }
+
+    uint32_t t0 = rdtsc();
+    uint32_t copied = 0;
+    for (; copied < FORKBENCH_PAGES; copied++) {
+        copies[copied] = (uint32_t)pmm_alloc_frame();
+        if (copies[copied] == 0) {
+            break;
+        }
+        memcpy(PHYS_TO_VIRT(copies[copied]), (const void *)(USER_START + copied * PAGE_SIZE), PAGE_SIZE);
+    }
+    uint32_t copy_cycles = rdtsc() - t0;
+    for (uint32_t i = 0; i < copied; i++) {
+        pmm_free_frame((void *)copies[i]);
+    }
+
+    vmm_switch_directory(kernel);
+    vmm_destroy_directory(parent);
+
+    printf("fork+exit of a 16 MiB address space: %u cycles\n", fork_cycles / FORKBENCH_ROUNDS);
+    printf("Copy-on-write fault: %u cycles per page, parent %s\n",
+           cow_cycles / FORKBENCH_WRITES, isolated ? "unchanged" : "CORRUPTED");
+    printf("Eager copy of %u pages: %u cycles\n", copied, copy_cycles);
+}
+
+#define SWITCHBENCH_PAGES  64 // Kernel heap pages touched after every switch
+#define SWITCHBENCH_ROUNDS 4096
+
+// Average cycles to switch to the other address space and touch the kernel
+// working set, which has to be refilled into the TLB unless it is global
+static uint32_t switch_rounds(page_directory_t a, page_directory_t b, volatile uint8_t *buf) {
+    uint32_t t0 = 0;
+
+    // The first round only warms the caches
+    for (int round = 0; round <= SWITCHBENCH_ROUNDS; round++) {
+        if (round == 1) {
+            t0 = rdtsc();
+        }
+        vmm_switch_directory(round & 1 ? b : a);
+        for (int i = 0; i < SWITCHBENCH_PAGES; i++) {
+            buf[i * PAGE_SIZE]++;
+        }
+    }
+    return (rdtsc() - t0) / SWITCHBENCH_ROUNDS;
+}
+
+// Bounces between two address spaces with and without global kernel pages
+void cmd_switchbench(void) {
+    page_directory_t kernel = vmm_get_current_directory();
+    page_directory_t a = vmm_create_directory();
+    page_directory_t b = vmm_create_directory();
+    uint8_t *buf = kmalloc(SWITCHBENCH_PAGES * PAGE_SIZE);
+
+    if (a == NULL || b == NULL || buf == NULL) {
+        printf("Out of memory\n");
+        vmm_destroy_directory(a);
+        vmm_destroy_directory(b);
+        kfree(buf);
+        return;
+    }
+
+    int global = vmm_set_global_pages(0);
+    uint32_t local_cycles = switch_rounds(a, b, buf);
+    vmm_set_global_pages(global);
+    uint32_t global_cycles = switch_rounds(a, b, buf);
+
+    vmm_switch_directory(kernel);
+    vmm_destroy_directory(a);
+    vmm_destroy_directory(b);
+    kfree(buf);
+
+    printf("Switch and touch %u kernel pages: %u cycles with a full flush\n", SWITCHBENCH_PAGES, local_cycles);
+    if (vmm_uses_global_pages()) {
+        printf("With global kernel pages: %u cycles\n", global_cycles);
     } else {
-        printf("/\n");
+        printf("No global page support\n");
+    }
+}
+
+#define MAPBENCH_SIZE (64 * 1024 * 1024)
+
+// Maps and unmaps 64 MiB of a test address space page by page and as one
+// range. The pages point at low memory and are never touched.
+void cmd_mapbench(void) {
+    page_directory_t kernel = vmm_get_current_directory();
+    page_directory_t dir = vmm_create_directory();
+    const uint32_t flags = PAGE_PRESENT | PAGE_RW | PAGE_USER;
+
+    if (dir == NULL) {
+        printf("Out of memory\n");
+        return;
+    }
+    vmm_switch_directory(dir);
+
+    uint32_t t0 = rdtsc();
+    for (uint32_t off = 0; off < MAPBENCH_SIZE; off += PAGE_SIZE) {
+        vmm_map(dir, USER_START + off, off, flags);
+    }
+    uint32_t map_cycles = rdtsc() - t0;
+
+    t0 = rdtsc();
+    for (uint32_t off = 0; off < MAPBENCH_SIZE; off += PAGE_SIZE) {
+        vmm_unmap(dir, USER_START + off);
+    }
+    uint32_t unmap_cycles = rdtsc() - t0;
+
+    // Frees the empty tables vmm_unmap leaves behind
+    vmm_unmap_range(dir, USER_START, MAPBENCH_SIZE);
+
+    t0 = rdtsc();
+    vmm_map_range(dir, USER_START, 0, MAPBENCH_SIZE, flags);
+    uint32_t map_range_cycles = rdtsc() - t0;
+
+    t0 = rdtsc();
+    vmm_unmap_range(dir, USER_START, MAPBENCH_SIZE);
+    uint32_t unmap_range_cycles = rdtsc() - t0;
+
+    vmm_switch_directory(kernel);
+    vmm_destroy_directory(dir);
+
+    printf("Map 64 MiB: %u cycles page by page, %u as a range\n", map_cycles, map_range_cycles);
+    printf("Unmap 64 MiB: %u cycles page by page, %u as a range\n", unmap_cycles, unmap_range_cycles);
+}
+
+#define BLITBENCH_WIDTH  160 // Game Boy screen, one byte per pixel
+#define BLITBENCH_HEIGHT 144
+#define BLITBENCH_VRAM   0xBA000    // Text pages 2 to 7, off screen in text mode
+#define BLITBENCH_SIZE   0x6000
+#define BLITBENCH_WINDOW 0xF1000000 // Unused virtual range for the test mappings
+#define BLITBENCH_FRAMES 64
+
+// Average cycles to copy a frame with 32-bit stores. The locked add drains
+// the write-combining buffers, so every frame has reached memory.
+static uint32_t blit_frames(volatile uint32_t *dst, const uint32_t *frame) {
+    uint32_t t0 = rdtsc();
+    for (int i = 0; i < BLITBENCH_FRAMES; i++) {
+        for (int j = 0; j < BLITBENCH_WIDTH * BLITBENCH_HEIGHT / 4; j++) {
+            dst[j] = frame[j];
+        }
+        __asm__ __volatile__("lock; addl $0, (%%esp)" ::: "memory");
+    }
+    return (rdtsc() - t0) / BLITBENCH_FRAMES;
+}
+
+// Copies frames into spare VGA memory through an uncached and a
+// write-combining mapping, with ordinary memory for reference
+void cmd_blitbench(void) {
+    static uint32_t frame[BLITBENCH_WIDTH * BLITBENCH_HEIGHT / 4];
+    static uint32_t ram[BLITBENCH_WIDTH * BLITBENCH_HEIGHT / 4];
+    page_directory_t dir = vmm_get_kernel_directory();
+    uint32_t uc = BLITBENCH_WINDOW;
+    uint32_t wc = BLITBENCH_WINDOW + BLITBENCH_SIZE;
+
+    for (int i = 0; i < BLITBENCH_WIDTH * BLITBENCH_HEIGHT / 4; i++) {
+        frame[i] = i * 2654435761u;
+    }
+    vmm_map_range(dir, uc, BLITBENCH_VRAM, BLITBENCH_SIZE, PAGE_PRESENT | PAGE_RW | PAGE_UC);
+    vmm_map_range(dir, wc, BLITBENCH_VRAM, BLITBENCH_SIZE, PAGE_PRESENT | PAGE_RW | PAGE_WC);
+
+    uint32_t ram_cycles = blit_frames(ram, frame);
+    uint32_t uc_cycles = blit_frames((volatile uint32_t *)uc, frame);
+    uint32_t wc_cycles = blit_frames((volatile uint32_t *)wc, frame);
+
+    vmm_unmap_range(dir, BLITBENCH_WINDOW, 2 * BLITBENCH_SIZE);
+
+    printf("%ux%u frame blit: %u cycles to RAM, %u uncached, %u %s\n", BLITBENCH_WIDTH, BLITBENCH_HEIGHT,
+           ram_cycles, uc_cycles, wc_cycles, vmm_uses_pat() ? "write-combining" : "write-through (no PAT)");
+}
+
+#define LSBENCH_FILES 5000
+
+// Cycles to list a directory once with fat_dir_read and fat_dir_next
+static uint32_t list_single(const char *fat_path, uint32_t *count) {
+    static DirInfo info;
+    Dir dir;
+
+    *count = 0;
+    uint32_t t0 = rdtsc();
+    if (fat_dir_open(&dir, fat_path) != FAT_ERR_NONE) {
+        return 0;
+    }
+    while (fat_dir_read(&dir, &info) == FAT_ERR_NONE) {
+        (*count)++;
+        if (fat_dir_next(&dir) != FAT_ERR_NONE) {
+            break;
+        }
+    }
+    return rdtsc() - t0;
+}
+
+// Cycles to list a directory once with fat_dir_read_batch
+static uint32_t list_batch(const char *fat_path, uint32_t *count) {
+    static DirEnt ents[64];
+    static char names[4096];
+    Dir dir;
+    int cnt;
+    int err = FAT_ERR_NONE;
+
+    *count = 0;
+    uint32_t t0 = rdtsc();
+    if (fat_dir_open(&dir, fat_path) != FAT_ERR_NONE) {
+        return 0;
+    }
+    while (err == FAT_ERR_NONE) {
+        err = fat_dir_read_batch(&dir, ents, 64, names, sizeof(names), &cnt);
+        *count += cnt;
+    }
+    return rdtsc() - t0;
+}
+
+// Lists a FAT directory entry by entry and in batches. A directory that does
+// not exist yet is created with 5000 empty files first.
+void cmd_lsbench(const char *dirname) {
+    static char path[256];
+    static char fat_path[256 + 34];
+    size_t name_len = 0;
+    while (name_len < 249 && dirname[name_len]) {
+        name_len++;
+    }
+    build_path(path, dirname, name_len);
+
+    if (vfs_fat_resolve(path, fat_path, sizeof(fat_path)) == NULL) {
+        printf("lsbench: '%s' is not on a FAT volume\n", dirname);
+        return;
+    }
+
+    Dir dir;
+    if (fat_dir_open(&dir, fat_path) != FAT_ERR_NONE) {
+        int err = fat_dir_create(&dir, fat_path);
+        if (err == FAT_ERR_NONE) {
+            err = fat_dir_open(&dir, fat_path);
+        }
+
+        char name[] = "entry_0000.dat";
+        for (int i = 0; i < LSBENCH_FILES && err == FAT_ERR_NONE; i++) {
+            Dir entry = dir;
+            name[6] = '0' + i / 1000;
+            name[7] = '0' + i / 100 % 10;
+            name[8] = '0' + i / 10 % 10;
+            name[9] = '0' + i % 10;
+            err = fat_dir_add(&entry, name, sizeof(name) - 1, FAT_ATTR_ARCHIVE);
+        }
+        if (err != FAT_ERR_NONE) {
+            printf("lsbench: cannot fill '%s': %s\n", dirname, fat_get_error(err));
+            return;
+        }
+    }
+
+    uint32_t single_count, batch_count;
+    uint32_t single_cycles = list_single(fat_path, &single_count);
+    uint32_t batch_cycles = list_batch(fat_path, &batch_count);
+    if (single_count == 0 || batch_count == 0) {
+        printf("lsbench: '%s' is empty\n", dirname);
+        return;
+    }
+
+    printf("fat_dir_read: %u entries, %u cycles per entry\n", single_count, single_cycles / single_count);
+    printf("fat_dir_read_batch: %u entries, %u cycles per entry\n", batch_count, batch_cycles / batch_count);
+}
+
+#define MMAPBENCH_WINDOW 0xF2000000 // Unused virtual range for the mapping
+#define MMAPBENCH_SIZE   (16 * 1024 * 1024)
+#define MMAPBENCH_STRIDE (64 * 1024) // Bytes between touched pages
+
+// Touches one byte per stride of the mapping and counts those that differ
+// from what the read saw
+static uint32_t touch_mapping(const uint8_t *samples, uint32_t size) {
+    volatile uint8_t *map = (volatile uint8_t *)MMAPBENCH_WINDOW;
+    uint32_t bad = 0;
+
+    for (uint32_t off = 0; off < size; off += MMAPBENCH_STRIDE) {
+        bad += map[off] != samples[off / MMAPBENCH_STRIDE];
+    }
+    return bad;
+}
+
+// Compares reading a whole file with mapping it and touching a few pages,
+// then evicts the pages and checks that they read back the same
+void cmd_mmapbench(const char *filename) {
+    static char path[256];
+    static char fat_path[256 + 34];
+    static uint8_t buf[4096];
+    static uint8_t samples[MMAPBENCH_SIZE / MMAPBENCH_STRIDE];
+    size_t name_len = 0;
+    while (name_len < 249 && filename[name_len]) {
+        name_len++;
+    }
+    build_path(path, filename, name_len);
+
+    File file;
+    if (vfs_fat_resolve(path, fat_path, sizeof(fat_path)) == NULL ||
+        fat_file_open(&file, fat_path, FAT_READ) != FAT_ERR_NONE) {
+        printf("mmapbench: cannot open '%s' on a FAT volume\n", filename);
+        return;
+    }
+
+    uint32_t size = file.size < MMAPBENCH_SIZE ? file.size : MMAPBENCH_SIZE;
+    if (size == 0) {
+        printf("mmapbench: '%s' is empty\n", filename);
+        fat_file_close(&file);
+        return;
+    }
+
+    uint32_t start = timer_get_ticks();
+    uint32_t pos = 0;
+    int bytes = 0;
+    while (pos < size && fat_file_read(&file, buf, sizeof(buf), &bytes) == FAT_ERR_NONE && bytes > 0) {
+        for (uint32_t off = (pos + MMAPBENCH_STRIDE - 1) & ~(MMAPBENCH_STRIDE - 1);
+             off < pos + (uint32_t)bytes && off < size; off += MMAPBENCH_STRIDE) {
+            samples[off / MMAPBENCH_STRIDE] = buf[off - pos];
+        }
+        pos += bytes;
+    }
+    uint32_t read_ms = timer_ticks_to_ms(timer_get_ticks() - start);
+
+    int err = fat_file_mmap(&file, MMAPBENCH_WINDOW, size);
+    if (err != FAT_ERR_NONE) {
+        printf("mmapbench: cannot map '%s': %s\n", filename, fat_get_error(err));
+        fat_file_close(&file);
+        return;
+    }
+
+    start = timer_get_ticks();
+    uint32_t bad = touch_mapping(samples, size);
+    uint32_t map_ms = timer_ticks_to_ms(timer_get_ticks() - start);
+
+    int evicted = fat_mmap_evict(size / PAGE_SIZE + 1);
+    bad += touch_mapping(samples, size);
+
+    fat_file_munmap(MMAPBENCH_WINDOW);
+    fat_file_close(&file);
+
+    printf("Read %u KiB: %u ms\n", size / 1024, read_ms);
+    printf("Map and touch %u pages: %u ms\n", (size + MMAPBENCH_STRIDE - 1) / MMAPBENCH_STRIDE, map_ms);
+    printf("Evicted %d pages, %u sampled bytes differed from the read\n", evicted, bad);
+}
+
+void cmd_cache(void) {
+    pagecache_stats_t st;
+    uint32_t hits, misses;
+
+    pagecache_get_stats(&st);
+    printf("Page cache: %u pages (%u KiB), %u hits, %u misses, %u reclaimed\n",
+           st.pages, st.pages * 4, st.hits, st.misses, st.reclaimed);
+
+    vfs_cache_stats(&hits, &misses);
+    printf("Vnode cache: %u hits, %u misses\n", hits, misses);
+
+    pmm_cache_stats_t frames;
+    pmm_get_cache_stats(&frames);
+    printf("Frame cache: %u frames, %u hits, %u misses, %u drains\n",
+           frames.cached, frames.hits, frames.misses, frames.drains);
+}
+
+void cmd_slabinfo(void) {
+    for (kmem_cache_t* cache = kmem_cache_next(NULL); cache != NULL; cache = kmem_cache_next(cache)) {
+        kmem_cache_stats_t st;
+        kmem_cache_get_stats(cache, &st);
+        printf("%s: %u/%u objects of %u bytes in use, %u slabs of %u pages\n",
+               st.name, st.in_use, st.total, st.size, st.slabs, st.pages);
+    }
+}
+
+static void serial_write_hex(uint32_t value) {
+    char buf[11] = "0x";
+    for (int i = 0; i < 8; i++) {
+        buf[2 + i] = "0123456789abcdef"[(value >> (28 - 4 * i)) & 0xF];
+    }
+    buf[10] = '\0';
+    serial_write(buf);
+}
+
+static uint32_t dumped_blocks;
+
+static void dump_block(void *ptr, size_t size, void *caller) {
+    serial_write("kheap ");
+    serial_write_hex((uint32_t)ptr);
+    serial_write(" size ");
+    serial_write_hex(size);
+    if (caller != NULL) {
+        serial_write(" from ");
+        serial_write_hex((uint32_t)caller);
+    }
+    serial_write("\n");
+    dumped_blocks++;
+}
+
+// Prints heap usage and fragmentation. "dump" writes every live allocation
+// to the serial port instead.
+void cmd_meminfo(const char *arg) {
+    if (arg != NULL && strcmp(arg, "dump") == 0) {
+        dumped_blocks = 0;
+        kheap_walk(dump_block);
+        printf("Wrote %u live allocations to serial\n", dumped_blocks);
+        return;
+    }
+
+    kheap_stats_t st;
+    kheap_get_stats(&st);
+
+    // Share of free memory outside the largest block, scaled to avoid overflow
+    uint32_t largest = st.largest_free;
+    uint32_t free = st.free;
+    while (free > 0xFFFFFFFF / 100) {
+        largest >>= 1;
+        free >>= 1;
+    }
+    uint32_t fragmentation = free ? 100 - largest * 100 / free : 0;
+
+    printf("Heap: %u KiB mapped, %u KiB used in %u blocks, peak %u KiB\n",
+           st.mapped / 1024, st.used / 1024, st.blocks, st.peak / 1024);
+    printf("Free: %u KiB in %u blocks, largest %u KiB, fragmentation %u%%\n",
+           st.free / 1024, st.free_blocks, st.largest_free / 1024, fragmentation);
+    printf("PMM: %u of %u frames free\n", pmm_get_free_frames(), pmm_get_total_frames());
+
+#ifdef KHEAP_PROFILE
+    static kheap_site_t sites[10];
+    int count = kheap_get_sites(sites, 10);
+    printf("Top allocators:\n");
+    for (int i = 0; i < count; i++) {
+        printf("  %x: %u bytes in %u blocks, %u allocations\n",
+               (uint32_t)sites[i].caller, sites[i].bytes, sites[i].live, sites[i].allocs);
     }
+#else
+    printf("Build with KHEAP_PROFILE=1 for per call site statistics\n");
+#endif
 }
 
 void cmd_help(void) {
@@ -272,6 +1184,21 @@ void cmd_help(void) {
     printf("  mkdir <dir>      - Create directory\n");
     printf("  cd <dir>         - Change directory\n");
     printf("  pwd              - Print working directory\n");
+    printf("  defrag <path>    - Make a file or directory contiguous\n");
+    printf("  initrd [file]    - List initrd files or display one\n");
+    printf("  cache            - Show page, vnode and frame cache statistics\n");
+    printf("  ramdisk [MiB]    - Create a FAT32 RAM disk at /ram or show it\n");
+    printf("  pmmbench         - Benchmark frame allocation at 10/50/90%% usage\n");
+    printf("  heapbench        - Benchmark kmalloc/kfree with mixed sizes\n");
+    printf("  slabinfo         - Show object cache usage\n");
+    printf("  meminfo [dump]   - Show heap usage or dump allocations to serial\n");
+    printf("  tlbbench         - Compare loads through 4 MiB and 4 KiB pages\n");
+    printf("  forkbench        - Time copy-on-write address space clones\n");
+    printf("  switchbench      - Time address space switches with global kernel pages\n");
+    printf("  mapbench         - Time mapping 64 MiB page by page and as a range\n");
+    printf("  blitbench        - Compare frame blits to uncached and write-combining VGA memory\n");
+    printf("  lsbench <dir>    - Time listing a FAT directory entry by entry and in batches\n");
+    printf("  mmapbench <file> - Compare reading a FAT file with mapping it on demand\n");
     printf("  help             - Show this help\n");
     printf("  clear            - Clear the screen\n");
 }
@@ -2,14 +2,28 @@
 #include "keyboard.h"
 #include "io.h"
 #include "pmm.h"
+#include "vmm.h"
 #include "kheap.h"
 #include "idt.h"
 #include "timer.h"
 #include "serial.h"
 #include "ata.h"
+#include "ramdisk.h"
 #include "fat.h"
+#include "initrd.h"
 #include "shell.h"
+#include "vfs.h"
+#include "pagecache.h"
 #include <stdio.h>
+#include <stdlib.h>
+
+#define MULTIBOOT_INFO_MEMORY  0x00000001
+#define MULTIBOOT_INFO_MODS    0x00000008
+#define MULTIBOOT_INFO_MEM_MAP 0x00000040
+
+#define MULTIBOOT_MEMORY_AVAILABLE 1
+
+#define MAX_REGIONS 32
 
 typedef struct multiboot_info {
     uint32_t flags;
@@ -31,6 +45,15 @@ typedef struct multiboot_mod {
     uint32_t reserved;
 } multiboot_mod_t;
 
+typedef struct multiboot_mmap_entry {
+    uint32_t size; // Size of the rest of the entry
+    uint64_t addr;
+    uint64_t len;
+    uint32_t type;
+} __attribute__((packed)) multiboot_mmap_entry_t;
+
+extern uint8_t kernel_end[];
+
 static void print_ok(const char *msg) {
     terminal_writestring_color("[OK]", VGA_COLOR_LIGHT_GREEN, VGA_COLOR_BLACK);
     printf(" %s\n", msg);
@@ -85,11 +108,95 @@ static bool fat_write_sector(const uint8_t *buf, uint32_t sect) {
     return ata_write_sectors(sect, 1, (uint8_t*)buf) == 0;
 }
 
+static bool fat_read_sectors(uint8_t *buf, uint32_t sect, uint32_t cnt) {
+    while (cnt > 0) {
+        uint8_t n = cnt > 128 ? 128 : cnt;
+        if (ata_read_sectors(sect, n, buf) != 0) {
+            return false;
+        }
+        buf += n * 512;
+        sect += n;
+        cnt -= n;
+    }
+    return true;
+}
+
+// Collects the available RAM regions below 4 GiB from the bootloader
+static uint32_t read_memory_map(multiboot_info_t *mboot_info, uint32_t *starts, uint32_t *ends) {
+    uint32_t count = 0;
+
+    if (mboot_info->flags & MULTIBOOT_INFO_MEM_MAP) {
+        uint32_t addr = (uint32_t)PHYS_TO_VIRT(mboot_info->mmap_addr);
+        uint32_t end = addr + mboot_info->mmap_length;
+
+        while (addr < end && count < MAX_REGIONS) {
+            multiboot_mmap_entry_t *entry = (multiboot_mmap_entry_t *)addr;
+            addr += entry->size + sizeof(entry->size);
+
+            if (entry->type != MULTIBOOT_MEMORY_AVAILABLE || entry->addr >= 0x100000000ULL) {
+                continue;
+            }
+            uint64_t region_end = entry->addr + entry->len;
+            starts[count] = (uint32_t)entry->addr;
+            ends[count] = region_end > 0xFFFFF000ULL ? 0xFFFFF000 : (uint32_t)region_end;
+            count++;
+        }
+    } else if (mboot_info->flags & MULTIBOOT_INFO_MEMORY) {
+        // Only the size of the memory above 1 MiB is known
+        starts[0] = 0x00100000;
+        ends[0] = 0x00100000 + mboot_info->mem_upper * 1024;
+        count = 1;
+    }
+
+    return count;
+}
+
+// Hands all available RAM above reserved_end to the PMM. Its metadata goes in
+// the first region of low memory with room for it.
+static void init_memory(multiboot_info_t *mboot_info, uint32_t reserved_end) {
+    static uint32_t starts[MAX_REGIONS];
+    static uint32_t ends[MAX_REGIONS];
+    uint32_t count = read_memory_map(mboot_info, starts, ends);
+    uint32_t mem_end = 0;
+
+    reserved_end = (reserved_end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (starts[i] < reserved_end) {
+            starts[i] = reserved_end;
+        }
+        if (ends[i] > mem_end) {
+            mem_end = ends[i];
+        }
+    }
+
+    uint32_t meta_size = pmm_metadata_size(mem_end);
+    uint32_t meta_addr = 0;
+    for (uint32_t i = 0; i < count && meta_addr == 0; i++) {
+        uint32_t start = (starts[i] + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+        uint32_t end = ends[i] < DIRECT_MAP_SIZE ? ends[i] : DIRECT_MAP_SIZE;
+        if (end > start && end - start >= meta_size) {
+            meta_addr = start;
+        }
+    }
+
+    if (meta_addr == 0) {
+        printf("No usable memory found\n");
+        abort();
+    }
+
+    pmm_init(mem_end, meta_addr);
+    for (uint32_t i = 0; i < count; i++) {
+        pmm_add_region(starts[i], ends[i]);
+    }
+}
+
 Fat g_fs;
+Fat g_ramfs;
 
+// Called by loader.s with paging on. The multiboot structures hold physical
+// addresses, which the boot directory maps at KERNEL_BASE like the kernel.
 void kmain(multiboot_info_t *mboot_info) {
-    (void)mboot_info;
-    
     terminal_initialize();
     terminal_enable_cursor();
     boot_animation();
@@ -115,26 +222,98 @@ void kmain(multiboot_info_t *mboot_info) {
     keyboard_init_irq();
     print_ok("Keyboard IRQ handler registered");
     
-    pmm_init(0x00400000, 0x02000000);
-    printf("[OK] PMM initialized (%d frames available)\n", pmm_get_free_frames());
+    // The first module is the initrd, an optional second one is a FAT32 image
+    // used as the RAM disk. Everything up to the end of the modules is kept
+    // out of the PMM. Modules are used in place through the direct map.
+    multiboot_mod_t *initrd_mod = NULL;
+    multiboot_mod_t *ramdisk_mod = NULL;
+    uint32_t reserved_end = VIRT_TO_PHYS(kernel_end);
+    if ((mboot_info->flags & MULTIBOOT_INFO_MODS) && mboot_info->mods_count > 0) {
+        initrd_mod = PHYS_TO_VIRT(mboot_info->mods_addr);
+        if (mboot_info->mods_count > 1) {
+            ramdisk_mod = initrd_mod + 1;
+        }
+        for (multiboot_mod_t *mod = initrd_mod; mod <= (ramdisk_mod ? ramdisk_mod : initrd_mod); mod++) {
+            if (mod->mod_end > reserved_end) {
+                reserved_end = mod->mod_end;
+            }
+        }
+    }
+    
+    if (reserved_end > DIRECT_MAP_SIZE) {
+        printf("[WARN] Boot modules above the direct map are ignored\n");
+        initrd_mod = NULL;
+        ramdisk_mod = NULL;
+        reserved_end = VIRT_TO_PHYS(kernel_end);
+    }
+
+    init_memory(mboot_info, reserved_end);
+    printf("[OK] PMM initialized (%u frames available, %u MiB of RAM, %u MiB high)\n",
+           pmm_get_free_frames(), pmm_get_total_frames() / 256, pmm_get_high_frames() / 256);
+    
+    vmm_init();
+    terminal_map_buffer();
+    print_ok("Paging enabled");
     
     kheap_init();
     print_ok("Kernel heap initialized");
     
+    pagecache_init();
+    
+    vfs_init();
+    if (vfs_mount_tmpfs("/tmp") == VFS_OK) {
+        print_ok("tmpfs mounted at /tmp");
+    }
+    
+    // Compressed files are unpacked on first use, so only the image itself
+    // is loaded at boot. The unpacked size is what an uncompressed image
+    // would have cost GRUB to load.
+    if (initrd_mod != NULL) {
+        uint32_t initrd_start = timer_get_ticks();
+        if (initrd_init((uint32_t)PHYS_TO_VIRT(initrd_mod->mod_start),
+                        (uint32_t)PHYS_TO_VIRT(initrd_mod->mod_end)) == 0) {
+            uint32_t initrd_ms = timer_ticks_to_ms(timer_get_ticks() - initrd_start);
+            printf("[OK] Initrd loaded in %u ms (%u files, %u KiB, %u KiB unpacked)\n",
+                   initrd_ms, initrd_count(), initrd_image_size() / 1024,
+                   initrd_unpacked_size() / 1024);
+            vfs_mount_initrd("/initrd");
+        } else {
+            printf("[WARN] Invalid initrd module\n");
+        }
+    }
+    
     ata_init();
     print_ok("ATA driver initialized");
     
     DiskOps ops = {
         .read = fat_read_sector,
-        .write = fat_write_sector
+        .write = fat_write_sector,
+        .read_multi = fat_read_sectors
     };
     
+    uint32_t mount_start = timer_get_ticks();
     if (fat_mount(&ops, 0, &g_fs, "root") == FAT_ERR_NONE) {
-        print_ok("FAT32 filesystem mounted at /");
+        uint32_t mount_ms = timer_ticks_to_ms(timer_get_ticks() - mount_start);
+        printf("[OK] FAT32 filesystem mounted at / in %u ms (%u free clusters)\n",
+               mount_ms, g_fs.free_cnt);
+        vfs_mount_fat("/", "root");
     } else {
         printf("[WARN] Failed to mount FAT32 filesystem\n");
     }
 
+    if (ramdisk_mod != NULL) {
+        DiskOps ram_ops;
+        ramdisk_get_ops(&ram_ops);
+        if (ramdisk_init_image((uint32_t)PHYS_TO_VIRT(ramdisk_mod->mod_start),
+                               (uint32_t)PHYS_TO_VIRT(ramdisk_mod->mod_end)) == 0 &&
+            fat_mount(&ram_ops, 0, &g_ramfs, "ram") == FAT_ERR_NONE) {
+            printf("[OK] RAM disk mounted at /ram (%u KiB)\n", ramdisk_sectors() / 2);
+            vfs_mount_fat("/ram", "ram");
+        } else {
+            printf("[WARN] Failed to mount RAM disk image\n");
+        }
+    }
+
     printf("\n");
     print_ok("All systems operational");
     printf("\n");
@@ -3,9 +3,12 @@
 #include "keyboard.h"
 #include "tty.h"
 #include "fat.h"
+#include "fat_async.h"
 #include <stdio.h>
 #include <string.h>
 
+#define ASYNC_IDLE_BUDGET 8 // Sectors of queued FAT I/O moved per idle iteration
+
 extern Fat g_fs;
 
 static char* trim_whitespace(char *str) {
@@ -91,6 +94,42 @@ static void process_command(const char *cmd) {
         cmd_cd(&g_fs, "/");
     } else if (strncmp(actual_cmd, "cat ", 4) == 0) {
         cmd_cat(&g_fs, actual_cmd + 4);
+    } else if (strncmp(actual_cmd, "defrag ", 7) == 0) {
+        cmd_defrag(&g_fs, actual_cmd + 7);
+    } else if (strcmp(actual_cmd, "initrd") == 0) {
+        cmd_initrd(NULL);
+    } else if (strncmp(actual_cmd, "initrd ", 7) == 0) {
+        cmd_initrd(actual_cmd + 7);
+    } else if (strcmp(actual_cmd, "cache") == 0) {
+        cmd_cache();
+    } else if (strcmp(actual_cmd, "ramdisk") == 0) {
+        cmd_ramdisk(NULL);
+    } else if (strncmp(actual_cmd, "ramdisk ", 8) == 0) {
+        cmd_ramdisk(actual_cmd + 8);
+    } else if (strcmp(actual_cmd, "pmmbench") == 0) {
+        cmd_pmmbench();
+    } else if (strcmp(actual_cmd, "heapbench") == 0) {
+        cmd_heapbench();
+    } else if (strcmp(actual_cmd, "slabinfo") == 0) {
+        cmd_slabinfo();
+    } else if (strcmp(actual_cmd, "meminfo") == 0) {
+        cmd_meminfo(NULL);
+    } else if (strncmp(actual_cmd, "meminfo ", 8) == 0) {
+        cmd_meminfo(actual_cmd + 8);
+    } else if (strcmp(actual_cmd, "tlbbench") == 0) {
+        cmd_tlbbench();
+    } else if (strcmp(actual_cmd, "forkbench") == 0) {
+        cmd_forkbench();
+    } else if (strcmp(actual_cmd, "switchbench") == 0) {
+        cmd_switchbench();
+    } else if (strcmp(actual_cmd, "mapbench") == 0) {
+        cmd_mapbench();
+    } else if (strcmp(actual_cmd, "blitbench") == 0) {
+        cmd_blitbench();
+    } else if (strncmp(actual_cmd, "lsbench ", 8) == 0) {
+        cmd_lsbench(actual_cmd + 8);
+    } else if (strncmp(actual_cmd, "mmapbench ", 10) == 0) {
+        cmd_mmapbench(actual_cmd + 10);
     } else {
         printf("Unknown command: %s\n", actual_cmd);
         printf("Type 'help' for available commands\n");
@@ -106,6 +145,13 @@ void shell_loop(void) {
     terminal_writestring("> ");
 
     while (1) {
+        // Queued async FAT transfers run while the shell waits for input.
+        // Nothing else uses the filesystem then, so the worker is safe here.
+        while (!keyboard_has_input()) {
+            if (fat_async_run(ASYNC_IDLE_BUDGET) == 0) {
+                __asm__ __volatile__("hlt");
+            }
+        }
         char c = keyboard_getchar();
 
         if (c == 0) continue;
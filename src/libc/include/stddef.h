@@ -6,4 +6,6 @@
 typedef __SIZE_TYPE__ size_t;
 typedef __PTRDIFF_TYPE__ ptrdiff_t;
 
+#define offsetof(type, member) __builtin_offsetof(type, member)
+
 #endif
@@ -1,71 +1,452 @@
 #include "kheap.h"
+#include "pmm.h"
+#include "vmm.h"
+#include <stddef.h>
 #include <stdint.h>
 #include <string.h>
 
-#define HEAP_START 0x00200000
-#define HEAP_SIZE  0x00100000
+// The heap has its own virtual range above the direct map and the initrd
+// window. It grows by mapping PMM frames, high memory first, at the end and gives whole pages
+// back when the last block is free and big enough.
+#define HEAP_START 0xE4000000
+#define HEAP_MAX   0xF0000000
+#define HEAP_GROW  0x00010000 // Smallest growth, also kept mapped when shrinking
+
+// Two-level segregated fit (TLSF) allocator. Free blocks are kept on lists by
+// size class: the first level is the power of two of the size, the second
+// level splits each power of two into SL_COUNT linear steps. Two levels of
+// bitmaps give the first non-empty list that fits in constant time.
+//
+// Every block starts with a header holding its size and a pointer to the
+// block physically before it, so freeing merges with both neighbours without
+// searching. Free blocks keep their list links in the payload.
+
+#define ALIGN_LOG2 3
+#define ALIGN      (1 << ALIGN_LOG2)
+#define SL_LOG2    4
+#define SL_COUNT   (1 << SL_LOG2)
+#define FL_SHIFT   (SL_LOG2 + ALIGN_LOG2) // Sizes below 2^FL_SHIFT share the first list
+#define FL_MAX     30                     // Largest block is just under 2^FL_MAX bytes
+#define FL_COUNT   (FL_MAX - FL_SHIFT + 1)
+#define SMALL_SIZE (1 << FL_SHIFT)
+
+#define BLOCK_FREE      0x1
+#define BLOCK_PREV_FREE 0x2
+#define BLOCK_FLAGS     (BLOCK_FREE | BLOCK_PREV_FREE)
 
 typedef struct heap_block {
-    size_t size;
-    int is_free;
-    struct heap_block* next;
+    struct heap_block* prev_phys; // Valid while the previous block is free
+    size_t size;                  // Payload bytes and BLOCK_* flags
+    struct heap_block* next_free; // Free blocks only
+    struct heap_block* prev_free;
 } heap_block_t;
 
-static heap_block_t* heap_head = NULL;
-static uint8_t* heap_memory = (uint8_t*)HEAP_START;
+#define HEADER_SIZE    offsetof(heap_block_t, next_free)
+#define MIN_BLOCK_SIZE (sizeof(heap_block_t) - HEADER_SIZE)
+
+static uint32_t fl_bitmap;
+static uint32_t sl_bitmap[FL_COUNT];
+static heap_block_t* free_lists[FL_COUNT][SL_COUNT];
+
+static uint32_t heap_end; // End of the mapped range
+
+static uint32_t used_bytes; // Payload bytes of used blocks
+static uint32_t used_blocks;
+static uint32_t peak_bytes;
+
+static size_t block_size(const heap_block_t* block) {
+    return block->size & ~BLOCK_FLAGS;
+}
+
+static heap_block_t* next_block(const heap_block_t* block) {
+    return (heap_block_t*)((uint8_t*)block + HEADER_SIZE + block_size(block));
+}
+
+#ifdef KHEAP_PROFILE
+// Each used block carries the return address of its kmalloc call in the last
+// word of its payload. Live allocations are counted per call site in an open
+// addressed table. Once it is full, new sites share the last entry.
+#define SITE_COUNT 256
+
+static kheap_site_t sites[SITE_COUNT + 1];
+
+static void** block_tag(const heap_block_t* block) {
+    return (void**)((uint8_t*)block + HEADER_SIZE + block_size(block)) - 1;
+}
+
+static kheap_site_t* find_site(void* caller) {
+    uint32_t start = ((uint32_t)caller >> 2) % SITE_COUNT;
+
+    for (uint32_t i = 0; i < SITE_COUNT; i++) {
+        kheap_site_t* site = &sites[(start + i) % SITE_COUNT];
+        if (site->allocs == 0) {
+            site->caller = caller;
+            return site;
+        }
+        if (site->caller == caller) {
+            return site;
+        }
+    }
+    return &sites[SITE_COUNT];
+}
+#endif
+
+static int fls(uint32_t x) {
+    return 31 - __builtin_clz(x);
+}
+
+// Size class holding blocks of exactly this size
+static void mapping(size_t size, int* fl, int* sl) {
+    if (size < SMALL_SIZE) {
+        *fl = 0;
+        *sl = size / (SMALL_SIZE / SL_COUNT);
+    } else {
+        int bit = fls(size);
+        *sl = (size >> (bit - SL_LOG2)) ^ SL_COUNT;
+        *fl = bit - FL_SHIFT + 1;
+    }
+}
+
+// First size class whose blocks are all at least this big
+static void mapping_search(size_t size, int* fl, int* sl) {
+    if (size >= SMALL_SIZE) {
+        size += (1 << (fls(size) - SL_LOG2)) - 1;
+    }
+    mapping(size, fl, sl);
+}
+
+static void insert_free(heap_block_t* block) {
+    int fl, sl;
+    mapping(block_size(block), &fl, &sl);
+
+    block->prev_free = NULL;
+    block->next_free = free_lists[fl][sl];
+    if (block->next_free != NULL) {
+        block->next_free->prev_free = block;
+    }
+    free_lists[fl][sl] = block;
+
+    fl_bitmap |= 1u << fl;
+    sl_bitmap[fl] |= 1u << sl;
+}
+
+static void remove_free(heap_block_t* block) {
+    int fl, sl;
+    mapping(block_size(block), &fl, &sl);
+
+    if (block->prev_free != NULL) {
+        block->prev_free->next_free = block->next_free;
+    } else {
+        free_lists[fl][sl] = block->next_free;
+    }
+    if (block->next_free != NULL) {
+        block->next_free->prev_free = block->prev_free;
+    }
+
+    if (free_lists[fl][sl] == NULL) {
+        sl_bitmap[fl] &= ~(1u << sl);
+        if (sl_bitmap[fl] == 0) {
+            fl_bitmap &= ~(1u << fl);
+        }
+    }
+}
+
+static heap_block_t* find_free(size_t size) {
+    int fl, sl;
+    mapping_search(size, &fl, &sl);
+
+    uint32_t sl_map = fl < FL_COUNT ? sl_bitmap[fl] & (~0u << sl) : 0;
+    if (sl_map == 0) {
+        uint32_t fl_map = fl + 1 < FL_COUNT ? fl_bitmap & (~0u << (fl + 1)) : 0;
+        if (fl_map != 0) {
+            fl = __builtin_ctz(fl_map);
+            sl_map = sl_bitmap[fl];
+        }
+    }
+    if (sl_map != 0) {
+        return free_lists[fl][__builtin_ctz(sl_map)];
+    }
+
+    // Rounding up skips the class of the size itself, which can still hold a
+    // block that fits. Only searched when memory is nearly exhausted.
+    mapping(size, &fl, &sl);
+    heap_block_t* block = free_lists[fl][sl];
+    while (block != NULL && block_size(block) < size) {
+        block = block->next_free;
+    }
+    return block;
+}
+
+// Marks a block free or used in its own header and in the next block's
+static void set_free(heap_block_t* block, int free) {
+    heap_block_t* next = next_block(block);
+
+    if (free) {
+        block->size |= BLOCK_FREE;
+        next->size |= BLOCK_PREV_FREE;
+        next->prev_phys = block;
+    } else {
+        block->size &= ~BLOCK_FREE;
+        next->size &= ~BLOCK_PREV_FREE;
+    }
+}
+
+// Maps pages at the end of the heap. Returns 0 when out of frames or address
+// space, leaving the heap unchanged.
+static int map_pages(uint32_t bytes) {
+    page_directory_t dir = vmm_get_kernel_directory();
+
+    if (bytes > HEAP_MAX - heap_end) {
+        return 0;
+    }
+    for (uint32_t off = 0; off < bytes; off += PAGE_SIZE) {
+        void* frame = pmm_alloc_high_frame();
+        if (frame == NULL) {
+            vmm_free_range(dir, heap_end, off);
+            return 0;
+        }
+        vmm_map(dir, heap_end + off, (uint32_t)frame, PAGE_PRESENT | PAGE_RW);
+    }
+
+    heap_end += bytes;
+    return 1;
+}
+
+static void unmap_pages(uint32_t end) {
+    vmm_free_range(vmm_get_kernel_directory(), end, heap_end - end);
+    heap_end = end;
+}
+
+// Merges a block with its free neighbours and puts it on a free list
+static heap_block_t* release(heap_block_t* block) {
+    if (block->size & BLOCK_PREV_FREE) {
+        heap_block_t* prev = block->prev_phys;
+        remove_free(prev);
+        prev->size += HEADER_SIZE + block_size(block);
+        block = prev;
+    }
+
+    heap_block_t* next = next_block(block);
+    if (next->size & BLOCK_FREE) {
+        remove_free(next);
+        block->size += HEADER_SIZE + block_size(next);
+    }
+
+    set_free(block, 1);
+    insert_free(block);
+    return block;
+}
+
+// Extends the heap so that a free block of at least size bytes exists. The
+// old end block becomes the header of the new space.
+static int grow(size_t size) {
+    heap_block_t* end = (heap_block_t*)(heap_end - HEADER_SIZE);
+    uint32_t bytes = size + HEADER_SIZE;
+
+    if (end->size & BLOCK_PREV_FREE) {
+        uint32_t tail = block_size(end->prev_phys) + HEADER_SIZE;
+        bytes = tail < bytes ? bytes - tail : 0;
+    }
+    bytes = (bytes + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    if (bytes < HEAP_GROW) {
+        bytes = HEAP_GROW;
+    }
+    if (!map_pages(bytes)) {
+        return 0;
+    }
+
+    heap_block_t* block = end;
+    block->size = (bytes - HEADER_SIZE) | (end->size & BLOCK_PREV_FREE);
+    next_block(block)->size = 0;
+    release(block);
+    return 1;
+}
+
+// Unmaps the pages of a free last block beyond HEAP_GROW bytes, once at
+// least twice that much is free, so alternating kmalloc and kfree near the
+// boundary does not map and unmap every time
+static void shrink(heap_block_t* block) {
+    heap_block_t* next = next_block(block);
+    if (block_size(next) != 0 || block_size(block) < 2 * HEAP_GROW) {
+        return;
+    }
+
+    uint32_t end = ((uint32_t)block + HEADER_SIZE + HEAP_GROW + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    remove_free(block);
+    block->size = (end - HEADER_SIZE - (uint32_t)block - HEADER_SIZE) | (block->size & BLOCK_FLAGS);
+    next = next_block(block);
+    next->size = 0;
+    set_free(block, 1);
+    insert_free(block);
+
+    unmap_pages(end);
+}
 
 void kheap_init(void) {
-    heap_head = (heap_block_t*)heap_memory;
-    heap_head->size = HEAP_SIZE - sizeof(heap_block_t);
-    heap_head->is_free = 1;
-    heap_head->next = NULL;
+    fl_bitmap = 0;
+    memset(sl_bitmap, 0, sizeof(sl_bitmap));
+    memset(free_lists, 0, sizeof(free_lists));
+
+    heap_end = HEAP_START;
+    if (!map_pages(HEAP_GROW)) {
+        return;
+    }
+
+    // One free block followed by an empty used block, so every block has a
+    // next block to carry its boundary tag
+    heap_block_t* block = (heap_block_t*)HEAP_START;
+    block->size = HEAP_GROW - 2 * HEADER_SIZE;
+
+    heap_block_t* end = next_block(block);
+    end->size = 0;
+
+    set_free(block, 1);
+    insert_free(block);
 }
 
 void* kmalloc(size_t size) {
-    if (size == 0) {
+    if (size == 0 || size >= (1u << FL_MAX)) {
         return NULL;
     }
-    
-    size = (size + 7) & ~7;
-    
-    heap_block_t* current = heap_head;
-    
-    while (current != NULL) {
-        if (current->is_free && current->size >= size) {
-            if (current->size >= size + sizeof(heap_block_t) + 8) {
-                heap_block_t* new_block = (heap_block_t*)((uint8_t*)current + sizeof(heap_block_t) + size);
-                new_block->size = current->size - size - sizeof(heap_block_t);
-                new_block->is_free = 1;
-                new_block->next = current->next;
-                
-                current->size = size;
-                current->next = new_block;
-            }
-            
-            current->is_free = 0;
-            return (void*)((uint8_t*)current + sizeof(heap_block_t));
+
+#ifdef KHEAP_PROFILE
+    size += sizeof(void*);
+#endif
+    size = (size + ALIGN - 1) & ~(ALIGN - 1);
+    if (size < MIN_BLOCK_SIZE) {
+        size = MIN_BLOCK_SIZE;
+    }
+
+    heap_block_t* block = find_free(size);
+    if (block == NULL) {
+        if (heap_end == HEAP_START || !grow(size)) {
+            return NULL;
         }
-        current = current->next;
+        block = find_free(size);
+    }
+    remove_free(block);
+
+    // Split off the tail if it can hold a block of its own
+    size_t total = block_size(block);
+    if (total >= size + sizeof(heap_block_t)) {
+        block->size = size | (block->size & BLOCK_PREV_FREE);
+
+        heap_block_t* rest = next_block(block);
+        rest->size = total - size - HEADER_SIZE;
+        set_free(rest, 1);
+        insert_free(rest);
     }
-    
-    return NULL;
+
+    set_free(block, 0);
+
+    used_bytes += block_size(block);
+    used_blocks++;
+    if (used_bytes > peak_bytes) {
+        peak_bytes = used_bytes;
+    }
+
+#ifdef KHEAP_PROFILE
+    void* caller = __builtin_return_address(0);
+    kheap_site_t* site = find_site(caller);
+    site->allocs++;
+    site->live++;
+    site->bytes += block_size(block);
+    *block_tag(block) = caller;
+#endif
+
+    return (uint8_t*)block + HEADER_SIZE;
 }
 
 void kfree(void* ptr) {
     if (ptr == NULL) {
         return;
     }
-    
-    heap_block_t* block = (heap_block_t*)((uint8_t*)ptr - sizeof(heap_block_t));
-    block->is_free = 1;
-    
-    heap_block_t* current = heap_head;
-    while (current != NULL) {
-        if (current->is_free && current->next != NULL && current->next->is_free) {
-            current->size += sizeof(heap_block_t) + current->next->size;
-            current->next = current->next->next;
+
+    heap_block_t* block = (heap_block_t*)((uint8_t*)ptr - HEADER_SIZE);
+    if (block->size & BLOCK_FREE) {
+        return;
+    }
+
+    used_bytes -= block_size(block);
+    used_blocks--;
+
+#ifdef KHEAP_PROFILE
+    kheap_site_t* site = find_site(*block_tag(block));
+    site->live--;
+    site->bytes -= block_size(block);
+#endif
+
+    shrink(release(block));
+}
+
+void kheap_get_stats(kheap_stats_t* stats) {
+    stats->mapped = heap_end - HEAP_START;
+    stats->used = used_bytes;
+    stats->peak = peak_bytes;
+    stats->blocks = used_blocks;
+    stats->free = 0;
+    stats->free_blocks = 0;
+    stats->largest_free = 0;
+
+    for (int fl = 0; fl < FL_COUNT; fl++) {
+        for (int sl = 0; sl < SL_COUNT; sl++) {
+            for (heap_block_t* block = free_lists[fl][sl]; block != NULL; block = block->next_free) {
+                stats->free += block_size(block);
+                stats->free_blocks++;
+                if (block_size(block) > stats->largest_free) {
+                    stats->largest_free = block_size(block);
+                }
+            }
+        }
+    }
+}
+
+// Calls fn for every used block with its address, payload size and, when
+// profiling, the caller that allocated it
+void kheap_walk(void (*fn)(void* ptr, size_t size, void* caller)) {
+    if (heap_end == HEAP_START) {
+        return;
+    }
+
+    heap_block_t* block = (heap_block_t*)HEAP_START;
+    for (; block_size(block) != 0; block = next_block(block)) {
+        if (block->size & BLOCK_FREE) {
+            continue;
+        }
+#ifdef KHEAP_PROFILE
+        fn((uint8_t*)block + HEADER_SIZE, block_size(block), *block_tag(block));
+#else
+        fn((uint8_t*)block + HEADER_SIZE, block_size(block), NULL);
+#endif
+    }
+}
+
+#ifdef KHEAP_PROFILE
+// Copies up to max call sites with live allocations, most bytes first.
+// Returns the number copied.
+int kheap_get_sites(kheap_site_t* out, int max) {
+    int count = 0;
+
+    for (int i = 0; i <= SITE_COUNT && max > 0; i++) {
+        if (sites[i].live == 0) {
+            continue;
+        }
+
+        int pos = count;
+        if (count < max) {
+            count++;
+        } else if (out[max - 1].bytes >= sites[i].bytes) {
+            continue;
         } else {
-            current = current->next;
+            pos = max - 1;
+        }
+
+        while (pos > 0 && out[pos - 1].bytes < sites[i].bytes) {
+            out[pos] = out[pos - 1];
+            pos--;
         }
+        out[pos] = sites[i];
     }
+    return count;
 }
+#endif
@@ -1,93 +1,419 @@
 #include "pmm.h"
+#include "vmm.h"
 #include <string.h>
 
-#define BITMAP_SIZE 32768
-#define BITS_PER_BYTE 8
+// Buddy allocator. Free memory is kept as blocks of 2^order frames, aligned
+// to their size, on one list per order. Allocation splits the smallest block
+// that fits, freeing merges a block with its buddy while the buddy is free.
+//
+// The lists are linked through per-frame metadata rather than through the
+// free frames themselves, so nothing here touches the managed memory.
+//
+// The metadata covers every frame from address 0 to the end of memory and is
+// placed by the caller, sized by pmm_metadata_size. Frames start out in use
+// and only the regions handed to pmm_add_region become free.
+//
+// Memory is split in two zones with separate lists. Low memory is covered by
+// the kernel's direct map, so its frames can be used through PHYS_TO_VIRT.
+// High memory is only reachable through mappings made for it and is handed
+// out by pmm_alloc_high_frame alone. The boundary is a multiple of the largest
+// block, so no block or buddy pair crosses it.
+//
+// Allocated single frames are not on a list, so their frame_next holds the
+// number of references beyond the first, for frames shared between address
+// spaces.
 
-static uint8_t frame_bitmap[BITMAP_SIZE];
+#define NONE         0xFFFFFFFF
+#define STATE_FREE   0x80 // Head of a free block, low bits hold the order
+#define STATE_ALLOC  0x40 // Head of an allocated block, low bits hold the order
+#define STATE_CACHED 0x20 // Free frame held in the frame cache
+
+#define ZONE_LOW   0
+#define ZONE_HIGH  1
+#define ZONE_COUNT 2
+#define LOW_FRAMES (DIRECT_MAP_SIZE / FRAME_SIZE)
+
+// Single frames are freed to and allocated from a LIFO stack, which is only
+// refilled from and drained to the buddy lists in batches. Recently freed
+// frames are handed out first, while they may still be in the CPU cache. The
+// state is kept in one struct so it can become per-CPU. Only low memory goes
+// through the cache.
+#define FRAME_CACHE_SIZE  64
+#define FRAME_CACHE_BATCH 32
+
+typedef struct {
+    uint32_t frames[FRAME_CACHE_SIZE];
+    uint32_t count;
+    pmm_cache_stats_t stats;
+} frame_cache_t;
+
+static frame_cache_t frame_cache;
+
+static uint32_t* frame_next;
+static uint32_t* frame_prev;
+static uint8_t* frame_state;
+
+static uint32_t free_head[ZONE_COUNT][PMM_MAX_ORDER + 1];
+static uint32_t free_count[ZONE_COUNT][PMM_MAX_ORDER + 1];
+
+static uint32_t frame_count;  // Frames covered by the metadata
+static uint32_t meta_start;   // Frames holding the metadata itself
+static uint32_t meta_end;
 static uint32_t total_frames;
+static uint32_t high_frames;
 static uint32_t free_frames;
-static uint32_t first_frame;
 
-static void set_frame(uint32_t frame_addr) {
-    uint32_t frame = frame_addr / FRAME_SIZE;
-    uint32_t idx = frame / BITS_PER_BYTE;
-    uint32_t off = frame % BITS_PER_BYTE;
-    frame_bitmap[idx] |= (1 << off);
+static uint32_t zone_of(uint32_t idx) {
+    return idx < LOW_FRAMES ? ZONE_LOW : ZONE_HIGH;
 }
 
-static void clear_frame(uint32_t frame_addr) {
-    uint32_t frame = frame_addr / FRAME_SIZE;
-    uint32_t idx = frame / BITS_PER_BYTE;
-    uint32_t off = frame % BITS_PER_BYTE;
-    frame_bitmap[idx] &= ~(1 << off);
+static void list_push(uint32_t idx, uint32_t order) {
+    uint32_t* head = &free_head[zone_of(idx)][order];
+
+    frame_state[idx] = STATE_FREE | order;
+    frame_prev[idx] = NONE;
+    frame_next[idx] = *head;
+    if (*head != NONE) {
+        frame_prev[*head] = idx;
+    }
+    *head = idx;
+    free_count[zone_of(idx)][order]++;
 }
 
-static int test_frame(uint32_t frame_addr) {
-    uint32_t frame = frame_addr / FRAME_SIZE;
-    uint32_t idx = frame / BITS_PER_BYTE;
-    uint32_t off = frame % BITS_PER_BYTE;
-    return (frame_bitmap[idx] & (1 << off));
+static void list_remove(uint32_t idx, uint32_t order) {
+    if (frame_prev[idx] != NONE) {
+        frame_next[frame_prev[idx]] = frame_next[idx];
+    } else {
+        free_head[zone_of(idx)][order] = frame_next[idx];
+    }
+    if (frame_next[idx] != NONE) {
+        frame_prev[frame_next[idx]] = frame_prev[idx];
+    }
+    frame_state[idx] = 0;
+    free_count[zone_of(idx)][order]--;
 }
 
-static uint32_t find_free_frame(void) {
-    for (uint32_t i = 0; i < total_frames; i++) {
-        uint32_t frame_addr = (first_frame + i) * FRAME_SIZE;
-        if (!test_frame(frame_addr)) {
-            return frame_addr;
+// Frees a block, merging it with its buddies as far as possible
+static void free_block(uint32_t idx, uint32_t order) {
+    free_frames += 1 << order;
+
+    while (order < PMM_MAX_ORDER) {
+        uint32_t buddy = idx ^ (1 << order);
+        if (buddy >= frame_count || frame_state[buddy] != (STATE_FREE | order)) {
+            break;
         }
+        list_remove(buddy, order);
+        idx &= ~(1 << order);
+        order++;
     }
-    return 0;
+
+    list_push(idx, order);
 }
 
-void pmm_init(uint32_t mem_low, uint32_t mem_high) {
-    memset(frame_bitmap, 0, BITMAP_SIZE);
-    
-    first_frame = (mem_low + FRAME_SIZE - 1) / FRAME_SIZE;
-    total_frames = (mem_high / FRAME_SIZE) - first_frame;
-    
-    if (total_frames > BITMAP_SIZE * BITS_PER_BYTE) {
-        total_frames = BITMAP_SIZE * BITS_PER_BYTE;
+// Returns the head of the free block containing idx, or NONE if it is in use
+static uint32_t find_free_block(uint32_t idx, uint32_t* order) {
+    for (uint32_t o = 0; o <= PMM_MAX_ORDER; o++) {
+        uint32_t head = idx & ~((1 << o) - 1);
+        if (frame_state[head] == (STATE_FREE | o)) {
+            *order = o;
+            return head;
+        }
     }
-    
-    free_frames = total_frames;
-    
-    for (uint32_t i = 0; i < mem_low; i += FRAME_SIZE) {
-        set_frame(i);
+    return NONE;
+}
+
+// Bytes of metadata needed to manage memory up to mem_end
+uint32_t pmm_metadata_size(uint32_t mem_end) {
+    uint32_t frames = mem_end / FRAME_SIZE;
+    uint32_t size = frames * (2 * sizeof(uint32_t) + sizeof(uint8_t));
+    return (size + FRAME_SIZE - 1) & ~(FRAME_SIZE - 1);
+}
+
+// Sets up an empty allocator for memory up to mem_end, keeping its metadata
+// at the physical address meta_addr, which has to be in low memory
+void pmm_init(uint32_t mem_end, uint32_t meta_addr) {
+    frame_count = mem_end / FRAME_SIZE;
+    frame_next = PHYS_TO_VIRT(meta_addr);
+    frame_prev = frame_next + frame_count;
+    frame_state = (uint8_t*)(frame_prev + frame_count);
+    memset(frame_state, 0, frame_count);
+
+    meta_start = meta_addr / FRAME_SIZE;
+    meta_end = meta_start + pmm_metadata_size(mem_end) / FRAME_SIZE;
+
+    for (uint32_t z = 0; z < ZONE_COUNT; z++) {
+        for (uint32_t o = 0; o <= PMM_MAX_ORDER; o++) {
+            free_head[z][o] = NONE;
+            free_count[z][o] = 0;
+        }
     }
+    total_frames = 0;
+    high_frames = 0;
+    free_frames = 0;
+    memset(&frame_cache, 0, sizeof(frame_cache));
 }
 
-void* pmm_alloc_frame(void) {
-    if (free_frames == 0) {
-        return NULL;
+// Frees the whole frames in [lo, hi) in the largest aligned blocks that fit
+static void add_frames(uint32_t lo, uint32_t hi) {
+    while (lo < hi) {
+        uint32_t order = 0;
+        while (order < PMM_MAX_ORDER && (lo & ((2 << order) - 1)) == 0 && lo + (2 << order) <= hi) {
+            order++;
+        }
+        free_block(lo, order);
+        total_frames += 1 << order;
+        if (zone_of(lo) == ZONE_HIGH) {
+            high_frames += 1 << order;
+        }
+        lo += 1 << order;
+    }
+}
+
+// Hands a range of usable RAM to the allocator. The metadata is skipped.
+void pmm_add_region(uint32_t start, uint32_t end) {
+    uint32_t lo = (start + FRAME_SIZE - 1) / FRAME_SIZE;
+    uint32_t hi = end / FRAME_SIZE;
+
+    // Frame 0 would look like a failed allocation
+    if (lo == 0) {
+        lo = 1;
+    }
+    if (hi > frame_count) {
+        hi = frame_count;
+    }
+
+    if (lo < meta_start) {
+        add_frames(lo, hi < meta_start ? hi : meta_start);
+    }
+    add_frames(lo > meta_end ? lo : meta_end, hi);
+}
+
+static uint32_t alloc_block(uint32_t zone, uint32_t order) {
+    uint32_t o = order;
+    while (o <= PMM_MAX_ORDER && free_head[zone][o] == NONE) {
+        o++;
+    }
+    if (o > PMM_MAX_ORDER) {
+        return NONE;
     }
-    
-    uint32_t frame_addr = find_free_frame();
-    if (frame_addr == 0) {
+
+    uint32_t idx = free_head[zone][o];
+    list_remove(idx, o);
+
+    // Give back the upper halves until the block has the requested size
+    while (o > order) {
+        o--;
+        list_push(idx + (1 << o), o);
+    }
+
+    frame_state[idx] = STATE_ALLOC | order;
+    frame_next[idx] = 0;
+    free_frames -= 1 << order;
+    return idx;
+}
+
+// Returns the cached frames, all of them or a batch, to the buddy lists
+static void drain_cache(uint32_t count) {
+    frame_cache_t* cache = &frame_cache;
+
+    if (cache->count == 0) {
+        return;
+    }
+    while (count > 0 && cache->count > 0) {
+        free_block(cache->frames[--cache->count], 0);
+        count--;
+    }
+    cache->stats.drains++;
+}
+
+// Allocates 2^order physically contiguous frames of low memory, aligned to
+// their size
+void* pmm_alloc_pages(uint32_t order) {
+    if (order > PMM_MAX_ORDER) {
         return NULL;
     }
-    
-    set_frame(frame_addr);
-    free_frames--;
-    
-    return (void*)frame_addr;
+
+    uint32_t idx = alloc_block(ZONE_LOW, order);
+    if (idx == NONE && frame_cache.count > 0) {
+        // Cached frames may be what keeps larger blocks from forming
+        drain_cache(FRAME_CACHE_SIZE);
+        idx = alloc_block(ZONE_LOW, order);
+    }
+
+    return idx == NONE ? NULL : (void*)(idx * FRAME_SIZE);
+}
+
+// Frees a block from pmm_alloc_pages. The order must match the allocation.
+// Single frames may be shared, so they go through pmm_free_frame.
+void pmm_free_pages(void* addr, uint32_t order) {
+    uint32_t idx = (uint32_t)addr / FRAME_SIZE;
+
+    if (order == 0) {
+        pmm_free_frame(addr);
+        return;
+    }
+    if (idx >= frame_count || frame_state[idx] != (STATE_ALLOC | order)) {
+        return;
+    }
+
+    frame_state[idx] = 0;
+    free_block(idx, order);
+}
+
+// Allocates a frame of low memory, which the kernel can use directly
+void* pmm_alloc_frame(void) {
+    frame_cache_t* cache = &frame_cache;
+
+    if (cache->count > 0) {
+        cache->stats.hits++;
+    } else {
+        cache->stats.misses++;
+        while (cache->count < FRAME_CACHE_BATCH) {
+            uint32_t idx = alloc_block(ZONE_LOW, 0);
+            if (idx == NONE) {
+                break;
+            }
+            frame_state[idx] = STATE_CACHED;
+            cache->frames[cache->count++] = idx;
+        }
+
+        if (cache->count == 0) {
+            return NULL;
+        }
+    }
+
+    uint32_t idx = cache->frames[--cache->count];
+    frame_state[idx] = STATE_ALLOC;
+    return (void*)(idx * FRAME_SIZE);
 }
 
+// Allocates a frame that is only used through mappings, such as heap or user
+// pages. High memory is taken first so low memory stays for the kernel.
+void* pmm_alloc_high_frame(void) {
+    uint32_t idx = alloc_block(ZONE_HIGH, 0);
+    if (idx == NONE) {
+        return pmm_alloc_frame();
+    }
+    return (void*)(idx * FRAME_SIZE);
+}
+
+// Drops a reference to a frame and frees it with the last one
 void pmm_free_frame(void* addr) {
-    uint32_t frame_addr = (uint32_t)addr;
-    
-    if (!test_frame(frame_addr)) {
+    frame_cache_t* cache = &frame_cache;
+    uint32_t idx = (uint32_t)addr / FRAME_SIZE;
+
+    if (idx >= frame_count || frame_state[idx] != STATE_ALLOC) {
         return;
     }
-    
-    clear_frame(frame_addr);
-    free_frames++;
+    if (frame_next[idx] > 0) {
+        frame_next[idx]--;
+        return;
+    }
+    if (zone_of(idx) == ZONE_HIGH) {
+        frame_state[idx] = 0;
+        free_block(idx, 0);
+        return;
+    }
+
+    if (cache->count == FRAME_CACHE_SIZE) {
+        drain_cache(FRAME_CACHE_BATCH);
+    }
+    frame_state[idx] = STATE_CACHED;
+    cache->frames[cache->count++] = idx;
+}
+
+// Marks frames holding data placed by the bootloader (modules) as used. Each
+// frame becomes a separately allocated order 0 block.
+void pmm_reserve_range(uint32_t start, uint32_t end) {
+    uint32_t lo = start / FRAME_SIZE;
+    uint32_t hi = (end + FRAME_SIZE - 1) / FRAME_SIZE;
+
+    drain_cache(FRAME_CACHE_SIZE);
+
+    if (hi > frame_count) {
+        hi = frame_count;
+    }
+
+    for (uint32_t idx = lo; idx < hi; idx++) {
+        uint32_t order;
+        uint32_t head = find_free_block(idx, &order);
+        if (head == NONE) {
+            continue;
+        }
+
+        // Split around idx, keeping the halves that do not contain it free
+        list_remove(head, order);
+        while (order > 0) {
+            order--;
+            uint32_t half = 1 << order;
+            if (idx >= head + half) {
+                list_push(head, order);
+                head += half;
+            } else {
+                list_push(head + half, order);
+            }
+        }
+
+        frame_state[idx] = STATE_ALLOC;
+        frame_next[idx] = 0;
+        free_frames--;
+    }
+}
+
+// Adds a reference to an allocated frame, which then takes one more
+// pmm_free_frame to free
+void pmm_ref_frame(void* addr) {
+    uint32_t idx = (uint32_t)addr / FRAME_SIZE;
+
+    if (idx < frame_count && frame_state[idx] == STATE_ALLOC) {
+        frame_next[idx]++;
+    }
+}
+
+// Number of references to an allocated frame, 0 if it is not one
+uint32_t pmm_get_frame_refs(void* addr) {
+    uint32_t idx = (uint32_t)addr / FRAME_SIZE;
+
+    if (idx >= frame_count || frame_state[idx] != STATE_ALLOC) {
+        return 0;
+    }
+    return frame_next[idx] + 1;
 }
 
 uint32_t pmm_get_total_frames(void) {
     return total_frames;
 }
 
+// Frames above the direct map, included in the total
+uint32_t pmm_get_high_frames(void) {
+    return high_frames;
+}
+
+// End of the memory covered by the allocator
+uint32_t pmm_get_memory_end(void) {
+    return frame_count * FRAME_SIZE;
+}
+
+// Frames in the frame cache count as free
 uint32_t pmm_get_free_frames(void) {
-    return free_frames;
+    return free_frames + frame_cache.count;
+}
+
+// Free frames that pmm_alloc_frame and pmm_alloc_pages can hand out
+uint32_t pmm_get_free_low_frames(void) {
+    uint32_t frames = frame_cache.count;
+    for (uint32_t order = 0; order <= PMM_MAX_ORDER; order++) {
+        frames += free_count[ZONE_LOW][order] << order;
+    }
+    return frames;
+}
+
+// Number of free blocks of the given order in both zones
+uint32_t pmm_get_free_blocks(uint32_t order) {
+    return order <= PMM_MAX_ORDER ? free_count[ZONE_LOW][order] + free_count[ZONE_HIGH][order] : 0;
+}
+
+void pmm_get_cache_stats(pmm_cache_stats_t* stats) {
+    *stats = frame_cache.stats;
+    stats->cached = frame_cache.count;
 }
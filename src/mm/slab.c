@@ -0,0 +1,242 @@
+#include "slab.h"
+#include "kheap.h"
+#include "pmm.h"
+#include "vmm.h"
+#include <string.h>
+
+// Object caches for fixed-size kernel objects. Each cache carves slabs of
+// 2^order pages from the PMM into equal objects. A slab starts with its
+// header, and since the PMM aligns blocks to their size, the slab of an object
+// is found by rounding its address down.
+//
+// Free objects are linked through a pointer stored in the object. With a
+// constructor, the pointer goes after the object instead, so freed objects
+// keep their constructed state and the constructor only runs once per object.
+
+#define SLAB_MAX_ORDER 3
+
+typedef struct slab {
+    kmem_cache_t* cache;
+    struct slab* next;
+    struct slab* prev;
+    void* free;        // First free object
+    uint32_t in_use;
+} slab_t;
+
+struct kmem_cache {
+    const char* name;
+    uint32_t size;
+    uint32_t stride;     // Distance between objects
+    uint32_t free_off;   // Offset of the free pointer in an object
+    uint32_t first_off;  // Offset of the first object in a slab
+    uint32_t order;
+    uint32_t per_slab;
+    void (*ctor)(void*);
+    slab_t* partial;
+    slab_t* full;
+    slab_t* empty;       // At most one slab is kept empty
+    uint32_t in_use;
+    uint32_t slabs;
+    struct kmem_cache* next;
+};
+
+static kmem_cache_t* caches;
+
+static void list_add(slab_t** list, slab_t* slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list != NULL) {
+        (*list)->prev = slab;
+    }
+    *list = slab;
+}
+
+static void list_del(slab_t** list, slab_t* slab) {
+    if (slab->prev != NULL) {
+        slab->prev->next = slab->next;
+    } else {
+        *list = slab->next;
+    }
+    if (slab->next != NULL) {
+        slab->next->prev = slab->prev;
+    }
+}
+
+static void** free_ptr(kmem_cache_t* cache, void* obj) {
+    return (void**)((uint8_t*)obj + cache->free_off);
+}
+
+static slab_t* new_slab(kmem_cache_t* cache) {
+    void* frames = pmm_alloc_pages(cache->order);
+    if (frames == NULL) {
+        return NULL;
+    }
+
+    slab_t* slab = PHYS_TO_VIRT(frames);
+
+    slab->cache = cache;
+    slab->in_use = 0;
+    slab->free = NULL;
+
+    // Link the objects so the lowest address is handed out first
+    uint8_t* first = (uint8_t*)slab + cache->first_off;
+    for (uint32_t i = cache->per_slab; i-- > 0;) {
+        void* obj = first + i * cache->stride;
+        if (cache->ctor != NULL) {
+            cache->ctor(obj);
+        }
+        *free_ptr(cache, obj) = slab->free;
+        slab->free = obj;
+    }
+
+    cache->slabs++;
+    return slab;
+}
+
+static void free_slab(kmem_cache_t* cache, slab_t* slab) {
+    pmm_free_pages((void*)VIRT_TO_PHYS(slab), cache->order);
+    cache->slabs--;
+}
+
+// Creates a cache of objects of the given size. align is a power of two or 0
+// for pointer alignment. ctor, if given, initializes each object once when
+// its slab is created.
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align, void (*ctor)(void*)) {
+    if (size == 0 || (align & (align - 1))) {
+        return NULL;
+    }
+    if (align < sizeof(void*)) {
+        align = sizeof(void*);
+    }
+
+    kmem_cache_t* cache = kmalloc(sizeof(kmem_cache_t));
+    if (cache == NULL) {
+        return NULL;
+    }
+    memset(cache, 0, sizeof(kmem_cache_t));
+
+    uint32_t stride = size < sizeof(void*) ? sizeof(void*) : size;
+    if (ctor != NULL) {
+        stride = (stride + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+        cache->free_off = stride;
+        stride += sizeof(void*);
+    }
+    stride = (stride + align - 1) & ~(align - 1);
+
+    cache->first_off = (sizeof(slab_t) + align - 1) & ~(align - 1);
+
+    // Smallest slab that wastes at most an eighth of its memory
+    for (cache->order = 0; cache->order <= SLAB_MAX_ORDER; cache->order++) {
+        uint32_t bytes = PAGE_SIZE << cache->order;
+        cache->per_slab = (bytes - cache->first_off) / stride;
+        uint32_t waste = bytes - cache->first_off - cache->per_slab * stride;
+        if (cache->per_slab > 0 && (waste <= bytes / 8 || cache->order == SLAB_MAX_ORDER)) {
+            break;
+        }
+    }
+    if (cache->per_slab == 0) {
+        kfree(cache);
+        return NULL;
+    }
+
+    cache->name = name;
+    cache->size = size;
+    cache->stride = stride;
+    cache->ctor = ctor;
+
+    cache->next = caches;
+    caches = cache;
+    return cache;
+}
+
+void* kmem_cache_alloc(kmem_cache_t* cache) {
+    slab_t* slab = cache->partial;
+
+    if (slab == NULL) {
+        if (cache->empty != NULL) {
+            slab = cache->empty;
+            cache->empty = NULL;
+        } else {
+            slab = new_slab(cache);
+            if (slab == NULL) {
+                return NULL;
+            }
+        }
+        list_add(&cache->partial, slab);
+    }
+
+    void* obj = slab->free;
+    slab->free = *free_ptr(cache, obj);
+    slab->in_use++;
+    cache->in_use++;
+
+    if (slab->in_use == cache->per_slab) {
+        list_del(&cache->partial, slab);
+        list_add(&cache->full, slab);
+    }
+    return obj;
+}
+
+void kmem_cache_free(kmem_cache_t* cache, void* obj) {
+    if (obj == NULL) {
+        return;
+    }
+
+    slab_t* slab = (slab_t*)((uint32_t)obj & ~((PAGE_SIZE << cache->order) - 1));
+    // Catches foreign pointers and the most common double frees
+    if (slab->cache != cache || slab->in_use == 0 || slab->free == obj) {
+        return;
+    }
+
+    if (slab->in_use == cache->per_slab) {
+        list_del(&cache->full, slab);
+        list_add(&cache->partial, slab);
+    }
+
+    *free_ptr(cache, obj) = slab->free;
+    slab->free = obj;
+    slab->in_use--;
+    cache->in_use--;
+
+    if (slab->in_use == 0) {
+        list_del(&cache->partial, slab);
+        if (cache->empty == NULL) {
+            cache->empty = slab;
+        } else {
+            free_slab(cache, slab);
+        }
+    }
+}
+
+// Frees the cache and all its slabs. Fails if objects are still allocated.
+int kmem_cache_destroy(kmem_cache_t* cache) {
+    if (cache->in_use > 0) {
+        return -1;
+    }
+    if (cache->empty != NULL) {
+        free_slab(cache, cache->empty);
+    }
+
+    kmem_cache_t** link = &caches;
+    while (*link != cache) {
+        link = &(*link)->next;
+    }
+    *link = cache->next;
+
+    kfree(cache);
+    return 0;
+}
+
+void kmem_cache_get_stats(const kmem_cache_t* cache, kmem_cache_stats_t* stats) {
+    stats->name = cache->name;
+    stats->size = cache->size;
+    stats->in_use = cache->in_use;
+    stats->total = cache->slabs * cache->per_slab;
+    stats->slabs = cache->slabs;
+    stats->pages = 1 << cache->order;
+}
+
+// Iterates over all caches, starting with NULL
+kmem_cache_t* kmem_cache_next(kmem_cache_t* cache) {
+    return cache == NULL ? caches : cache->next;
+}
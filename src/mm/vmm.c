@@ -1,46 +1,236 @@
 #include "vmm.h"
+#include "idt.h"
 #include "pmm.h"
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #define PAGE_DIRECTORY_INDEX(x) (((x) >> 22) & 0x3FF)
 #define PAGE_TABLE_INDEX(x) (((x) >> 12) & 0x3FF)
 #define PAGE_ALIGN(x) ((x) & 0xFFFFF000)
 
+#define TABLE_SPAN (1024 * PAGE_SIZE) // Bytes mapped by one page table
+
+#define RECURSIVE_INDEX 1023 // Directory entry pointing at the directory itself
+#define TABLE_ADDR(pd_index) (PAGE_TABLES + (pd_index) * PAGE_SIZE)
+
+#define FLUSH_PAGES_MAX 32 // Larger ranges reload CR3 instead of one invlpg per page
+
+#define TEMP_MAP_START 0xFF800000 // Window for vmm_map_temp
+#define TEMP_MAP_SLOTS 16
+
+#define CPUID_PGE 0x00002000
+#define CPUID_PAT 0x00010000
+#define CR4_PGE   0x00000080
+#define CR0_WP    0x00010000
+
+// PAT entries WB, WC, UC-, UC, WB, WT, UC-, UC. Only entry 1 differs from the
+// power-on value, so PAGE_WC (PWT) selects write-combining and PWT | PCD
+// still selects uncached.
+#define MSR_PAT      0x277
+#define PAT_LOW      0x00070106
+#define PAT_HIGH     0x00070406
+
+// Virtual range whose pages are mapped by its fault function on first touch
+typedef struct {
+    page_directory_t dir; // NULL when unused
+    uint32_t start;
+    uint32_t end;
+    vmm_fault_t fault;
+    void* data;
+} vmm_region_t;
+
 static uint32_t kernel_page_directory[1024] __attribute__((aligned(4096)));
-static uint32_t kernel_page_tables[256][1024] __attribute__((aligned(4096)));
+static page_directory_t current_directory;
+static int global_pages;
+static int pat;
+static uint32_t temp_used; // Slots of the temporary window in use
+static vmm_region_t regions[VMM_MAX_REGIONS];
+
+static void page_fault_handler(registers_t* regs);
 
 extern void enable_paging(uint32_t* page_directory);
 
+static uint32_t cpu_features(void) {
+    uint32_t eax = 1, ebx, ecx, edx;
+    __asm__ __volatile__("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    return edx;
+}
+
+static uint32_t read_cr4(void) {
+    uint32_t cr4;
+    __asm__ __volatile__("mov %%cr4, %0" : "=r"(cr4));
+    return cr4;
+}
+
+static void write_cr4(uint32_t cr4) {
+    __asm__ __volatile__("mov %0, %%cr4" :: "r"(cr4) : "memory");
+}
+
+static void wrmsr(uint32_t msr, uint32_t low, uint32_t high) {
+    __asm__ __volatile__("wrmsr" :: "c"(msr), "a"(low), "d"(high));
+}
+
+// Kernel mappings are global, so they stay in the TLB when CR3 changes
+static int is_kernel_address(uint32_t virt) {
+    return virt >= USER_END;
+}
+
+// Replaces the boot directory from loader.s with the kernel directory. Low
+// memory is mapped at KERNEL_BASE, so its frames can be used through
+// PHYS_TO_VIRT, while nothing below KERNEL_BASE stays mapped. loader.s already
+// turned on PSE, so every 4 MiB is one directory entry, which needs no page
+// tables and one TLB entry per 4 MiB.
+//
+// With PGE all kernel mappings are global, so switching address spaces only
+// drops the user part of the TLB.
+//
+// With PAT, PAGE_WC mappings are write-combining. Nothing maps memory with
+// PWT before this, so the PAT can be changed without flushing.
+//
+// The tables of the kernel windows are all created here. Their directory
+// entries never change afterwards, so address spaces can copy them and still
+// see every later kernel mapping.
 void vmm_init(void) {
+    uint32_t end = pmm_get_memory_end();
+
+    if (end > DIRECT_MAP_SIZE) {
+        end = DIRECT_MAP_SIZE;
+    }
     memset(kernel_page_directory, 0, sizeof(kernel_page_directory));
-    memset(kernel_page_tables, 0, sizeof(kernel_page_tables));
-    
-    for (uint32_t i = 0; i < 256; i++) {
-        kernel_page_directory[i] = ((uint32_t)kernel_page_tables[i]) | PAGE_PRESENT | PAGE_RW;
+
+    uint32_t features = cpu_features();
+    global_pages = (features & CPUID_PGE) != 0;
+    pat = (features & CPUID_PAT) != 0;
+    if (pat) {
+        wrmsr(MSR_PAT, PAT_LOW, PAT_HIGH);
     }
-    
-    for (uint32_t i = 0; i < 256 * 1024 * 1024; i += PAGE_SIZE) {
-        uint32_t pd_index = PAGE_DIRECTORY_INDEX(i);
-        uint32_t pt_index = PAGE_TABLE_INDEX(i);
-        kernel_page_tables[pd_index][pt_index] = i | PAGE_PRESENT | PAGE_RW;
+
+    uint32_t global = global_pages ? PAGE_GLOBAL : 0;
+    for (uint32_t base = 0; base < end; base += TABLE_SPAN) {
+        uint32_t pd_index = PAGE_DIRECTORY_INDEX(KERNEL_BASE + base);
+        kernel_page_directory[pd_index] = base | PAGE_PRESENT | PAGE_RW | PAGE_LARGE | global;
     }
-    
-    enable_paging(kernel_page_directory);
+
+    for (uint32_t i = PAGE_DIRECTORY_INDEX(KERNEL_WINDOW_START); i < RECURSIVE_INDEX; i++) {
+        uint32_t frame = (uint32_t)pmm_alloc_frame();
+        if (frame == 0) {
+            printf("Out of memory for the kernel page tables\n");
+            abort();
+        }
+        memset(PHYS_TO_VIRT(frame), 0, PAGE_SIZE);
+        kernel_page_directory[i] = frame | PAGE_PRESENT | PAGE_RW;
+    }
+    kernel_page_directory[RECURSIVE_INDEX] = VIRT_TO_PHYS(kernel_page_directory) | PAGE_PRESENT | PAGE_RW;
+
+    enable_paging((uint32_t*)VIRT_TO_PHYS(kernel_page_directory));
+    current_directory = kernel_page_directory;
+
+    if (global_pages) {
+        write_cr4(read_cr4() | CR4_PGE);
+    }
+
+    // Make kernel writes to read-only pages fault too, so copy-on-write also
+    // works for pages the kernel writes
+    uint32_t cr0;
+    __asm__ __volatile__("mov %%cr0, %0" : "=r"(cr0));
+    __asm__ __volatile__("mov %0, %%cr0" :: "r"(cr0 | CR0_WP));
+
+    register_interrupt_handler(14, page_fault_handler);
 }
 
-void vmm_map(page_directory_t dir, uint32_t virt, uint32_t phys, uint32_t flags) {
+// Maps a frame at a free slot of the temporary window and returns its
+// address. Slots are taken and given back in stack order, so a caller holding
+// several unmaps them in reverse. For frames outside the direct map and the
+// page tables of inactive directories.
+void* vmm_map_temp(uint32_t phys) {
+    uint32_t* table = (uint32_t*)TABLE_ADDR(PAGE_DIRECTORY_INDEX(TEMP_MAP_START));
+
+    if (temp_used == TEMP_MAP_SLOTS) {
+        printf("Out of temporary mappings\n");
+        abort();
+    }
+
+    uint32_t virt = TEMP_MAP_START + temp_used * PAGE_SIZE;
+    table[PAGE_TABLE_INDEX(virt)] = PAGE_ALIGN(phys) | PAGE_PRESENT | PAGE_RW | (global_pages ? PAGE_GLOBAL : 0);
+    temp_used++;
+    return (void*)virt;
+}
+
+// Releases the most recent temporary mapping
+void vmm_unmap_temp(void* addr) {
+    uint32_t* table = (uint32_t*)TABLE_ADDR(PAGE_DIRECTORY_INDEX(TEMP_MAP_START));
+
+    table[PAGE_TABLE_INDEX((uint32_t)addr)] = 0;
+    vmm_flush_page((uint32_t)addr);
+    temp_used--;
+}
+
+// Page table of a present directory entry. The tables of the active directory
+// and the kernel window tables, which every directory shares, are reached
+// through the recursive mapping. Tables of other directories get a temporary
+// mapping, so every table_of needs a put_table.
+static uint32_t* table_of(page_directory_t dir, uint32_t pd_index) {
+    if (dir == current_directory || pd_index >= PAGE_DIRECTORY_INDEX(KERNEL_WINDOW_START)) {
+        return (uint32_t*)TABLE_ADDR(pd_index);
+    }
+    return vmm_map_temp(dir[pd_index]);
+}
+
+static void put_table(uint32_t* table) {
+    if ((uint32_t)table < PAGE_TABLES) {
+        vmm_unmap_temp(table);
+    }
+}
+
+static void set_pde(page_directory_t dir, uint32_t pd_index, uint32_t pde) {
+    dir[pd_index] = pde;
+    if (dir == current_directory) {
+        vmm_flush_page(TABLE_ADDR(pd_index));
+    }
+}
+
+// Returns the page table for a directory entry, creating it if needed. New
+// tables are filled before the directory points at them.
+//
+// Every directory copies the direct map when it is created, so a table added
+// there, or a 4 MiB page split into one, would only reach this directory. Those
+// entries are never changed and NULL is returned for them.
+static uint32_t* get_table(page_directory_t dir, uint32_t virt, uint32_t flags) {
     uint32_t pd_index = PAGE_DIRECTORY_INDEX(virt);
-    uint32_t pt_index = PAGE_TABLE_INDEX(virt);
-    
-    uint32_t* page_table = (uint32_t*)(dir[pd_index] & 0xFFFFF000);
-    
-    if (!(dir[pd_index] & PAGE_PRESENT)) {
-        page_table = (uint32_t*)pmm_alloc_frame();
-        memset(page_table, 0, PAGE_SIZE);
-        dir[pd_index] = ((uint32_t)page_table) | PAGE_PRESENT | PAGE_RW | flags;
+    uint32_t pde = dir[pd_index];
+
+    if ((pde & PAGE_PRESENT) && !(pde & PAGE_LARGE)) {
+        return table_of(dir, pd_index);
+    }
+    if (is_kernel_address(virt) && virt < KERNEL_WINDOW_START) {
+        return NULL;
+    }
+
+    uint32_t frame = (uint32_t)pmm_alloc_high_frame();
+    if (frame == 0) {
+        return NULL;
+    }
+
+    uint32_t* page_table = vmm_map_temp(frame);
+    memset(page_table, 0, PAGE_SIZE);
+    vmm_unmap_temp(page_table);
+    // PWT and PCD in a directory entry would apply to the table itself
+    set_pde(dir, pd_index, frame | PAGE_PRESENT | PAGE_RW | (flags & PAGE_USER));
+    return table_of(dir, pd_index);
+}
+
+void vmm_map(page_directory_t dir, uint32_t virt, uint32_t phys, uint32_t flags) {
+    uint32_t* page_table = get_table(dir, virt, flags);
+    if (page_table == NULL) {
+        return;
+    }
+    if (global_pages && is_kernel_address(virt)) {
+        flags |= PAGE_GLOBAL;
     }
     
-    page_table[pt_index] = PAGE_ALIGN(phys) | flags;
+    page_table[PAGE_TABLE_INDEX(virt)] = PAGE_ALIGN(phys) | flags;
+    put_table(page_table);
 }
 
 void vmm_unmap(page_directory_t dir, uint32_t virt) {
@@ -51,16 +241,474 @@ void vmm_unmap(page_directory_t dir, uint32_t virt) {
         return;
     }
     
-    uint32_t* page_table = (uint32_t*)(dir[pd_index] & 0xFFFFF000);
+    uint32_t* page_table = get_table(dir, virt, 0);
+    if (page_table == NULL) {
+        return;
+    }
     page_table[pt_index] = 0;
+    put_table(page_table);
+    
+    vmm_flush_page(virt);
+}
+
+// Invalidates the TLB entries of a range after its page tables changed. User
+// ranges of other directories are not cached, kernel ranges are shared.
+static void flush_range(page_directory_t dir, uint32_t start, uint32_t pages) {
+    if (dir != current_directory && !is_kernel_address(start)) {
+        return;
+    }
+
+    if (pages <= FLUSH_PAGES_MAX) {
+        for (uint32_t i = 0; i < pages; i++) {
+            vmm_flush_page(start + i * PAGE_SIZE);
+        }
+    } else if (is_kernel_address(start)) {
+        vmm_flush_tlb_global();
+    } else {
+        vmm_flush_tlb();
+    }
+}
+
+// Maps size bytes of contiguous physical memory, filling a page table at a
+// time. Only ranges that replace existing mappings need a flush.
+void vmm_map_range(page_directory_t dir, uint32_t virt, uint32_t phys, uint32_t size, uint32_t flags) {
+    uint32_t start = PAGE_ALIGN(virt);
+    uint32_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint32_t replaced = 0;
+
+    if (global_pages && is_kernel_address(start)) {
+        flags |= PAGE_GLOBAL;
+    }
+
+    for (uint32_t done = 0; done < pages;) {
+        uint32_t va = start + done * PAGE_SIZE;
+        uint32_t* page_table = get_table(dir, va, flags);
+        if (page_table == NULL) {
+            break;
+        }
+
+        for (uint32_t i = PAGE_TABLE_INDEX(va); i < 1024 && done < pages; i++, done++) {
+            replaced |= page_table[i];
+            page_table[i] = (PAGE_ALIGN(phys) + done * PAGE_SIZE) | flags;
+        }
+        put_table(page_table);
+    }
+
+    if (replaced & PAGE_PRESENT) {
+        flush_range(dir, start, pages);
+    }
+}
+
+static int is_user_table(uint32_t pd_index) {
+    return pd_index >= PAGE_DIRECTORY_INDEX(USER_START) && pd_index < PAGE_DIRECTORY_INDEX(USER_END);
+}
+
+// Frees what unmap_range left for after the flush: the frames of the entries
+// it kept with PAGE_PRESENT cleared, and the user page tables it detached
+// the same way. Kernel tables are shared with every directory and stay.
+static void release_range(page_directory_t dir, uint32_t start, uint32_t pages) {
+    for (uint32_t done = 0; done < pages;) {
+        uint32_t va = start + done * PAGE_SIZE;
+        uint32_t pd_index = PAGE_DIRECTORY_INDEX(va);
+        uint32_t i = PAGE_TABLE_INDEX(va);
+        uint32_t count = 1024 - i < pages - done ? 1024 - i : pages - done;
+        uint32_t pde = dir[pd_index];
+        done += count;
+
+        if (pde == 0 || (pde & PAGE_LARGE)) {
+            continue;
+        }
+
+        uint32_t* page_table = pde & PAGE_PRESENT ? table_of(dir, pd_index) : vmm_map_temp(pde);
+        for (uint32_t end = i + count; i < end; i++) {
+            if (page_table[i] != 0) {
+                pmm_free_frame((void*)PAGE_ALIGN(page_table[i]));
+                page_table[i] = 0;
+            }
+        }
+        put_table(page_table);
+
+        if (!(pde & PAGE_PRESENT)) {
+            dir[pd_index] = 0;
+            pmm_free_frame((void*)PAGE_ALIGN(pde));
+        }
+    }
+}
+
+// Clears the entries of a range and detaches the user page tables left with
+// nothing mapped, then flushes once. Frames and tables are only freed after
+// the flush, so no stale TLB or paging-structure entry can reach them. With
+// free_frames the mapped frames lose a reference too.
+static void unmap_range(page_directory_t dir, uint32_t virt, uint32_t size, int free_frames) {
+    uint32_t start = PAGE_ALIGN(virt);
+    uint32_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    int detached = 0;
+
+    if (pages == 0) {
+        return;
+    }
+
+    for (uint32_t done = 0; done < pages;) {
+        uint32_t va = start + done * PAGE_SIZE;
+        uint32_t pd_index = PAGE_DIRECTORY_INDEX(va);
+        uint32_t i = PAGE_TABLE_INDEX(va);
+        uint32_t count = 1024 - i < pages - done ? 1024 - i : pages - done;
+        done += count;
+
+        if (!(dir[pd_index] & PAGE_PRESENT)) {
+            continue;
+        }
+
+        uint32_t* page_table = get_table(dir, va, 0);
+        if (page_table == NULL) {
+            continue;
+        }
+
+        // Frames to free keep their address until after the flush
+        for (uint32_t end = i + count; i < end; i++) {
+            uint32_t pte = page_table[i];
+            page_table[i] = free_frames && (pte & PAGE_PRESENT) ? pte & ~PAGE_PRESENT : 0;
+        }
+
+        int empty = is_user_table(pd_index);
+        for (i = 0; i < 1024 && empty; i++) {
+            empty = !(page_table[i] & PAGE_PRESENT);
+        }
+        put_table(page_table);
+
+        if (empty) {
+            dir[pd_index] &= ~PAGE_PRESENT;
+            detached = 1;
+        }
+    }
+
+    if (detached && dir == current_directory) {
+        // Also drops the detached tables from the recursive window
+        vmm_flush_tlb();
+    } else {
+        flush_range(dir, start, pages);
+    }
+
+    if (free_frames || detached) {
+        release_range(dir, start, pages);
+    }
+}
+
+// Unmaps size bytes a page table at a time with a single flush at the end.
+// Like vmm_unmap, the frames are left to the caller.
+void vmm_unmap_range(page_directory_t dir, uint32_t virt, uint32_t size) {
+    unmap_range(dir, virt, size, 0);
+}
+
+// Unmaps size bytes like vmm_unmap_range and drops a reference to every frame
+// that was mapped, once no TLB entry can reach it anymore
+void vmm_free_range(page_directory_t dir, uint32_t virt, uint32_t size) {
+    unmap_range(dir, virt, size, 1);
+}
+
+uint32_t vmm_get_pte(page_directory_t dir, uint32_t virt) {
+    uint32_t pd_index = PAGE_DIRECTORY_INDEX(virt);
+    uint32_t pt_index = PAGE_TABLE_INDEX(virt);
     
-    __asm__ __volatile__("invlpg (%0)" :: "r"(virt));
+    if (!(dir[pd_index] & PAGE_PRESENT)) {
+        return 0;
+    }
+    if (dir[pd_index] & PAGE_LARGE) {
+        return ((dir[pd_index] & 0xFFC00000) + pt_index * PAGE_SIZE) | (dir[pd_index] & 0xFFF & ~PAGE_LARGE);
+    }
+    
+    uint32_t* page_table = table_of(dir, pd_index);
+    uint32_t pte = page_table[pt_index];
+    put_table(page_table);
+    return pte;
+}
+
+static vmm_region_t* find_region_at(page_directory_t dir, uint32_t start) {
+    for (int i = 0; i < VMM_MAX_REGIONS; i++) {
+        if (regions[i].dir == dir && regions[i].start == start) {
+            return &regions[i];
+        }
+    }
+    return NULL;
+}
+
+// Regions of the kernel directory in the kernel windows are seen from every
+// address space, since those page tables are shared
+static vmm_region_t* find_region(uint32_t addr) {
+    int kernel = addr >= KERNEL_WINDOW_START;
+
+    for (int i = 0; i < VMM_MAX_REGIONS; i++) {
+        vmm_region_t* region = &regions[i];
+        if (region->dir == NULL || addr < region->start || addr >= region->end) {
+            continue;
+        }
+        if (region->dir == current_directory || (kernel && region->dir == kernel_page_directory)) {
+            return region;
+        }
+    }
+    return NULL;
+}
+
+// Write to a copy-on-write page of the active directory. The last owner just
+// gets write access back, others get a private copy.
+static int cow_fault(uint32_t addr) {
+    uint32_t page = PAGE_ALIGN(addr);
+    uint32_t pte = vmm_get_pte(current_directory, page);
+    if (!(pte & PAGE_COW)) {
+        return -1;
+    }
+
+    uint32_t frame = PAGE_ALIGN(pte);
+    if (pmm_get_frame_refs((void*)frame) > 1) {
+        uint32_t copy = (uint32_t)pmm_alloc_high_frame();
+        if (copy == 0) {
+            return -1;
+        }
+        void* dst = vmm_map_temp(copy);
+        memcpy(dst, (void*)page, PAGE_SIZE);
+        vmm_unmap_temp(dst);
+        pmm_free_frame((void*)frame);
+        frame = copy;
+    }
+
+    vmm_map(current_directory, page, frame, (pte & 0xFFF & ~PAGE_COW) | PAGE_RW);
+    vmm_flush_page(page);
+    return 0;
+}
+
+static void page_fault_handler(registers_t* regs) {
+    uint32_t addr;
+    __asm__ __volatile__("mov %%cr2, %0" : "=r"(addr));
+
+    if ((regs->err_code & (PF_PRESENT | PF_WRITE)) == (PF_PRESENT | PF_WRITE) && cow_fault(addr) == 0) {
+        return;
+    }
+
+    vmm_region_t* region = find_region(addr);
+    if (region != NULL && region->fault(region->dir, addr, regs->err_code, region->data) == 0) {
+        return;
+    }
+
+    printf("Page fault at 0x%x (eip 0x%x, error 0x%x)\n", addr, regs->eip, regs->err_code);
+    abort();
+}
+
+// Registers a lazy region of whole pages. Nothing is mapped until a page is
+// touched, then fault maps it. Returns -1 if the range overlaps another
+// region or no slot is free.
+int vmm_add_region(page_directory_t dir, uint32_t start, uint32_t end, vmm_fault_t fault, void* data) {
+    vmm_region_t* slot = NULL;
+
+    if ((start | end) & (PAGE_SIZE - 1) || end <= start) {
+        return -1;
+    }
+    for (int i = 0; i < VMM_MAX_REGIONS; i++) {
+        if (regions[i].dir == NULL) {
+            slot = slot ? slot : &regions[i];
+        } else if (regions[i].dir == dir && start < regions[i].end && end > regions[i].start) {
+            return -1;
+        }
+    }
+    if (slot == NULL) {
+        return -1;
+    }
+
+    slot->dir = dir;
+    slot->start = start;
+    slot->end = end;
+    slot->fault = fault;
+    slot->data = data;
+    return 0;
+}
+
+// The region data is the page flags
+static int zero_fault(page_directory_t dir, uint32_t addr, uint32_t error, void* data) {
+    if (error & PF_PRESENT) {
+        return -1;
+    }
+
+    uint32_t frame = (uint32_t)pmm_alloc_high_frame();
+    if (frame == 0) {
+        return -1;
+    }
+    void* page = vmm_map_temp(frame);
+    memset(page, 0, PAGE_SIZE);
+    vmm_unmap_temp(page);
+    vmm_map(dir, PAGE_ALIGN(addr), frame, (uint32_t)data);
+    return 0;
+}
+
+// Registers anonymous memory that reads as zeros. Frames are allocated and
+// mapped with flags on first touch.
+int vmm_add_zero_region(page_directory_t dir, uint32_t start, uint32_t end, uint32_t flags) {
+    return vmm_add_region(dir, start, end, zero_fault, (void*)(flags | PAGE_PRESENT));
+}
+
+// Unmaps the pages of a region, drops its references to their frames and
+// removes the region
+void vmm_remove_region(page_directory_t dir, uint32_t start) {
+    vmm_region_t* region = find_region_at(dir, start);
+    if (region == NULL) {
+        return;
+    }
+
+    vmm_free_range(dir, region->start, region->end - region->start);
+    region->dir = NULL;
+}
+
+// Creates an address space with the kernel mapped and no user pages. The
+// directory is in low memory, so the kernel edits it through the direct map.
+page_directory_t vmm_create_directory(void) {
+    uint32_t frame = (uint32_t)pmm_alloc_frame();
+    if (frame == 0) {
+        return NULL;
+    }
+
+    page_directory_t dir = PHYS_TO_VIRT(frame);
+    memset(dir, 0, PAGE_SIZE);
+    for (uint32_t i = PAGE_DIRECTORY_INDEX(KERNEL_BASE); i < RECURSIVE_INDEX; i++) {
+        dir[i] = kernel_page_directory[i];
+    }
+    dir[RECURSIVE_INDEX] = frame | PAGE_PRESENT | PAGE_RW;
+    return dir;
+}
+
+// Creates a copy of an address space that shares its user pages and regions.
+// Writable pages become read-only copy-on-write pages in both, so only pages
+// written afterwards are ever copied.
+page_directory_t vmm_clone_directory(page_directory_t src) {
+    page_directory_t dst = vmm_create_directory();
+    if (dst == NULL) {
+        return NULL;
+    }
+
+    for (uint32_t i = PAGE_DIRECTORY_INDEX(USER_START); i < PAGE_DIRECTORY_INDEX(USER_END); i++) {
+        if (!(src[i] & PAGE_PRESENT)) {
+            continue;
+        }
+
+        uint32_t frame = (uint32_t)pmm_alloc_high_frame();
+        if (frame == 0) {
+            vmm_destroy_directory(dst);
+            return NULL;
+        }
+
+        uint32_t* src_table = table_of(src, i);
+        uint32_t* table = vmm_map_temp(frame);
+        for (uint32_t j = 0; j < 1024; j++) {
+            uint32_t pte = src_table[j];
+            if (pte & PAGE_PRESENT) {
+                if (pte & PAGE_RW) {
+                    pte = (pte & ~PAGE_RW) | PAGE_COW;
+                    src_table[j] = pte;
+                }
+                pmm_ref_frame((void*)PAGE_ALIGN(pte));
+            }
+            table[j] = pte;
+        }
+        vmm_unmap_temp(table);
+        put_table(src_table);
+        dst[i] = frame | (src[i] & 0xFFF);
+    }
+
+    for (int i = 0; i < VMM_MAX_REGIONS; i++) {
+        if (regions[i].dir == src && regions[i].start >= USER_START && regions[i].start < USER_END &&
+            vmm_add_region(dst, regions[i].start, regions[i].end, regions[i].fault, regions[i].data) != 0) {
+            vmm_destroy_directory(dst);
+            return NULL;
+        }
+    }
+
+    // Pages of the source just lost write access
+    if (src == current_directory) {
+        vmm_flush_tlb();
+    }
+    return dst;
+}
+
+// Frees an address space with its regions and user page tables, dropping its
+// references to every frame mapped in user space. The kernel directory and
+// the active one are left alone.
+void vmm_destroy_directory(page_directory_t dir) {
+    if (dir == NULL || dir == kernel_page_directory || dir == current_directory) {
+        return;
+    }
+
+    for (int i = 0; i < VMM_MAX_REGIONS; i++) {
+        if (regions[i].dir == dir) {
+            regions[i].dir = NULL;
+        }
+    }
+
+    for (uint32_t i = PAGE_DIRECTORY_INDEX(USER_START); i < PAGE_DIRECTORY_INDEX(USER_END); i++) {
+        if (!(dir[i] & PAGE_PRESENT)) {
+            continue;
+        }
+
+        uint32_t* table = table_of(dir, i);
+        for (uint32_t j = 0; j < 1024; j++) {
+            if (table[j] & PAGE_PRESENT) {
+                pmm_free_frame((void*)PAGE_ALIGN(table[j]));
+            }
+        }
+        put_table(table);
+        pmm_free_frame((void*)PAGE_ALIGN(dir[i]));
+    }
+    pmm_free_frame((void*)VIRT_TO_PHYS(dir));
 }
 
 void vmm_switch_directory(page_directory_t dir) {
-    __asm__ __volatile__("mov %0, %%cr3" :: "r"(dir));
+    __asm__ __volatile__("mov %0, %%cr3" :: "r"(VIRT_TO_PHYS(dir)) : "memory");
+    current_directory = dir;
+}
+
+page_directory_t vmm_get_current_directory(void) {
+    return current_directory;
 }
 
 page_directory_t vmm_get_kernel_directory(void) {
     return kernel_page_directory;
 }
+
+// Whether kernel mappings are global pages
+int vmm_uses_global_pages(void) {
+    return global_pages;
+}
+
+// Whether PAGE_WC mappings are write-combining rather than write-through
+int vmm_uses_pat(void) {
+    return pat;
+}
+
+// Turns the global bit of kernel mappings on or off and returns whether it was
+// on. Changing PGE flushes the whole TLB. Only for measuring what it saves.
+int vmm_set_global_pages(int enable) {
+    if (!global_pages) {
+        return 0;
+    }
+
+    uint32_t cr4 = read_cr4();
+    write_cr4(enable ? cr4 | CR4_PGE : cr4 & ~CR4_PGE);
+    return (cr4 & CR4_PGE) != 0;
+}
+
+// Drops one page from the TLB, global or not
+void vmm_flush_page(uint32_t virt) {
+    __asm__ __volatile__("invlpg (%0)" :: "r"(virt) : "memory");
+}
+
+// Drops all non-global TLB entries, which is every user mapping
+void vmm_flush_tlb(void) {
+    __asm__ __volatile__("mov %0, %%cr3" :: "r"(VIRT_TO_PHYS(current_directory)) : "memory");
+}
+
+// Drops every TLB entry including the global kernel mappings
+void vmm_flush_tlb_global(void) {
+    uint32_t cr4 = read_cr4();
+    if (cr4 & CR4_PGE) {
+        write_cr4(cr4 & ~CR4_PGE);
+        write_cr4(cr4);
+    } else {
+        vmm_flush_tlb();
+    }
+}
@@ -0,0 +1,261 @@
+// Packs files into an initrd image for the kernel to use as a GRUB module.
+// Usage: mkinitrd [-z] <output> <file>...
+// Files are stored under their base name. The index is sorted so the kernel
+// can look names up with a binary search. With -z, files are compressed in
+// independent LZ4 blocks when that makes them smaller.
+
+#include "initrd.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HASH_BITS    16
+#define MIN_MATCH    4
+#define MAX_OFFSET   65535
+#define MF_LIMIT     12 // Matches must start this far from the block end
+#define LAST_LITERALS 5 // and end this far from it
+
+typedef struct {
+    const char* path;
+    const char* name;
+    uint8_t* data;
+    uint32_t size;
+    uint8_t* stored;    // Bytes written to the image
+    uint32_t stored_size;
+    uint32_t flags;
+} input_t;
+
+static void put32(uint8_t* p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static uint32_t get32(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint8_t* put_length(uint8_t* op, uint32_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+// Emits one sequence. A match length of zero emits the final literals only.
+static uint8_t* put_sequence(uint8_t* op, const uint8_t* lit, uint32_t lit_len,
+                             uint32_t offset, uint32_t match_len) {
+    uint8_t* token = op++;
+
+    *token = (lit_len >= 15 ? 15 : lit_len) << 4;
+    if (lit_len >= 15) {
+        op = put_length(op, lit_len - 15);
+    }
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+
+    if (match_len == 0) {
+        return op;
+    }
+
+    *op++ = offset;
+    *op++ = offset >> 8;
+
+    match_len -= MIN_MATCH;
+    *token |= match_len >= 15 ? 15 : match_len;
+    if (match_len >= 15) {
+        op = put_length(op, match_len - 15);
+    }
+    return op;
+}
+
+// Greedy single-probe LZ4 block compressor. dst must hold len + len / 255 + 16
+// bytes. Returns the compressed size.
+static uint32_t lz4_compress(const uint8_t* src, uint32_t len, uint8_t* dst) {
+    static uint32_t table[1 << HASH_BITS]; // Position + 1 of the last occurrence
+    uint32_t ip = 0;
+    uint32_t anchor = 0;
+    uint8_t* op = dst;
+
+    memset(table, 0, sizeof(table));
+
+    while (ip + MF_LIMIT <= len) {
+        uint32_t seq = get32(src + ip);
+        uint32_t hash = (seq * 2654435761u) >> (32 - HASH_BITS);
+        uint32_t ref = table[hash];
+        table[hash] = ip + 1;
+
+        if (ref == 0 || ip - (ref - 1) > MAX_OFFSET || get32(src + ref - 1) != seq) {
+            ip++;
+            continue;
+        }
+
+        ref--;
+        uint32_t match_len = MIN_MATCH;
+        while (ip + match_len < len - LAST_LITERALS && src[ref + match_len] == src[ip + match_len]) {
+            match_len++;
+        }
+
+        op = put_sequence(op, src + anchor, ip - anchor, ip - ref, match_len);
+        ip += match_len;
+        anchor = ip;
+    }
+
+    op = put_sequence(op, src + anchor, len - anchor, 0, 0);
+    return op - dst;
+}
+
+// Builds the block index and blocks. Falls back to storing the file as is when
+// compression does not make it smaller.
+static void compress_file(input_t* in) {
+    uint32_t blocks = (in->size + INITRD_BLOCK_SIZE - 1) / INITRD_BLOCK_SIZE;
+    uint32_t bound = blocks * 4 + in->size + blocks * (INITRD_BLOCK_SIZE / 255 + 16);
+    uint8_t* out = malloc(bound);
+    uint32_t pos = blocks * 4;
+
+    for (uint32_t i = 0; i < blocks; i++) {
+        const uint8_t* src = in->data + i * INITRD_BLOCK_SIZE;
+        uint32_t len = in->size - i * INITRD_BLOCK_SIZE;
+        if (len > INITRD_BLOCK_SIZE) {
+            len = INITRD_BLOCK_SIZE;
+        }
+
+        uint32_t packed = lz4_compress(src, len, out + pos);
+        if (packed >= len) {
+            memcpy(out + pos, src, len);
+            put32(out + i * 4, len | INITRD_BLOCK_RAW);
+            pos += len;
+        } else {
+            put32(out + i * 4, packed);
+            pos += packed;
+        }
+    }
+
+    if (pos >= in->size) {
+        free(out);
+        return;
+    }
+
+    in->stored = out;
+    in->stored_size = pos;
+    in->flags = INITRD_LZ4;
+}
+
+static int compare_names(const void* a, const void* b) {
+    return strcmp(((const input_t*)a)->name, ((const input_t*)b)->name);
+}
+
+static int load_file(input_t* in) {
+    FILE* f = fopen(in->path, "rb");
+    if (!f) {
+        perror(in->path);
+        return -1;
+    }
+
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    in->size = size;
+    in->data = malloc(size ? size : 1);
+    if (!in->data || fread(in->data, 1, size, f) != (size_t)size) {
+        fprintf(stderr, "%s: read failed\n", in->path);
+        fclose(f);
+        return -1;
+    }
+
+    in->stored = in->data;
+    in->stored_size = in->size;
+    fclose(f);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    int compress = argc > 1 && strcmp(argv[1], "-z") == 0;
+    argv += compress;
+    argc -= compress;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: mkinitrd [-z] <output> <file>...\n");
+        return 1;
+    }
+
+    uint32_t count = argc - 2;
+    input_t* inputs = calloc(count ? count : 1, sizeof(input_t));
+
+    for (uint32_t i = 0; i < count; i++) {
+        const char* slash = strrchr(argv[i + 2], '/');
+        inputs[i].path = argv[i + 2];
+        inputs[i].name = slash ? slash + 1 : argv[i + 2];
+
+        if (strlen(inputs[i].name) >= INITRD_NAME_MAX) {
+            fprintf(stderr, "%s: name too long\n", inputs[i].path);
+            return 1;
+        }
+        if (load_file(&inputs[i]) != 0) {
+            return 1;
+        }
+        if (compress) {
+            compress_file(&inputs[i]);
+        }
+    }
+
+    qsort(inputs, count, sizeof(input_t), compare_names);
+
+    for (uint32_t i = 1; i < count; i++) {
+        if (strcmp(inputs[i - 1].name, inputs[i].name) == 0) {
+            fprintf(stderr, "%s: duplicate name\n", inputs[i].name);
+            return 1;
+        }
+    }
+
+    // Header and index, then file data at aligned offsets
+    uint32_t index_size = sizeof(initrd_header_t) + count * sizeof(initrd_entry_t);
+    uint32_t offset = index_size;
+    uint32_t unpacked = 0;
+    uint8_t* index = calloc(1, index_size);
+
+    put32(index, INITRD_MAGIC);
+    put32(index + 4, count);
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t* entry = index + sizeof(initrd_header_t) + i * sizeof(initrd_entry_t);
+
+        offset = (offset + INITRD_ALIGN - 1) & ~(INITRD_ALIGN - 1);
+        memcpy(entry, inputs[i].name, strlen(inputs[i].name));
+        put32(entry + INITRD_NAME_MAX, offset);
+        put32(entry + INITRD_NAME_MAX + 4, inputs[i].size);
+        put32(entry + INITRD_NAME_MAX + 8, inputs[i].stored_size);
+        put32(entry + INITRD_NAME_MAX + 12, inputs[i].flags);
+        offset += inputs[i].stored_size;
+        unpacked += inputs[i].size;
+    }
+
+    FILE* out = fopen(argv[1], "wb");
+    if (!out) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    static const uint8_t zero[INITRD_ALIGN];
+    uint32_t pos = index_size;
+    fwrite(index, 1, index_size, out);
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t pad = ((pos + INITRD_ALIGN - 1) & ~(INITRD_ALIGN - 1)) - pos;
+        fwrite(zero, 1, pad, out);
+        fwrite(inputs[i].stored, 1, inputs[i].stored_size, out);
+        pos += pad + inputs[i].stored_size;
+    }
+
+    if (fclose(out) != 0) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    printf("%s: %u files, %u bytes (%u bytes unpacked)\n", argv[1], count, pos, unpacked);
+    return 0;
+}